@@ -0,0 +1,88 @@
+// Runs the mock Gemini API server until interrupted, for trying out
+// moodle-gift-gen offline:
+//
+//   mock-gemini-server --port 8765 --latency 500 &
+//   moodle-gift-gen --base-url http://127.0.0.1:8765 --files notes.pdf
+#include "mock_gemini_server.hpp"
+
+#include <csignal>
+#include <iostream>
+#include <pthread.h>
+#include <string>
+
+void print_usage(const char *program_name)
+{
+  std::cout << "Usage: " << program_name << " [OPTIONS]"
+            << R"(
+
+Options:
+  --help               Show this help message and exit
+  --port N             Port to listen on, on 127.0.0.1 (default: 8765)
+  --latency MS         Delay before each generation response (default: 0)
+  --file-latency MS    Delay before each upload, status, cache or delete
+                       response (default: 0)
+  --error-rate P       Fraction of requests answered with HTTP 503, between 0
+                       and 1 (default: 0)
+  --payload-bytes N    Padding added to the explanation of each generated
+                       question (default: 0)
+)";
+}
+
+int main(int argc, char *argv[])
+{
+  MockGeminiOptions options;
+  options.port = 8765;
+
+  try
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const std::string arg = argv[i];
+      if (arg == "--help")
+      {
+        print_usage(argv[0]);
+        return 0;
+      }
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("Unknown option, or missing value: " + arg);
+      }
+      const std::string value = argv[++i];
+
+      if (arg == "--port")
+        options.port = std::stoi(value);
+      else if (arg == "--latency")
+        options.latency = std::chrono::milliseconds(std::stol(value));
+      else if (arg == "--file-latency")
+        options.file_latency = std::chrono::milliseconds(std::stol(value));
+      else if (arg == "--error-rate")
+        options.error_rate = std::stod(value);
+      else if (arg == "--payload-bytes")
+        options.payload_bytes = std::stoul(value);
+      else
+        throw std::runtime_error("Unknown option: " + arg);
+    }
+
+    // Only the main thread takes the signals which stop the server
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    MockGeminiServer server(options);
+    std::cout << "Mock Gemini API listening on " << server.base_url()
+              << std::endl;
+
+    int signal = 0;
+    sigwait(&signals, &signal);
+    server.stop();
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,720 @@
+// A local stand-in for the parts of the Gemini API which moodle-gift-gen uses:
+// file uploads (multipart and resumable), file status, context caches,
+// generateContent, streamGenerateContent and file deletion. Responses can be delayed, made to
+// fail and padded out, so the tool can be measured without a network or quota.
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct MockGeminiOptions
+{
+  int port = 0; // Any free port
+  std::chrono::milliseconds latency{0};      // Before each generation response
+  std::chrono::milliseconds file_latency{0}; // Before each file response
+  double error_rate = 0; // Fraction of requests answered with HTTP 503
+  size_t payload_bytes = 0; // Padding added to each question's explanation
+};
+
+// A request served, for the benchmark's statistics
+struct MockRequestRecord
+{
+  std::string phase; // "upload", "status", "cache", "generate", "stream" or
+                     // "delete"
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+  int status = 0;
+};
+
+class MockGeminiServer
+{
+public:
+  explicit MockGeminiServer(const MockGeminiOptions &options)
+      : options_(options), random_(std::random_device{}())
+  {
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0)
+    {
+      throw std::runtime_error("Failed to create the mock server socket");
+    }
+    int reuse = 1;
+    ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(options.port));
+    socklen_t length = sizeof(address);
+    if (::bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), length) <
+            0 ||
+        ::listen(listen_fd_, 1024) < 0 ||
+        ::getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&address),
+                      &length) < 0)
+    {
+      ::close(listen_fd_);
+      throw std::runtime_error("Failed to listen on port " +
+                               std::to_string(options.port));
+    }
+    port_ = ntohs(address.sin_port);
+
+    accept_thread_ = std::thread([this] { accept_connections(); });
+  }
+
+  ~MockGeminiServer() { stop(); }
+
+  MockGeminiServer(const MockGeminiServer &) = delete;
+  MockGeminiServer &operator=(const MockGeminiServer &) = delete;
+
+  int port() const { return port_; }
+
+  std::string base_url() const
+  {
+    return "http://127.0.0.1:" + std::to_string(port_);
+  }
+
+  void stop()
+  {
+    if (stopping_.exchange(true))
+      return;
+
+    ::shutdown(listen_fd_, SHUT_RDWR);
+    ::close(listen_fd_);
+    accept_thread_.join();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (int fd : connections_)
+      ::shutdown(fd, SHUT_RDWR);
+    closed_.wait(lock, [this] { return connections_.empty(); });
+  }
+
+  // The requests served since the last call
+  std::vector<MockRequestRecord> take_records()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<MockRequestRecord> records;
+    records.swap(records_);
+    return records;
+  }
+
+private:
+  struct Request
+  {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> query;
+    std::map<std::string, std::string> headers; // Lowercase names
+    std::string body;
+    std::chrono::steady_clock::time_point received; // Of the headers
+  };
+
+  struct Response
+  {
+    int status = 200;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    std::vector<std::string> events; // Server-sent events, if streaming
+  };
+
+  struct UploadSession
+  {
+    uint64_t size = 0;
+    uint64_t received = 0;
+    std::string mime_type;
+    std::string file_name; // Once finalized
+  };
+
+  void accept_connections()
+  {
+    while (!stopping_)
+    {
+      const int fd = ::accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0)
+      {
+        if (stopping_)
+          return;
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      connections_.insert(fd);
+      std::thread([this, fd] { serve(fd); }).detach();
+    }
+  }
+
+  void serve(const int fd)
+  {
+    std::string buffer;
+    Request request;
+    while (!stopping_ && read_request(fd, buffer, request))
+    {
+      MockRequestRecord record;
+      record.start = request.received;
+      record.phase = phase_of(request);
+
+      const Response response = handle(request);
+      record.status = response.status;
+      const bool written = write_response(fd, response);
+      record.end = std::chrono::steady_clock::now();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        records_.push_back(std::move(record));
+      }
+      if (!written)
+        break;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    connections_.erase(fd);
+    ::close(fd);
+    closed_.notify_all();
+  }
+
+  static bool receive(const int fd, std::string &buffer)
+  {
+    char chunk[65536];
+    const ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0)
+      return false;
+    buffer.append(chunk, static_cast<size_t>(n));
+    return true;
+  }
+
+  static bool send_all(const int fd, const std::string &data)
+  {
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+      const ssize_t n =
+          ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0)
+        return false;
+      sent += static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  // Reads the next request of the connection; buffer carries over any bytes
+  // of the request after it
+  static bool read_request(const int fd, std::string &buffer,
+                           Request &request)
+  {
+    size_t header_end;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+    {
+      if (!receive(fd, buffer))
+        return false;
+    }
+
+    request = Request{};
+    request.received = std::chrono::steady_clock::now();
+    size_t line_end = buffer.find("\r\n");
+    const std::string request_line = buffer.substr(0, line_end);
+    const size_t method_end = request_line.find(' ');
+    const size_t target_end = request_line.find(' ', method_end + 1);
+    if (method_end == std::string::npos || target_end == std::string::npos)
+      return false;
+    request.method = request_line.substr(0, method_end);
+    const std::string target =
+        request_line.substr(method_end + 1, target_end - method_end - 1);
+
+    const size_t query_start = target.find('?');
+    request.path = target.substr(0, query_start);
+    if (query_start != std::string::npos)
+    {
+      std::string query = target.substr(query_start + 1);
+      size_t start = 0;
+      while (start <= query.size())
+      {
+        size_t end = query.find('&', start);
+        if (end == std::string::npos)
+          end = query.size();
+        const std::string pair = query.substr(start, end - start);
+        const size_t equals = pair.find('=');
+        if (equals != std::string::npos)
+          request.query[pair.substr(0, equals)] = pair.substr(equals + 1);
+        start = end + 1;
+      }
+    }
+
+    while (line_end < header_end)
+    {
+      const size_t start = line_end + 2;
+      line_end = buffer.find("\r\n", start);
+      const std::string line = buffer.substr(start, line_end - start);
+      const size_t colon = line.find(':');
+      if (colon == std::string::npos)
+        continue;
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      const size_t value_start = line.find_first_not_of(' ', colon + 1);
+      request.headers[name] =
+          value_start == std::string::npos ? "" : line.substr(value_start);
+    }
+    buffer.erase(0, header_end + 4);
+
+    if (request.headers["expect"] == "100-continue" &&
+        !send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n"))
+      return false;
+
+    if (request.headers["transfer-encoding"] == "chunked")
+    {
+      while (true)
+      {
+        size_t size_end;
+        while ((size_end = buffer.find("\r\n")) == std::string::npos)
+        {
+          if (!receive(fd, buffer))
+            return false;
+        }
+        const size_t size = std::stoul(buffer.substr(0, size_end), nullptr, 16);
+        while (buffer.size() < size_end + 2 + size + 2)
+        {
+          if (!receive(fd, buffer))
+            return false;
+        }
+        request.body.append(buffer, size_end + 2, size);
+        buffer.erase(0, size_end + 2 + size + 2);
+        if (size == 0)
+          return true;
+      }
+    }
+
+    const size_t length = request.headers.count("content-length")
+                              ? std::stoul(request.headers["content-length"])
+                              : 0;
+    while (buffer.size() < length)
+    {
+      if (!receive(fd, buffer))
+        return false;
+    }
+    request.body = buffer.substr(0, length);
+    buffer.erase(0, length);
+    return true;
+  }
+
+  static bool write_response(const int fd, const Response &response)
+  {
+    std::string head = "HTTP/1.1 " + std::to_string(response.status) +
+                       (response.status < 400 ? " OK" : " Error") + "\r\n";
+    for (const auto &[name, value] : response.headers)
+      head += name + ": " + value + "\r\n";
+
+    if (response.events.empty())
+    {
+      head += "Content-Type: application/json\r\nContent-Length: " +
+              std::to_string(response.body.size()) + "\r\n\r\n";
+      return send_all(fd, head + response.body);
+    }
+
+    head += "Content-Type: text/event-stream\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n";
+    if (!send_all(fd, head))
+      return false;
+    for (const auto &event : response.events)
+    {
+      const std::string data = "data: " + event + "\r\n\r\n";
+      char size[32];
+      std::snprintf(size, sizeof(size), "%zx\r\n", data.size());
+      if (!send_all(fd, size + data + "\r\n"))
+        return false;
+    }
+    return send_all(fd, "0\r\n\r\n");
+  }
+
+  static std::string phase_of(const Request &request)
+  {
+    if (request.path.rfind("/upload/", 0) == 0)
+      return "upload";
+    if (request.path.rfind("/v1beta/cachedContents", 0) == 0)
+      return "cache";
+    if (request.method == "DELETE")
+      return "delete";
+    if (request.method == "GET")
+      return "status";
+    if (request.path.find(":streamGenerateContent") != std::string::npos)
+      return "stream";
+    return "generate";
+  }
+
+  static Response error(const int code, const std::string &message,
+                        const std::string &status)
+  {
+    Response response;
+    response.status = code;
+    response.body = nlohmann::json{{"error",
+                                    {{"code", code},
+                                     {"message", message},
+                                     {"status", status}}}}
+                        .dump();
+    return response;
+  }
+
+  Response handle(const Request &request)
+  {
+    const std::string phase = phase_of(request);
+    const bool generation = phase == "generate" || phase == "stream";
+    std::this_thread::sleep_for(generation ? options_.latency
+                                           : options_.file_latency);
+
+    if (options_.error_rate > 0)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (std::uniform_real_distribution<double>(0, 1)(random_) <
+          options_.error_rate)
+        return error(503, "The model is overloaded.", "UNAVAILABLE");
+    }
+
+    if (phase == "upload")
+      return handle_upload(request);
+
+    if (phase == "cache")
+      return handle_cache(request);
+
+    if (phase == "status" && request.path == "/v1beta/files")
+      return list_files(request);
+
+    if (phase == "status" || phase == "delete")
+    {
+      const std::string prefix = "/v1beta/files/";
+      const std::string id = request.path.rfind(prefix, 0) == 0
+                                 ? request.path.substr(prefix.size())
+                                 : "";
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = files_.find(id);
+      if (it == files_.end())
+        return error(404, "File " + id + " not found", "NOT_FOUND");
+      Response response;
+      if (phase == "delete")
+      {
+        files_.erase(it);
+        response.body = "{}";
+      }
+      else
+      {
+        response.body = it->second.dump();
+      }
+      return response;
+    }
+
+    if (request.path.rfind("/v1beta/models/", 0) != 0)
+      return error(404, "No such method: " + request.path, "NOT_FOUND");
+    return handle_generation(request, phase == "stream");
+  }
+
+  // Lists the files a page at a time; the page token is the last ID listed
+  Response list_files(const Request &request)
+  {
+    size_t page_size = 100;
+    auto size = request.query.find("pageSize");
+    if (size != request.query.end())
+      page_size = std::max<size_t>(1, std::stoul(size->second));
+    auto token = request.query.find("pageToken");
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = token == request.query.end() ? files_.begin()
+                                           : files_.upper_bound(token->second);
+    nlohmann::json files = nlohmann::json::array();
+    for (; it != files_.end() && files.size() < page_size; ++it)
+      files.push_back(it->second);
+
+    nlohmann::json body = {{"files", files}};
+    if (it != files_.end())
+      body["nextPageToken"] = files.back()["name"].get<std::string>().substr(6);
+    Response response;
+    response.body = body.dump();
+    return response;
+  }
+
+  // Returns the description of a new file, as in upload responses
+  nlohmann::json add_file(const uint64_t size, const std::string &mime_type)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::string id = "mock" + std::to_string(next_id_++);
+    nlohmann::json file = {{"name", "files/" + id},
+                           {"uri", base_url() + "/v1beta/files/" + id},
+                           {"mimeType", mime_type},
+                           {"sizeBytes", std::to_string(size)},
+                           {"state", "ACTIVE"},
+                           {"expirationTime", "2099-01-01T00:00:00Z"}};
+    files_[id] = file;
+    return file;
+  }
+
+  Response handle_upload(const Request &request)
+  {
+    auto header = [&request](const std::string &name)
+    {
+      auto it = request.headers.find(name);
+      return it == request.headers.end() ? std::string() : it->second;
+    };
+    const std::string command = header("x-goog-upload-command");
+    Response response;
+
+    if (header("x-goog-upload-protocol") == "resumable" && command == "start")
+    {
+      UploadSession session;
+      session.size = std::stoull("0" + header("x-goog-upload-header-content-"
+                                              "length"));
+      session.mime_type = header("x-goog-upload-header-content-type");
+      std::lock_guard<std::mutex> lock(mutex_);
+      const std::string id = "upload" + std::to_string(next_id_++);
+      sessions_[id] = session;
+      response.headers = {
+          {"X-Goog-Upload-URL",
+           base_url() + "/upload/v1beta/files?upload_id=" + id},
+          {"X-Goog-Upload-Status", "active"}};
+      response.body = "{}";
+      return response;
+    }
+
+    auto upload_id = request.query.find("upload_id");
+    if (upload_id == request.query.end())
+    {
+      // Multipart: the file is the body, less the metadata and boundaries
+      auto type = request.headers.find("content-type");
+      return {200, {},
+              nlohmann::json{
+                  {"file",
+                   add_file(request.body.size(),
+                            type == request.headers.end() ? ""
+                                                          : type->second)}}
+                  .dump(),
+              {}};
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = sessions_.find(upload_id->second);
+    if (it == sessions_.end())
+      return error(404, "No such upload", "NOT_FOUND");
+    UploadSession &session = it->second;
+
+    if (command == "query" || !session.file_name.empty())
+    {
+      if (!session.file_name.empty())
+      {
+        response.headers = {{"X-Goog-Upload-Status", "final"}};
+        response.body = nlohmann::json{{"file", files_[session.file_name]}}
+                            .dump();
+        return response;
+      }
+      response.headers = {
+          {"X-Goog-Upload-Status", "active"},
+          {"X-Goog-Upload-Size-Received", std::to_string(session.received)}};
+      response.body = "{}";
+      return response;
+    }
+
+    if (std::stoull("0" + header("x-goog-upload-offset")) != session.received)
+      return error(400, "Offset does not match the data received",
+                   "INVALID_ARGUMENT");
+    session.received += request.body.size();
+
+    if (command.find("finalize") == std::string::npos)
+    {
+      response.headers = {{"X-Goog-Upload-Status", "active"}};
+      response.body = "{}";
+      return response;
+    }
+
+    const uint64_t size = session.received;
+    const std::string mime_type = session.mime_type;
+    lock.unlock();
+    nlohmann::json file = add_file(size, mime_type);
+    lock.lock();
+    sessions_[upload_id->second].file_name =
+        file["name"].get<std::string>().substr(6);
+    response.headers = {{"X-Goog-Upload-Status", "final"}};
+    response.body = nlohmann::json{{"file", file}}.dump();
+    return response;
+  }
+
+  // Creates (POST), describes (GET) or deletes (DELETE) a context cache. Its
+  // token count is taken to be a quarter of the size of its contents.
+  Response handle_cache(const Request &request)
+  {
+    const std::string prefix = "/v1beta/cachedContents/";
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (request.method == "POST")
+    {
+      const nlohmann::json body =
+          nlohmann::json::parse(request.body, nullptr, false);
+      if (body.is_discarded() || !body.contains("model") ||
+          !body.contains("contents"))
+        return error(400, "A cache needs a model and contents",
+                     "INVALID_ARGUMENT");
+
+      const std::string ttl = body.value("ttl", "3600s");
+      const std::time_t expiry =
+          std::time(nullptr) + std::stol("0" + ttl.substr(0, ttl.size() - 1));
+      char expire_time[32];
+      std::tm tm;
+      gmtime_r(&expiry, &tm);
+      std::strftime(expire_time, sizeof(expire_time), "%Y-%m-%dT%H:%M:%SZ",
+                    &tm);
+
+      const std::string id = "cache" + std::to_string(next_id_++);
+      nlohmann::json cache = {
+          {"name", "cachedContents/" + id},
+          {"model", body["model"]},
+          {"expireTime", expire_time},
+          {"usageMetadata", {{"totalTokenCount", request.body.size() / 4}}}};
+      caches_[id] = cache;
+      return {200, {}, cache.dump(), {}};
+    }
+
+    const std::string id = request.path.rfind(prefix, 0) == 0
+                               ? request.path.substr(prefix.size())
+                               : "";
+    auto it = caches_.find(id);
+    if (it == caches_.end())
+      return error(404, "Cached content " + id + " not found", "NOT_FOUND");
+    Response response;
+    if (request.method == "DELETE")
+    {
+      caches_.erase(it);
+      response.body = "{}";
+    }
+    else
+    {
+      response.body = it->second.dump();
+    }
+    return response;
+  }
+
+  // The number of questions asked for by "generate N multiple choice
+  // questions", as in the tool's queries
+  static int requested_questions(const std::string &body)
+  {
+    const nlohmann::json request = nlohmann::json::parse(body, nullptr, false);
+    std::string text;
+    if (!request.is_discarded() && request.contains("contents"))
+    {
+      for (const auto &part : request["contents"][0].value(
+               "parts", nlohmann::json::array()))
+      {
+        if (part.contains("text"))
+          text = part["text"].get<std::string>();
+      }
+    }
+
+    const std::string marker = "generate ";
+    const size_t at = text.find(marker);
+    if (at == std::string::npos ||
+        !std::isdigit(static_cast<unsigned char>(text[at + marker.size()])))
+      return 5;
+    return std::max(1, std::stoi(text.substr(at + marker.size())));
+  }
+
+  Response handle_generation(const Request &request, const bool stream)
+  {
+    // A request through a context cache also counts the cache's tokens
+    int64_t cached_tokens = 0;
+    const nlohmann::json body =
+        nlohmann::json::parse(request.body, nullptr, false);
+    if (!body.is_discarded() && body.contains("cachedContent"))
+    {
+      const std::string name = body["cachedContent"];
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = caches_.find(name.substr(name.find('/') + 1));
+      if (it == caches_.end())
+        return error(404, "Cached content " + name + " not found",
+                     "NOT_FOUND");
+      const std::string version = "/v1beta/";
+      const std::string model = request.path.substr(
+          version.size(), request.path.find(':') - version.size());
+      if (it->second["model"] != model)
+        return error(400, "The model does not match the cached content's",
+                     "INVALID_ARGUMENT");
+      cached_tokens = it->second["usageMetadata"]["totalTokenCount"];
+    }
+
+    const int count = requested_questions(request.body);
+    nlohmann::json questions = nlohmann::json::array();
+    for (int i = 0; i < count; ++i)
+    {
+      const std::string n = std::to_string(i + 1);
+      questions.push_back(
+          {{"title", "Mock " + n},
+           {"question", "Which option of question " + n + " is {correct}?"},
+           {"options", {"a: first", "b = second", "c ~ third", "d # fourth"}},
+           {"correct_answer", i % 4},
+           {"explanation",
+            "Option " + std::to_string(i % 4 + 1) + " is correct." +
+                std::string(options_.payload_bytes, '.')}});
+    }
+    const std::string text =
+        nlohmann::json{{"category", "Mock Quiz"}, {"questions", questions}}
+            .dump();
+
+    auto candidate = [](const std::string &part)
+    {
+      return nlohmann::json{
+          {"candidates",
+           {{{"content", {{"parts", {{{"text", part}}}}, {"role", "model"}}},
+             {"finishReason", "STOP"}}}}};
+    };
+
+    nlohmann::json usage = {
+        {"promptTokenCount", request.body.size() / 4 + cached_tokens},
+        {"candidatesTokenCount", text.size() / 4}};
+    if (cached_tokens > 0)
+      usage["cachedContentTokenCount"] = cached_tokens;
+
+    Response response;
+    if (!stream)
+    {
+      nlohmann::json body = candidate(text);
+      body["usageMetadata"] = usage;
+      response.body = body.dump();
+      return response;
+    }
+
+    // As the API does, the last event carries the usage of the whole stream
+    const size_t fragment = 256;
+    for (size_t i = 0; i < text.size(); i += fragment)
+    {
+      nlohmann::json event = candidate(text.substr(i, fragment));
+      if (i + fragment >= text.size())
+        event["usageMetadata"] = usage;
+      response.events.push_back(event.dump());
+    }
+    return response;
+  }
+
+  MockGeminiOptions options_;
+  int listen_fd_ = -1;
+  int port_ = 0;
+  std::atomic<bool> stopping_{false};
+  std::thread accept_thread_;
+
+  std::mutex mutex_;
+  std::mt19937 random_;
+  std::condition_variable closed_;
+  std::set<int> connections_; // Each served by a detached thread
+  std::vector<MockRequestRecord> records_;
+  std::map<std::string, nlohmann::json> files_;
+  std::map<std::string, nlohmann::json> caches_;
+  std::map<std::string, UploadSession> sessions_;
+  uint64_t next_id_ = 1;
+};
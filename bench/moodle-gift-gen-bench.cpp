@@ -0,0 +1,297 @@
+// Benchmarks moodle-gift-gen end to end against the mock Gemini API server:
+// each run generates a quiz of M questions from N files, and the latencies of
+// the requests in each phase (upload, generate, ...) and of whole runs are
+// reported as percentiles, with the overall throughput. Nothing leaves the
+// machine, so the numbers can be compared between builds.
+#include "mock_gemini_server.hpp"
+
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+struct BenchOptions
+{
+  std::string tool;
+  int files = 20;
+  uintmax_t file_size = 64 * 1024;
+  int questions = 10;
+  int runs = 10;
+  MockGeminiOptions server;
+  std::vector<std::string> tool_args; // Passed through after "--"
+};
+
+void print_usage(const char *program_name)
+{
+  std::cout << "Usage: " << program_name
+            << " --tool PATH [OPTIONS] [-- TOOL OPTIONS]"
+            << R"(
+
+Options:
+  --help               Show this help message and exit
+  --tool PATH          The moodle-gift-gen executable to benchmark
+  --files N            Files per run (default: 20)
+  --file-size KB       Size of each file (default: 64)
+  --questions M        Questions per run (default: 10)
+  --runs R             Number of runs (default: 10)
+  --latency MS         Mock delay before each generation response
+                       (default: 200)
+  --file-latency MS    Mock delay before each upload, status or delete
+                       response (default: 5)
+  --error-rate P       Fraction of requests the mock fails with HTTP 503
+                       (default: 0)
+  --payload-bytes N    Padding added to each generated question's explanation
+                       (default: 0)
+
+Options after "--" are passed to every run of the tool, e.g. -- --shards 4
+)";
+}
+
+BenchOptions parse_command_line(int argc, char *argv[])
+{
+  BenchOptions options;
+  options.server.latency = std::chrono::milliseconds(200);
+  options.server.file_latency = std::chrono::milliseconds(5);
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    if (arg == "--")
+    {
+      options.tool_args.assign(argv + i + 1, argv + argc);
+      break;
+    }
+    if (i + 1 >= argc)
+    {
+      throw std::runtime_error("Unknown option, or missing value: " + arg);
+    }
+    const std::string value = argv[++i];
+
+    if (arg == "--tool")
+      options.tool = value;
+    else if (arg == "--files")
+      options.files = std::stoi(value);
+    else if (arg == "--file-size")
+      options.file_size = std::stoull(value) * 1024;
+    else if (arg == "--questions")
+      options.questions = std::stoi(value);
+    else if (arg == "--runs")
+      options.runs = std::stoi(value);
+    else if (arg == "--latency")
+      options.server.latency = std::chrono::milliseconds(std::stol(value));
+    else if (arg == "--file-latency")
+      options.server.file_latency = std::chrono::milliseconds(std::stol(value));
+    else if (arg == "--error-rate")
+      options.server.error_rate = std::stod(value);
+    else if (arg == "--payload-bytes")
+      options.server.payload_bytes = std::stoul(value);
+    else
+      throw std::runtime_error("Unknown option: " + arg);
+  }
+
+  if (options.tool.empty())
+  {
+    throw std::runtime_error("--tool is required");
+  }
+  if (options.files < 0 || options.questions <= 0 || options.runs <= 0)
+  {
+    throw std::runtime_error(
+        "--files, --questions and --runs must be positive");
+  }
+  return options;
+}
+
+// Distinct text files, so each run uploads every one of them
+std::vector<std::string> write_input_files(const std::filesystem::path &dir,
+                                           const int count,
+                                           const uintmax_t size)
+{
+  std::vector<std::string> filenames;
+  for (int i = 0; i < count; ++i)
+  {
+    const std::filesystem::path path =
+        dir / ("input-" + std::to_string(i + 1) + ".txt");
+    std::ofstream file(path, std::ios::binary);
+    const std::string line = "Benchmark input " + std::to_string(i + 1) +
+                             ": the quick brown fox jumps over the lazy dog.\n";
+    for (uintmax_t written = 0; written < size; written += line.size())
+      file.write(line.data(),
+                 std::streamsize(std::min<uintmax_t>(line.size(),
+                                                     size - written)));
+    filenames.push_back(path.string());
+  }
+  return filenames;
+}
+
+// Runs the tool to completion; returns its exit status
+int run_tool(const std::vector<std::string> &args,
+             const std::filesystem::path &cache_dir)
+{
+  const pid_t pid = fork();
+  if (pid < 0)
+  {
+    throw std::runtime_error("Failed to start " + args[0]);
+  }
+
+  if (pid == 0)
+  {
+    setenv("GEMINI_API_KEY", "bench", 1);
+    setenv("MOODLE_GIFT_GEN_CACHE_DIR", cache_dir.c_str(), 1);
+    std::vector<char *> argv;
+    for (const auto &arg : args)
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+// Nearest-rank percentile of sorted values
+double percentile(const std::vector<double> &sorted, const double p)
+{
+  if (sorted.empty())
+    return 0;
+  const size_t rank = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+  return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+void print_row(const std::string &name, std::vector<double> &milliseconds)
+{
+  std::sort(milliseconds.begin(), milliseconds.end());
+  std::cout << std::left << std::setw(10) << name << std::right
+            << std::setw(10) << milliseconds.size() << std::fixed
+            << std::setprecision(1);
+  for (const double p : {50.0, 95.0, 99.0})
+    std::cout << std::setw(10) << percentile(milliseconds, p);
+  std::cout << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (std::string(argv[1]) == "--help")
+  {
+    print_usage(argv[0]);
+    return 0;
+  }
+
+  std::filesystem::path work_dir;
+  try
+  {
+    const BenchOptions options = parse_command_line(argc, argv);
+
+    work_dir = std::filesystem::temp_directory_path() /
+               ("moodle-gift-gen-bench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(work_dir / "cache");
+    const std::vector<std::string> files =
+        write_input_files(work_dir, options.files, options.file_size);
+
+    MockGeminiServer server(options.server);
+
+    // Both caches are bypassed, so every run uploads and generates afresh
+    std::vector<std::string> args = {
+        std::filesystem::absolute(options.tool).string(),
+        "--base-url",
+        server.base_url(),
+        "--num-questions",
+        std::to_string(options.questions),
+        "--output",
+        (work_dir / "quiz.gift").string(),
+        "--quiet",
+        "--no-cache",
+        "--no-upload-cache",
+        "--retry-delay",
+        "50"};
+    if (!files.empty())
+    {
+      args.push_back("--files");
+      args.insert(args.end(), files.begin(), files.end());
+    }
+    args.insert(args.end(), options.tool_args.begin(), options.tool_args.end());
+
+    std::cout << "Benchmarking " << options.runs << " runs of "
+              << options.files << " files x " << options.questions
+              << " questions against " << server.base_url() << std::endl;
+
+    std::map<std::string, std::vector<double>> phases;
+    std::vector<double> runs;
+    std::map<int, int> statuses;
+    int failed_runs = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.runs; ++i)
+    {
+      const auto run_start = std::chrono::steady_clock::now();
+      if (run_tool(args, work_dir / "cache") != 0)
+        ++failed_runs;
+      runs.push_back(std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - run_start)
+                         .count());
+
+      for (const auto &record : server.take_records())
+      {
+        phases[record.phase].push_back(
+            std::chrono::duration<double, std::milli>(record.end - record.start)
+                .count());
+        ++statuses[record.status];
+      }
+    }
+    const double elapsed =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+            .count();
+
+    std::cout << "\n"
+              << std::left << std::setw(10) << "phase" << std::right
+              << std::setw(10) << "requests" << std::setw(10) << "p50 ms"
+              << std::setw(10) << "p95 ms" << std::setw(10) << "p99 ms"
+              << std::endl;
+    for (const char *phase :
+         {"upload", "status", "cache", "generate", "stream", "delete"})
+    {
+      if (phases.count(phase))
+        print_row(phase, phases[phase]);
+    }
+    print_row("run", runs);
+
+    std::cout << "\nThroughput: " << std::fixed << std::setprecision(1)
+              << options.runs / elapsed << " runs/s, "
+              << options.runs * options.files / elapsed << " files/s, "
+              << options.runs * options.questions / elapsed
+              << " questions/s" << std::endl;
+    std::cout << "Responses:";
+    for (const auto &[status, count] : statuses)
+      std::cout << " " << count << " x HTTP " << status;
+    std::cout << "\nFailed runs: " << failed_runs << " of " << options.runs
+              << std::endl;
+
+    server.stop();
+    std::filesystem::remove_all(work_dir);
+    return failed_runs == 0 ? 0 : 1;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    if (!work_dir.empty())
+    {
+      std::error_code ec;
+      std::filesystem::remove_all(work_dir, ec);
+    }
+    return 1;
+  }
+}
@@ -0,0 +1,1177 @@
+#include "src/generation.hpp"
+#include "src/server.hpp"
+
+namespace giftgen
+{
+
+using namespace detail;
+
+namespace
+{
+
+void print_usage(const char *program_name)
+{
+  std::cout
+      << "Usage: " << program_name
+      << " [OPTIONS]"
+         R"(
+
+Options:
+  --help               Show this help message and exit
+  --gemini-api-key KEY Google Gemini API key
+  --interactive        Show GIFT output and ask for approval before saving
+  --num-questions N    Number of questions to generate (default: 5)
+  --output FILE        Write GIFT output to file instead of stdout
+  --append             Top up the --output file, rather than replacing it:
+                       generate only as many questions as its category (that
+                       of --context, or else its last) needs to reach
+                       --num-questions, and append them
+  --files FILES...     Files to process (can be used multiple times)
+  --prompt "TEXT"      Custom query prompt (default: "From both the text and
+                       images in the provided files, generate N multiple choice
+                       questions formatted according to the provided json
+                       schema. Ensure that any code excerpts in the generated
+                       questions or answers are surrounded by a pair of
+                       backticks. Also ensure each question includes a short
+                       title: if a question is based on content from a provided
+                       file, start the question title using a short version of
+                       the relevant file's title or overall theme. Do not refer
+                       to the files provided by an ordinal word, such as
+                       "first" or "second". When referring to an image, do this
+                       only using one or two words which relate to the content
+                       of the image itself; though vary (avoid) this if it
+                       might help answer the question.")
+
+  --context "TEXT"     Override the LLM-generated category name with custom text.
+                       The category appears at the top of the GIFT output and is
+                       used by Moodle to organize questions. If not specified,
+                       the LLM generates a short category name based on the
+                       content, with a timestamp automatically appended.
+
+  --quiet              Suppress non-error output (except interactive prompts
+                       and final GIFT output)
+  --shards K           Split the questions across K concurrent requests, each
+                       steered towards different subtopics; duplicate
+                       questions are dropped when the results are merged
+  --per-document       Ask each file (or group of small files) for its own
+                       share of the questions, concurrently; shares follow
+                       each file's length in pages, and the questions are
+                       merged, with duplicates dropped, into one quiz
+  --stream             Stream the response, writing each question as soon as it
+                       has been generated
+  --model MODEL        Gemini model: "flash", "pro" or a full model name
+                       (default: flash)
+  --hedge MODEL        If a response is slow, also send the request to MODEL
+                       ("flash", "pro", or the same model again); the first
+                       valid response is used and the other is cancelled
+  --hedge-after TIME   When to send the hedged request: a number of seconds,
+                       or a percentile of recent response times, e.g. p90
+                       (default: p95)
+  --no-upload-cache    Always upload the files, rather than reusing file IDs
+                       from earlier uploads of identical content
+  --no-cache           Always generate the quiz, rather than reusing the one
+                       generated earlier from identical files, prompt and
+                       model (interactive runs never reuse a quiz)
+  --resumable-threshold MB
+                       Upload files of at least this size in resumable chunks,
+                       which are retried, and resumed by a re-run, after a
+                       dropped connection (default: 32)
+  --inline-threshold KB
+                       Send files smaller than this inline, with the request
+                       for questions, rather than uploading them first; suits
+                       a few small images (default: 0, i.e. upload all files)
+  --image-budget KB    Reduce images larger than this before sending them:
+                       strip their metadata and, if still too large, re-encode
+                       JPEGs at full size, then at a half, a quarter or an
+                       eighth of their width and height, until they fit
+                       (default: 0, i.e. send images as they are)
+  --context-cache SECONDS
+                       Hold the files in a context cache on the server for this
+                       long; requests, interactive retries and re-runs then
+                       refer to the cache, and the model reads the files only
+                       once (default: 0, i.e. send the files with each request)
+  --persist-dns        Remember resolved server addresses for a few minutes,
+                       so the next invocation can skip DNS lookups
+  --max-uploads N      Number of files uploaded at once, across all jobs; the
+                       largest files are uploaded first (default: 8)
+  --max-upload-rate KB Cap the combined upload rate, in KB per second, e.g. to
+                       leave room on a shared link (default: no cap)
+  --max-connections N  Number of connections opened to the server at once
+                       (default: no limit)
+  --manifest FILE      Generate every quiz listed in a JSON manifest; each job
+                       has "files", "num_questions" or "prompt", "context",
+                       "shards", "model", "stream" and "output" (paths are
+                       relative to the manifest)
+  --max-jobs N         Number of manifest (or server) jobs run concurrently
+                       (default: 4)
+  --serve ADDRESS      Run as a server, taking quiz jobs (as in a manifest) by
+                       HTTP on a Unix socket ("unix:PATH") or a local port
+                       ("localhost:PORT"); POST a job to /jobs, and the GIFT
+                       output is the response. Stops on SIGINT or SIGTERM.
+                       Jobs must be sent as application/json, and not from a
+                       web page; if MOODLE_GIFT_GEN_SERVE_TOKEN is set, with
+                       "Authorization: Bearer TOKEN"
+  --serve-root DIR     Directory to which the server confines jobs' files and
+                       outputs; their paths are relative to it (default: the
+                       working directory)
+  --max-retries N      Retries allowed per job, across all its requests, after
+                       rate limiting (429), server errors (500, 502, 503, 504)
+                       or connection failures (default: 5)
+  --retry-delay MS     Base delay before a retry; it doubles with each retry,
+                       is randomized, and yields to any delay the server asks
+                       for (default: 1000)
+  --deadline SECONDS   Give up on a job, including its retries, after this long
+                       (default: no deadline)
+  --base-url URL       Send API requests to this server instead, such as a
+                       local mock server (default:
+                       https://generativelanguage.googleapis.com)
+  --gc                 Delete the files left on the server by earlier runs which
+                       did not delete them (e.g. after a crash), unless another
+                       run still uses them or they are kept for reuse
+  --validate FILES...  Check GIFT files, reporting each malformed question (e.g.
+                       a multiple choice question with no correct answer) and
+                       the number of questions of each type
+  --question-index FILE
+                       Drop questions similar to any written before with the
+                       same index FILE (e.g. one per course), and ask for more
+                       in their place; created if it does not exist. Implies
+                       --no-cache
+  --metrics FILE       On exit, write the time spent in each phase, each
+                       transfer's timings and sizes, and the tokens used to
+                       FILE: as JSON, or as Prometheus text if it ends in .prom
+  --trace FILE         On exit, write the phases and transfers to FILE as a
+                       Chrome trace (for chrome://tracing or Perfetto)
+
+Examples:
+)"
+         "  "
+      << program_name
+      << " --files file1.pdf file2.docx --num-questions 10\n"
+         "  "
+      << program_name
+      << " --interactive --files a.pdf --num-questions 5 --files b.txt c.md\n"
+         "  "
+      << program_name
+      << " --prompt \"Generate 7 C++ questions\" --output cpp-quiz.gift\n"
+         "  "
+      << program_name
+      << " --quiet --gemini-api-key abc123 --output quiz.gift --files "
+         "../inputs/*.pdf\n"
+         "  "
+      << program_name
+      << " --context \"Cellular Biology 1\" --files cells.pdf --output "
+         "bio.gift\n"
+         "  "
+      << program_name
+      << " --manifest term1.json --max-jobs 8\n"
+         "  "
+      << program_name
+      << R"( --serve unix:/tmp/moodle-gift-gen.sock --max-jobs 16
+
+Environment:
+  GEMINI_API_KEY       API key for Google Gemini (if --gemini-api-key not used)
+  MOODLE_GIFT_GEN_CACHE_DIR
+                       Directory for the local caches (default:
+                       ~/.cache/moodle-gift-gen or %LOCALAPPDATA%\moodle-gift-gen)
+
+Note: If --prompt is used, it should specify the number of questions to be
+      generated. Providing --num-questions too is an error.
+)";
+}
+
+struct CommandLineArgs
+{
+  int num_questions = 5;
+  std::vector<std::string> files;
+  std::string gemini_api_key;
+  std::string output_file;
+  std::string custom_prompt;
+  std::string context;
+  std::string manifest_file;
+  std::string serve_address;
+  std::string serve_root;
+  int max_jobs = 4;
+  int max_uploads = int(DEFAULT_MAX_UPLOADS);
+  int max_upload_rate = 0; // KB per second; zero for no cap
+  int max_connections = 0; // Zero for no limit
+  int shards = 1;
+  bool per_document = false;
+  bool interactive = false;
+  bool stream = false;
+  bool quiet = false;
+  bool use_upload_cache = true;
+  bool use_response_cache = true;
+  uintmax_t resumable_threshold = DEFAULT_RESUMABLE_THRESHOLD;
+  uintmax_t inline_threshold = 0;
+  uintmax_t image_budget = 0; // Zero to send images as they are
+  int context_cache_ttl = 0; // Seconds; zero for no context cache
+  bool persist_dns = false;
+  RetryPolicy retry_policy;
+  std::string model = GEMINI_MODEL_FLASH;
+  HedgePolicy hedge; // Hedging is enabled by giving its model
+  std::string base_url = GEMINI_DEFAULT_BASE_URL;
+  std::string metrics_file;
+  std::string trace_file;
+  std::string question_index_file;
+  bool append = false;
+  bool gc = false;
+  std::vector<std::string> validate_files;
+  bool num_questions_specified = false;
+};
+
+CommandLineArgs parse_command_line(int argc, char *argv[])
+{
+  CommandLineArgs args;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+
+    if (arg == "--help")
+    {
+      print_usage(argv[0]);
+      exit(0);
+    }
+    else if (arg == "--num-questions")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--num-questions requires a value");
+      }
+      try
+      {
+        args.num_questions = std::stoi(argv[i + 1]);
+        args.num_questions_specified = true;
+        if (args.num_questions <= 0)
+        {
+          throw std::runtime_error("Number of questions must be positive");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --num-questions: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--gemini-api-key")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--gemini-api-key requires a value");
+      }
+      args.gemini_api_key = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--output")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--output requires a value");
+      }
+      args.output_file = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--interactive")
+    {
+      args.interactive = true;
+    }
+    else if (arg == "--quiet")
+    {
+      args.quiet = true;
+    }
+    else if (arg == "--shards")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--shards requires a value");
+      }
+      try
+      {
+        args.shards = std::stoi(argv[i + 1]);
+        if (args.shards <= 0)
+        {
+          throw std::runtime_error("Number of shards must be positive");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --shards: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--manifest")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--manifest requires a value");
+      }
+      args.manifest_file = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--serve")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--serve requires a value");
+      }
+      args.serve_address = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--serve-root")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--serve-root requires a value");
+      }
+      args.serve_root = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--max-jobs")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--max-jobs requires a value");
+      }
+      try
+      {
+        args.max_jobs = std::stoi(argv[i + 1]);
+        if (args.max_jobs <= 0)
+        {
+          throw std::runtime_error("Number of jobs must be positive");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --max-jobs: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--max-retries")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--max-retries requires a value");
+      }
+      try
+      {
+        args.retry_policy.max_retries = std::stoi(argv[i + 1]);
+        if (args.retry_policy.max_retries < 0)
+        {
+          throw std::runtime_error("Number of retries cannot be negative");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --max-retries: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--retry-delay")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--retry-delay requires a value");
+      }
+      try
+      {
+        args.retry_policy.base_delay =
+            std::chrono::milliseconds(std::stoi(argv[i + 1]));
+        if (args.retry_policy.base_delay.count() < 0)
+        {
+          throw std::runtime_error("Retry delay cannot be negative");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --retry-delay: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--deadline")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--deadline requires a value");
+      }
+      try
+      {
+        args.retry_policy.deadline =
+            std::chrono::seconds(std::stoi(argv[i + 1]));
+        if (args.retry_policy.deadline.count() <= 0)
+        {
+          throw std::runtime_error("Deadline must be positive");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --deadline: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--context-cache")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--context-cache requires a value");
+      }
+      try
+      {
+        args.context_cache_ttl = std::stoi(argv[i + 1]);
+        if (args.context_cache_ttl < 0)
+        {
+          throw std::runtime_error("Context cache TTL must not be negative");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --context-cache: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--stream")
+    {
+      args.stream = true;
+    }
+    else if (arg == "--per-document")
+    {
+      args.per_document = true;
+    }
+    else if (arg == "--model")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--model requires a value");
+      }
+      args.model = resolve_model_name(argv[i + 1]);
+      ++i; // Skip the value
+    }
+    else if (arg == "--hedge")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--hedge requires a value");
+      }
+      args.hedge.model = resolve_model_name(argv[i + 1]);
+      ++i; // Skip the value
+    }
+    else if (arg == "--hedge-after")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--hedge-after requires a value");
+      }
+      std::string value = argv[i + 1];
+      try
+      {
+        if (!value.empty() && value[0] == 'p')
+        {
+          args.hedge.percentile = std::stoi(value.substr(1));
+          if (args.hedge.percentile <= 0 || args.hedge.percentile >= 100)
+          {
+            throw std::runtime_error("Percentile must be between 1 and 99");
+          }
+        }
+        else
+        {
+          args.hedge.percentile = 0;
+          args.hedge.delay = std::chrono::milliseconds(
+              static_cast<int64_t>(std::stod(value) * 1000));
+          if (args.hedge.delay.count() < 0)
+          {
+            throw std::runtime_error("Hedge delay cannot be negative");
+          }
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid value for --hedge-after: " + value);
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--no-upload-cache")
+    {
+      args.use_upload_cache = false;
+    }
+    else if (arg == "--no-cache")
+    {
+      args.use_response_cache = false;
+    }
+    else if (arg == "--resumable-threshold")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--resumable-threshold requires a value");
+      }
+      try
+      {
+        int megabytes = std::stoi(argv[i + 1]);
+        if (megabytes < 0)
+        {
+          throw std::runtime_error("Resumable threshold must not be negative");
+        }
+        args.resumable_threshold = uintmax_t(megabytes) << 20;
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --resumable-threshold: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--inline-threshold")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--inline-threshold requires a value");
+      }
+      try
+      {
+        int kilobytes = std::stoi(argv[i + 1]);
+        if (kilobytes < 0)
+        {
+          throw std::runtime_error("Inline threshold must not be negative");
+        }
+        args.inline_threshold = uintmax_t(kilobytes) << 10;
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --inline-threshold: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--image-budget")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--image-budget requires a value");
+      }
+      try
+      {
+        int kilobytes = std::stoi(argv[i + 1]);
+        if (kilobytes < 0)
+        {
+          throw std::runtime_error("Image budget must not be negative");
+        }
+        args.image_budget = uintmax_t(kilobytes) << 10;
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --image-budget: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--max-uploads")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--max-uploads requires a value");
+      }
+      try
+      {
+        args.max_uploads = std::stoi(argv[i + 1]);
+        if (args.max_uploads <= 0)
+        {
+          throw std::runtime_error("Number of uploads must be positive");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --max-uploads: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--max-upload-rate")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--max-upload-rate requires a value");
+      }
+      try
+      {
+        args.max_upload_rate = std::stoi(argv[i + 1]);
+        if (args.max_upload_rate <= 0)
+        {
+          throw std::runtime_error("Upload rate must be positive");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --max-upload-rate: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--max-connections")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--max-connections requires a value");
+      }
+      try
+      {
+        args.max_connections = std::stoi(argv[i + 1]);
+        if (args.max_connections <= 0)
+        {
+          throw std::runtime_error("Number of connections must be positive");
+        }
+      }
+      catch (const std::invalid_argument &)
+      {
+        throw std::runtime_error("Invalid number for --max-connections: " +
+                                 std::string(argv[i + 1]));
+      }
+      ++i; // Skip the value
+    }
+    else if (arg == "--persist-dns")
+    {
+      args.persist_dns = true;
+    }
+    else if (arg == "--base-url")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--base-url requires a value");
+      }
+      args.base_url = argv[i + 1];
+      while (!args.base_url.empty() && args.base_url.back() == '/')
+        args.base_url.pop_back();
+      ++i; // Skip the value
+    }
+    else if (arg == "--metrics")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--metrics requires a value");
+      }
+      args.metrics_file = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--trace")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--trace requires a value");
+      }
+      args.trace_file = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--append")
+    {
+      args.append = true;
+    }
+    else if (arg == "--question-index")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--question-index requires a value");
+      }
+      args.question_index_file = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--prompt")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--prompt requires a value");
+      }
+      args.custom_prompt = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--context")
+    {
+      if (i + 1 >= argc)
+      {
+        throw std::runtime_error("--context requires a value");
+      }
+      args.context = argv[i + 1];
+      ++i; // Skip the value
+    }
+    else if (arg == "--gc")
+    {
+      args.gc = true;
+    }
+    else if (arg == "--validate")
+    {
+      // Collect all following arguments until next option or end
+      ++i;
+      while (i < argc && argv[i][0] != '-')
+      {
+        args.validate_files.push_back(argv[i]);
+        ++i;
+      }
+      --i; // Back up one since the loop will increment
+      if (args.validate_files.empty())
+      {
+        throw std::runtime_error("--validate requires at least one file");
+      }
+    }
+    else if (arg == "--files")
+    {
+      // Collect all following arguments until next option or end
+      ++i;
+      while (i < argc && argv[i][0] != '-')
+      {
+        args.files.push_back(argv[i]);
+        ++i;
+      }
+      --i; // Back up one since the loop will increment
+    }
+    else if (arg.substr(0, 2) == "--")
+    {
+      throw std::runtime_error("Unknown option: " + arg);
+    }
+    else
+    {
+      throw std::runtime_error("Unexpected argument: " + arg +
+                               ". Use --files to specify files.");
+    }
+  }
+
+  return args;
+}
+
+RetryPolicy retry_policy_of(const giftgen::GeneratorOptions &options)
+{
+  RetryPolicy policy;
+  policy.max_retries = options.max_retries;
+  policy.base_delay = std::chrono::milliseconds(options.retry_delay_ms);
+  policy.deadline = std::chrono::seconds(options.deadline_seconds);
+  return policy;
+}
+
+} // namespace
+
+Generator::Generator(GeneratorOptions options) : options_(std::move(options))
+{
+  options_.model = resolve_model_name(options_.model);
+
+  TransportSettings settings;
+  settings.base_url = options_.base_url.empty() ? GEMINI_DEFAULT_BASE_URL
+                                                : options_.base_url;
+  settings.api_key = options_.api_key;
+  settings.max_connections = options_.max_connections;
+  settings.max_uploads = options_.max_uploads;
+  settings.max_upload_rate = curl_off_t(options_.max_upload_rate);
+  acquire_transport(settings);
+}
+
+Generator::~Generator() { release_transport(); }
+
+std::vector<std::string>
+Generator::upload(const std::vector<std::string> &filenames) const
+{
+  RetryScheduler retry(retry_policy_of(options_), true);
+  return upload_files(filenames, options_.api_key, retry, true, true,
+                      options_.resumable_threshold,
+                      options_.inline_threshold);
+}
+
+Quiz Generator::generate(const std::vector<std::string> &file_ids,
+                         const int num_questions, const std::string &prompt,
+                         const int shards) const
+{
+  if (shards > 1 && !prompt.empty())
+  {
+    throw std::runtime_error("Cannot shard a custom prompt");
+  }
+
+  RetryScheduler retry(retry_policy_of(options_), true);
+  const json schema = generate_quiz_schema();
+  if (shards > 1)
+  {
+    return generate_quiz_sharded(file_ids, num_questions, shards,
+                                 QUIZ_QUERY_CONSTRAINTS, schema,
+                                 options_.api_key, retry, true,
+                                 options_.model);
+  }
+  return extract_quiz_data(query_gemini(file_ids,
+                                        build_quiz_query(num_questions, prompt),
+                                        schema, options_.api_key,
+                                        options_.model, retry));
+}
+
+std::string Generator::render_gift(const Quiz &quiz,
+                                   const std::string &context) const
+{
+  return convert_to_gift_format(quiz, context);
+}
+
+int run_command_line(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  try
+  {
+    CommandLineArgs args = parse_command_line(argc, argv);
+
+    // Checking GIFT files needs no API key, nor any transfers
+    if (!args.validate_files.empty())
+    {
+      const size_t errors = validate_gift_files(args.validate_files, args.quiet);
+      return errors > 0 ? 1 : 0;
+    }
+
+    if (args.shards > 1 && !args.custom_prompt.empty())
+    {
+      std::cerr << "Error: Cannot specify both --shards and --prompt. "
+                   "Sharding splits the --num-questions count.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (args.shards > 1 && args.stream)
+    {
+      std::cerr << "Error: Cannot specify both --shards and --stream.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (args.per_document &&
+        (args.files.empty() || args.shards > 1 ||
+         !args.custom_prompt.empty() || args.stream || args.append ||
+         !args.manifest_file.empty() || !args.serve_address.empty()))
+    {
+      std::cerr << "Error: --per-document needs --files, and cannot be "
+                   "combined with --shards, --prompt, --stream, --append, "
+                   "--manifest or --serve.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (!args.hedge.model.empty() && args.stream)
+    {
+      std::cerr << "Error: Cannot specify both --hedge and --stream.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (!args.manifest_file.empty() &&
+        (!args.files.empty() || !args.custom_prompt.empty() ||
+         !args.output_file.empty() || !args.context.empty() ||
+         args.num_questions_specified || args.interactive))
+    {
+      std::cerr << "Error: --manifest cannot be combined with --files, "
+                   "--prompt, --num-questions, --context, --output or "
+                   "--interactive; specify these per job in the manifest.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (args.append &&
+        (args.output_file.empty() || !args.custom_prompt.empty() ||
+         args.stream || args.interactive || !args.manifest_file.empty() ||
+         !args.serve_address.empty()))
+    {
+      std::cerr << "Error: --append needs --output, and cannot be combined "
+                   "with --prompt, --stream, --interactive, --manifest or "
+                   "--serve.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (!args.question_index_file.empty() && args.interactive)
+    {
+      std::cerr << "Error: Cannot specify both --question-index and "
+                   "--interactive.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (!args.serve_address.empty() &&
+        (!args.manifest_file.empty() || !args.files.empty() ||
+         !args.custom_prompt.empty() || !args.output_file.empty() ||
+         !args.context.empty() || args.num_questions_specified ||
+         args.interactive))
+    {
+      std::cerr << "Error: --serve cannot be combined with --manifest, "
+                   "--files, --prompt, --num-questions, --context, --output "
+                   "or --interactive; specify these per job.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (!args.serve_root.empty() && args.serve_address.empty())
+    {
+      std::cerr << "Error: --serve-root requires --serve.\n" << std::endl;
+      return 1;
+    }
+
+    if (args.gc &&
+        (!args.manifest_file.empty() || !args.serve_address.empty() ||
+         !args.files.empty() || !args.custom_prompt.empty() || args.append))
+    {
+      std::cerr << "Error: --gc cannot be combined with --manifest, --serve, "
+                   "--files, --prompt or --append.\n"
+                << std::endl;
+      return 1;
+    }
+
+    if (!args.gc && args.serve_address.empty() &&
+        args.manifest_file.empty() && args.files.empty() &&
+        args.custom_prompt.empty())
+    {
+      std::cerr
+          << "Error: No files specified and no custom prompt provided. Use "
+             "--files to specify files or --prompt for custom queries.\n"
+          << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+
+    if (args.num_questions_specified && !args.custom_prompt.empty())
+    {
+      std::cerr << "Error: Cannot specify both --num-questions and --prompt. "
+                   "The custom prompt should specify the number of questions.\n"
+                << std::endl;
+      return 1;
+    }
+
+    std::string api_key;
+    if (!args.gemini_api_key.empty())
+    {
+      api_key = args.gemini_api_key;
+    }
+    else
+    {
+      const char *api_key_env = std::getenv("GEMINI_API_KEY");
+      if (!api_key_env)
+      {
+        std::cerr << "Error: GEMINI_API_KEY environment variable not set and "
+                     "--gemini-api-key not provided"
+                  << std::endl;
+        return 1;
+      }
+      api_key = api_key_env;
+    }
+
+    image_budget = args.image_budget;
+    metrics.summary_file = args.metrics_file;
+    metrics.trace_file = args.trace_file;
+    TransportSettings transport_settings;
+    transport_settings.base_url = args.base_url;
+    transport_settings.api_key = api_key;
+    transport_settings.quiet = args.quiet;
+    transport_settings.persist_dns = args.persist_dns;
+    transport_settings.max_connections = args.max_connections;
+    transport_settings.max_uploads = size_t(args.max_uploads);
+    transport_settings.max_upload_rate = curl_off_t(args.max_upload_rate) << 10;
+    TransportUser transport_user(transport_settings);
+
+    if (args.gc)
+    {
+      RetryScheduler retry(args.retry_policy, args.quiet);
+      const size_t remaining = collect_garbage(api_key, args.quiet, retry);
+      return remaining > 0 ? 1 : 0;
+    }
+
+    const HedgePolicy *hedge = args.hedge.model.empty() ? nullptr : &args.hedge;
+
+    // A quiz from the response cache may repeat questions already indexed
+    std::optional<QuestionIndex> index;
+    if (!args.question_index_file.empty())
+    {
+      index.emplace(args.question_index_file);
+      args.use_response_cache = false;
+      if (!args.quiet)
+        std::cout << "Question index holds " << index->size()
+                  << " questions." << std::endl;
+    }
+    QuestionIndex *index_ptr = index ? &*index : nullptr;
+
+    JobOptions job_options;
+    job_options.api_key = api_key;
+    job_options.use_upload_cache = args.use_upload_cache;
+    job_options.use_response_cache = args.use_response_cache;
+    job_options.resumable_threshold = args.resumable_threshold;
+    job_options.inline_threshold = args.inline_threshold;
+    job_options.context_cache_ttl = args.context_cache_ttl;
+    job_options.retry_policy = args.retry_policy;
+    job_options.model = args.model;
+    job_options.hedge = hedge;
+    job_options.index = index_ptr;
+
+    if (!args.serve_address.empty())
+    {
+#ifdef _WIN32
+      throw std::runtime_error("--serve is not supported on Windows");
+#else
+      ServerOptions options;
+      options.address = args.serve_address;
+      options.root = args.serve_root;
+      if (const char *token = std::getenv("MOODLE_GIFT_GEN_SERVE_TOKEN"))
+        options.token = token;
+      options.max_jobs = args.max_jobs;
+      options.quiet = args.quiet;
+      options.job = job_options;
+      QuizServer(options).run();
+      return 0;
+#endif
+    }
+
+    if (!args.manifest_file.empty())
+    {
+      std::vector<QuizJob> jobs =
+          load_manifest(args.manifest_file, hedge != nullptr);
+      if (!args.quiet)
+        std::cout << "Generating " << jobs.size() << " quizzes from "
+                  << args.manifest_file << "." << std::endl;
+
+      size_t failures =
+          run_manifest(jobs, job_options, args.max_jobs, args.quiet);
+      if (failures > 0)
+      {
+        throw std::runtime_error(std::to_string(failures) + " of " +
+                                 std::to_string(jobs.size()) +
+                                 " manifest jobs failed");
+      }
+      return 0;
+    }
+
+    // Only the questions missing from the existing file are generated
+    std::optional<FileLock> append_lock;
+    std::optional<GiftAppendPlan> append_plan;
+    if (args.append)
+    {
+      append_lock.emplace(args.output_file);
+      append_plan =
+          plan_gift_append(args.output_file, args.num_questions, args.context);
+      if (!args.quiet)
+        std::cout << args.output_file << " holds " << append_plan->existing
+                  << " questions in the category topped up." << std::endl;
+      if (append_plan->missing == 0)
+      {
+        return 0;
+      }
+      args.num_questions = int(append_plan->missing);
+    }
+
+    if (!args.quiet)
+    {
+      if (args.files.empty())
+        std::cout << "Generating questions using a custom prompt." << std::endl;
+      else
+        std::cout << "Generating " << args.num_questions << " questions from "
+                  << args.files.size() << " files." << std::endl;
+    }
+
+    // A quiz generated before from identical inputs is reused as it is;
+    // interactive runs always generate, as the user may ask for another
+    std::string cache_key;
+    if (args.use_response_cache && !args.interactive && !args.append)
+    {
+      cache_key = response_cache_key(
+          args.files, build_quiz_query(args.num_questions, args.custom_prompt),
+          generate_quiz_schema(), args.model, args.shards, args.per_document,
+          hedge);
+      if (std::optional<Quiz> cached = load_cached_quiz(cache_key))
+      {
+        if (!args.quiet)
+          std::cout << "Reusing the quiz cached for these inputs." << std::endl;
+        write_quiz_output(*cached, args.output_file, args.context, args.quiet);
+        return 0;
+      }
+    }
+
+    RetryScheduler retry(args.retry_policy, args.quiet);
+    std::vector<std::string> file_ids;
+    std::vector<size_t> file_indices;
+    if (!args.files.empty())
+    {
+      file_ids = upload_files(args.files, api_key, retry, args.quiet,
+                              args.use_upload_cache, args.resumable_threshold,
+                              args.inline_threshold, &file_indices);
+    }
+
+    // Files not kept for reuse (nor context caches) are deleted, in the
+    // background, once the lease is released; on failure too
+    FileLease lease(file_ids);
+    // Files of identical content, sharing an ID, are counted once
+    std::optional<std::vector<DocumentGroup>> documents;
+    if (args.per_document)
+    {
+      std::vector<double> pages(file_ids.size(), 0);
+      for (size_t i = 0; i < args.files.size(); ++i)
+      {
+        if (pages[file_indices[i]] == 0)
+          pages[file_indices[i]] = document_pages(args.files[i]);
+      }
+      documents = plan_document_groups(file_ids, pages, args.num_questions);
+    }
+
+    // Each document group is cached separately
+    std::vector<std::string> generation_ids = file_ids;
+    if (args.context_cache_ttl > 0)
+    {
+      auto cache = [&](const std::vector<std::string> &ids)
+      {
+        return cache_context(ids, api_key, args.model, args.context_cache_ttl,
+                             args.quiet, args.use_upload_cache, retry,
+                             hedge);
+      };
+      if (documents)
+      {
+        std::vector<std::future<std::vector<std::string>>> cached;
+        for (const auto &group : *documents)
+          cached.push_back(
+              std::async(std::launch::async, cache, group.file_ids));
+        for (size_t i = 0; i < cached.size(); ++i)
+          (*documents)[i].file_ids = cached[i].get();
+      }
+      else
+      {
+        generation_ids = cache(file_ids);
+      }
+    }
+    lease.add(generation_ids);
+    if (documents)
+    {
+      for (const auto &group : *documents)
+        lease.add(group.file_ids);
+    }
+
+    GenerationOptions generation;
+    generation.num_questions = args.num_questions;
+    generation.output_file = args.output_file;
+    generation.interactive = args.interactive;
+    generation.quiet = args.quiet;
+    generation.custom_prompt = args.custom_prompt;
+    generation.context_override = args.context;
+    generation.shards = args.shards;
+    generation.stream = args.stream;
+    generation.model = args.model;
+    generation.hedge = hedge;
+    generation.cache_key = cache_key;
+    generation.index = index_ptr;
+    generation.documents = documents ? &*documents : nullptr;
+    generation.lease = &lease;
+
+    if (append_plan)
+      append_quiz_generation(*append_plan, generation_ids, api_key, generation,
+                             retry);
+    else
+      run_quiz_generation(generation_ids, api_key, generation, retry);
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+} // namespace giftgen
@@ -0,0 +1,90 @@
+// libgiftgen: generates Moodle GIFT quizzes from files with the Gemini API,
+// in-process. The moodle-gift-gen tool is a front-end to it.
+//
+//   giftgen::Generator generator({api_key});
+//   auto file_ids = generator.upload({"notes.pdf"});
+//   giftgen::Quiz quiz = generator.generate(file_ids, 10);
+//   std::string gift = generator.render_gift(quiz, "Week 3");
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace giftgen
+{
+
+// A quiz as generated under the response schema
+struct Question
+{
+  std::string title;
+  std::string question;
+  std::vector<std::string> options;
+  int correct_answer = -1;
+  std::string explanation;
+};
+
+struct Quiz
+{
+  std::string category; // Empty if the model gave none
+  std::vector<Question> questions;
+};
+
+struct GeneratorOptions
+{
+  std::string api_key;
+  std::string model = "flash"; // "flash", "pro" or a full model name
+  std::string base_url;        // Empty for the Gemini API
+  uintmax_t resumable_threshold = uintmax_t(32) << 20; // Bytes
+  uintmax_t inline_threshold = 0; // Bytes; zero to upload every file
+  int max_retries = 5; // Per call, across all its requests
+  int retry_delay_ms = 1000;
+  int deadline_seconds = 0; // Per call; zero for none
+  long max_connections = 0; // Zero for no limit
+  size_t max_uploads = 8; // Files uploaded at once
+  int64_t max_upload_rate = 0; // Bytes per second; zero for no cap
+};
+
+// A Generator may be used by any number of threads at once. Every Generator
+// in the process, and run_command_line while it runs, shares one transport
+// (the connections, DNS cache and TLS sessions, the upload limits, and the
+// threads driving them), set up with the options of the first, and torn down
+// with the last; a Generator whose base_url, api_key, max_connections,
+// max_uploads or max_upload_rate differ from those the transport was set up
+// with throws from its constructor. Uploads are remembered in the same local
+// caches as the tool's, so files of identical content are uploaded only once,
+// across calls, Generators and processes. Failures are thrown as
+// std::runtime_error.
+class Generator
+{
+public:
+  explicit Generator(GeneratorOptions options);
+  ~Generator();
+
+  Generator(const Generator &) = delete;
+  Generator &operator=(const Generator &) = delete;
+
+  // Uploads the files (or reuses earlier uploads), returning their file IDs
+  std::vector<std::string>
+  upload(const std::vector<std::string> &filenames) const;
+
+  // Asks for num_questions questions on the files (or, given a prompt, for
+  // what it asks), split across shards concurrent requests
+  Quiz generate(const std::vector<std::string> &file_ids,
+                int num_questions, const std::string &prompt = "",
+                int shards = 1) const;
+
+  // The quiz in GIFT format, under the category context (if not empty) or
+  // the quiz's own
+  std::string render_gift(const Quiz &quiz,
+                          const std::string &context = "") const;
+
+private:
+  GeneratorOptions options_;
+};
+
+// Runs the moodle-gift-gen tool; returns its exit status
+int run_command_line(int argc, char *argv[]);
+
+} // namespace giftgen
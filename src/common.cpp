@@ -0,0 +1,420 @@
+#include "common.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace giftgen::detail
+{
+
+std::string gemini_base_url = GEMINI_DEFAULT_BASE_URL;
+
+std::string resolve_model_name(const std::string &name)
+{
+  if (name == "flash")
+    return GEMINI_MODEL_FLASH;
+  if (name == "pro")
+    return GEMINI_MODEL_PRO;
+  return name;
+}
+
+std::filesystem::path get_cache_dir()
+{
+  if (const char *dir = std::getenv("MOODLE_GIFT_GEN_CACHE_DIR"))
+    return dir;
+#ifdef _WIN32
+  if (const char *dir = std::getenv("LOCALAPPDATA"))
+    return std::filesystem::path(dir) / "moodle-gift-gen";
+#else
+  if (const char *dir = std::getenv("XDG_CACHE_HOME"))
+    return std::filesystem::path(dir) / "moodle-gift-gen";
+  if (const char *dir = std::getenv("HOME"))
+    return std::filesystem::path(dir) / ".cache" / "moodle-gift-gen";
+#endif
+  return std::filesystem::temp_directory_path() / "moodle-gift-gen";
+}
+
+int64_t unix_time_now()
+{
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t current_process_id()
+{
+#ifdef _WIN32
+  return int64_t(GetCurrentProcessId());
+#else
+  return int64_t(getpid());
+#endif
+}
+
+std::filesystem::path temporary_path(const std::filesystem::path &path)
+{
+  static std::atomic<uint64_t> calls{0};
+  std::filesystem::path tmp = path;
+  tmp += ".tmp" + std::to_string(current_process_id()) + "-" +
+         std::to_string(calls++);
+  return tmp;
+}
+
+bool write_cache_file(const std::filesystem::path &path,
+                      const std::string &contents)
+{
+  std::error_code ec;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  const std::filesystem::path tmp = temporary_path(path);
+  {
+    std::ofstream file(tmp, std::ios::binary);
+    if (!file.is_open())
+      return false;
+    file << contents;
+    if (!file.good())
+      return false;
+  }
+  std::filesystem::rename(tmp, path, ec);
+  if (ec)
+    std::filesystem::remove(tmp, ec);
+  return !ec;
+}
+
+void write_json_file(const std::filesystem::path &path, const json &data)
+{
+  write_cache_file(path, data.dump(2));
+}
+
+void evict_cache_files(const std::filesystem::path &dir,
+                       const uintmax_t max_bytes,
+                       const std::set<std::filesystem::path> &keep)
+{
+  struct CachedFile
+  {
+    std::filesystem::file_time_type used;
+    uintmax_t size;
+    std::filesystem::path path;
+  };
+
+  std::error_code ec;
+  std::vector<CachedFile> files;
+  uintmax_t total = 0;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec))
+  {
+    if (entry.path().extension().string().compare(0, 4, ".tmp") == 0)
+      continue;
+    CachedFile file{entry.last_write_time(ec), entry.file_size(ec),
+                    entry.path()};
+    if (ec)
+      continue;
+    total += file.size;
+    files.push_back(std::move(file));
+  }
+
+  std::sort(files.begin(), files.end(),
+            [](const CachedFile &a, const CachedFile &b)
+            { return a.used < b.used; });
+  for (const auto &file : files)
+  {
+    if (total <= max_bytes)
+      break;
+    if (keep.count(file.path) == 0 && std::filesystem::remove(file.path, ec))
+      total -= file.size;
+  }
+}
+
+MappedFile::MappedFile(const std::string &filename)
+{
+#ifdef _WIN32
+  file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                      nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER size;
+  if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size))
+  {
+    close();
+    throw std::runtime_error("File not found: " + filename);
+  }
+  size_ = static_cast<size_t>(size.QuadPart);
+  if (size_ > 0)
+  {
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0,
+                                  nullptr);
+    if (mapping_)
+      data_ = static_cast<const char *>(
+          MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+  }
+#else
+  fd_ = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd_ < 0 || fstat(fd_, &st) != 0)
+  {
+    close();
+    throw std::runtime_error("File not found: " + filename);
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ > 0)
+  {
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (data != MAP_FAILED)
+    {
+      data_ = static_cast<const char *>(data);
+      madvise(data, size_, MADV_SEQUENTIAL);
+    }
+  }
+#endif
+  if (size_ > 0 && !data_)
+  {
+    close();
+    throw std::runtime_error("Unable to map file: " + filename);
+  }
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+  if (data_)
+    UnmapViewOfFile(data_);
+  if (mapping_)
+    CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE)
+    CloseHandle(file_);
+  mapping_ = nullptr;
+  file_ = INVALID_HANDLE_VALUE;
+#else
+  if (data_)
+    munmap(const_cast<char *>(data_), size_);
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+#endif
+  data_ = nullptr;
+}
+
+FileLock::FileLock(const std::string &filename)
+{
+  const std::string lock_name = filename + ".lock";
+#ifdef _WIN32
+  file_ = CreateFileA(lock_name.c_str(), GENERIC_READ | GENERIC_WRITE,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                      OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  OVERLAPPED overlapped{};
+  if (file_ == INVALID_HANDLE_VALUE ||
+      !LockFileEx(file_, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD,
+                  &overlapped))
+#else
+  fd_ = open(lock_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  int result = -1;
+  if (fd_ >= 0)
+  {
+    do
+      result = flock(fd_, LOCK_EX);
+    while (result < 0 && errno == EINTR);
+  }
+  if (result < 0)
+#endif
+  {
+    close();
+    throw std::runtime_error("Unable to lock " + filename + " (through " +
+                             lock_name + ")");
+  }
+}
+
+void FileLock::close()
+{
+#ifdef _WIN32
+  if (file_ != INVALID_HANDLE_VALUE)
+    CloseHandle(file_);
+  file_ = INVALID_HANDLE_VALUE;
+#else
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+#endif
+}
+
+size_t base64_encoded_size(const size_t size) { return (size + 2) / 3 * 4; }
+
+void base64_encode(const unsigned char *in, size_t size, char *out)
+{
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#ifdef MOODLE_GIFT_GEN_SSSE3
+  // 12 bytes become 16 characters per step (Wojciech Muła's algorithm).
+  // Each step loads 16 bytes, so the last 4 to 15 are left to the scalar loop.
+  const __m128i shuffle =
+      _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i offsets =
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  while (size >= 16)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    v = _mm_shuffle_epi8(v, shuffle);
+
+    // Split each 3 bytes into four 6-bit indices, one per byte
+    const __m128i hi = _mm_mulhi_epu16(
+        _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+        _mm_set1_epi32(0x04000040));
+    const __m128i lo = _mm_mullo_epi16(
+        _mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+        _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(hi, lo);
+
+    // Map each index to the offset of its range of the alphabet
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(
+        range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                             _mm_set1_epi8(13)));
+    const __m128i chars =
+        _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), chars);
+    in += 12;
+    size -= 12;
+    out += 16;
+  }
+#endif
+
+  for (; size >= 3; in += 3, size -= 3)
+  {
+    const uint32_t n = uint32_t(in[0]) << 16 | uint32_t(in[1]) << 8 | in[2];
+    *out++ = alphabet[n >> 18];
+    *out++ = alphabet[(n >> 12) & 63];
+    *out++ = alphabet[(n >> 6) & 63];
+    *out++ = alphabet[n & 63];
+  }
+
+  if (size > 0)
+  {
+    const uint32_t n = uint32_t(in[0]) << 16 | (size > 1 ? in[1] << 8 : 0);
+    *out++ = alphabet[n >> 18];
+    *out++ = alphabet[(n >> 12) & 63];
+    *out++ = size > 1 ? alphabet[(n >> 6) & 63] : '=';
+    *out++ = '=';
+  }
+}
+
+void Sha256::reset()
+{
+  state_ = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  length_ = 0;
+  buffered_ = 0;
+}
+
+void Sha256::update(const void *data, size_t size)
+{
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  length_ += size;
+
+  if (buffered_ > 0)
+  {
+    size_t n = std::min(size, buffer_.size() - buffered_);
+    std::copy(bytes, bytes + n, buffer_.begin() + buffered_);
+    buffered_ += n;
+    bytes += n;
+    size -= n;
+    if (buffered_ < buffer_.size())
+      return;
+    transform(buffer_.data());
+    buffered_ = 0;
+  }
+
+  for (; size >= 64; bytes += 64, size -= 64)
+    transform(bytes);
+
+  std::copy(bytes, bytes + size, buffer_.begin());
+  buffered_ = size;
+}
+
+std::string Sha256::hex_digest()
+{
+  const uint64_t bit_length = length_ * 8;
+  const unsigned char pad = 0x80;
+  const unsigned char zero = 0x00;
+  update(&pad, 1);
+  while (buffered_ != 56)
+    update(&zero, 1);
+
+  unsigned char length_bytes[8];
+  for (int i = 0; i < 8; ++i)
+    length_bytes[i] = static_cast<unsigned char>(bit_length >> (56 - 8 * i));
+  update(length_bytes, 8);
+
+  std::ostringstream oss;
+  for (uint32_t word : state_)
+    oss << std::hex << std::setw(8) << std::setfill('0') << word;
+  reset();
+  return oss.str();
+}
+
+void Sha256::transform(const unsigned char *block)
+{
+  static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i)
+  {
+    w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) |
+           (uint32_t(block[4 * i + 2]) << 8) | uint32_t(block[4 * i + 3]);
+  }
+  for (int i = 16; i < 64; ++i)
+  {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+  uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+  for (int i = 0; i < 64; ++i)
+  {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                  ((e & f) ^ (~e & g)) + k[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state_[0] += a;
+  state_[1] += b;
+  state_[2] += c;
+  state_[3] += d;
+  state_[4] += e;
+  state_[5] += f;
+  state_[6] += g;
+  state_[7] += h;
+}
+
+std::string hash_file(const std::string &filename)
+{
+  MappedFile file(filename);
+  Sha256 sha;
+  sha.update(file.data(), file.size());
+  return sha.hex_digest();
+}
+
+} // namespace giftgen::detail
@@ -0,0 +1,192 @@
+// The internals of libgiftgen shared by all its units: platform and SIMD
+// detection, the local cache files, mapped files and file locks, base64 and
+// SHA-256. Everything in giftgen::detail is private to the library.
+#pragma once
+
+#ifdef _WIN32
+#define NOMINMAX // Before any header (e.g. curl.h) includes windows.h
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "../giftgen.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <curl/curl.h>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MOODLE_GIFT_GEN_AVX2
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>
+#define MOODLE_GIFT_GEN_SSSE3
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MOODLE_GIFT_GEN_SSE2
+#endif
+
+namespace giftgen::detail
+{
+
+using json = nlohmann::json;
+
+inline const std::string GEMINI_MODEL_FLASH = "gemini-2.5-flash";
+
+inline const std::string GEMINI_MODEL_PRO = "gemini-2.5-pro";
+
+// Every API URL starts with this; --base-url points the tool at another
+// server, such as the mock server used by the benchmark
+inline const std::string GEMINI_DEFAULT_BASE_URL =
+    "https://generativelanguage.googleapis.com";
+
+extern std::string gemini_base_url;
+
+// Accepts "flash" and "pro" as short names; other names are used as given
+std::string resolve_model_name(const std::string &name);
+
+// Per-user cache directory; MOODLE_GIFT_GEN_CACHE_DIR takes precedence
+std::filesystem::path get_cache_dir();
+
+int64_t unix_time_now();
+
+int64_t current_process_id();
+
+// A temporary file beside path, to be renamed over it once written; named
+// by the process and a count of the calls in it, so concurrent writers (in
+// this process or another) never share one
+std::filesystem::path temporary_path(const std::filesystem::path &path);
+
+// Writes via a temporary file and rename, so readers (including concurrent
+// runs) never see a partially written file. Local caches are an
+// optimisation, so failures are silently ignored; returns whether the file
+// was written.
+bool write_cache_file(const std::filesystem::path &path,
+                      const std::string &contents);
+
+void write_json_file(const std::filesystem::path &path, const json &data);
+
+// Evicts the least recently used (by modification time) files of the cache
+// directory until they fit within max_bytes, sparing those in keep and the
+// temporary files of writes in progress
+void evict_cache_files(const std::filesystem::path &dir,
+                       const uintmax_t max_bytes,
+                       const std::set<std::filesystem::path> &keep = {});
+
+// A read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string &filename);
+
+  ~MappedFile() { close(); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  void close();
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+};
+
+// An exclusive lock on a file, held from construction to destruction; waits
+// while another process or thread holds it. The lock is taken on PATH.lock,
+// which is left in place, as removing it would race with the next holder.
+class FileLock
+{
+public:
+  explicit FileLock(const std::string &filename);
+
+  ~FileLock() { close(); }
+
+  FileLock(const FileLock &) = delete;
+  FileLock &operator=(const FileLock &) = delete;
+
+private:
+  // Closing the file releases the lock
+  void close();
+
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+#else
+  int fd_ = -1;
+#endif
+};
+
+size_t base64_encoded_size(const size_t size);
+
+// Writes the base64 encoding (RFC 4648, padded) of the input to out, which
+// must have room for base64_encoded_size(size) characters
+void base64_encode(const unsigned char *in, size_t size, char *out);
+
+// Minimal SHA-256 (FIPS 180-4); used to key the local upload cache by content
+class Sha256
+{
+public:
+  Sha256() { reset(); }
+
+  void reset();
+
+  void update(const void *data, size_t size);
+
+  std::string hex_digest();
+
+private:
+  static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  void transform(const unsigned char *block);
+
+  std::array<uint32_t, 8> state_;
+  std::array<unsigned char, 64> buffer_;
+  uint64_t length_;
+  size_t buffered_;
+};
+
+std::string hash_file(const std::string &filename);
+
+} // namespace giftgen::detail
@@ -0,0 +1,2653 @@
+#include "generation.hpp"
+
+namespace giftgen::detail
+{
+
+json generate_quiz_schema()
+{
+  json schema = {
+      {"type", "object"},
+      {"properties",
+       {{"category",
+         {{"type", "string"},
+          {"description",
+           "A short category name (less than 30 characters) based on the "
+           "context of the provided files and prompt. This should summarize "
+           "the topic or subject area of the questions."}}},
+        {"questions",
+         {{"type", "array"},
+          {"items",
+           {{"type", "object"},
+            {"properties",
+             {{"title",
+               {{"type", "string"},
+                {"description", "A short title for the question"}}},
+              {"question",
+               {{"type", "string"}, {"description", "The question text"}}},
+              {"options",
+               {{"type", "array"},
+                {"items", {{"type", "string"}}},
+                {"description", "Array of answer options"}}},
+              {"correct_answer",
+               {{"type", "integer"},
+                {"description", "Index of the correct answer (0-based)"}}},
+              {"explanation",
+               {{"type", "string"},
+                {"description",
+                 "Optional explanation for the correct answer"}}}}},
+            {"required", json::array({"title", "question", "options",
+                                      "correct_answer"})},
+            {"propertyOrdering",
+             json::array({"title", "question", "options", "correct_answer",
+                          "explanation"})}}}}}}},
+      {"required", json::array({"category", "questions"})},
+      // The category comes first, so streamed output can start with it
+      {"propertyOrdering", json::array({"category", "questions"})}};
+  return schema;
+}
+
+std::string generate_content_body(const std::vector<std::string> &file_ids,
+                                  const std::string &query, const json &schema)
+{
+  json request_body = {{"contents", json::array()},
+                       {"generationConfig",
+                        {{"response_mime_type", "application/json"},
+                         {"response_schema", schema}}}};
+
+  json content = {{"parts", json::array()}};
+
+  std::vector<std::string> inline_files;
+  std::string text = query;
+  for (const auto &file_id : file_ids)
+  {
+    if (is_inline_file(file_id))
+    {
+      inline_files.push_back(file_id.substr(INLINE_FILE_PREFIX.size()));
+      continue;
+    }
+    if (is_cached_content(file_id))
+    {
+      request_body["cachedContent"] =
+          file_id.substr(CACHED_CONTENT_PREFIX.size());
+      const size_t at = text.find(QUIZ_QUERY_CONSTRAINTS);
+      if (at != std::string::npos)
+        text.erase(at, QUIZ_QUERY_CONSTRAINTS.size());
+      continue;
+    }
+    content["parts"].push_back(
+        {{"file_data",
+          {{"file_uri",
+            gemini_base_url + "/v1beta/files/" + file_id}}}});
+  }
+
+  content["parts"].push_back({{"text", text}});
+  request_body["contents"].push_back(content);
+
+  std::string body = request_body.dump();
+  if (inline_files.empty())
+    return body;
+
+  // The inline parts go first. Their base64 data is encoded straight from
+  // each file's mapping into the request, which is allocated once.
+  const std::string head = "{\"contents\":[{\"parts\":[";
+  if (body.compare(0, head.size(), head) != 0)
+  {
+    throw std::runtime_error("Unexpected generateContent request layout");
+  }
+
+  std::vector<std::unique_ptr<MappedFile>> files;
+  std::vector<std::string> part_heads;
+  size_t size = body.size();
+  for (const auto &filename : inline_files)
+  {
+    files.push_back(std::make_unique<MappedFile>(filename));
+    part_heads.push_back("{\"inline_data\":{\"mime_type\":" +
+                         json(get_mime_type(filename)).dump() +
+                         ",\"data\":\"");
+    size += part_heads.back().size() +
+            base64_encoded_size(files.back()->size()) + 4;
+  }
+
+  std::string result;
+  result.reserve(size);
+  result.append(head);
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    result.append(part_heads[i]);
+    const size_t start = result.size();
+    result.resize(start + base64_encoded_size(files[i]->size()));
+    base64_encode(reinterpret_cast<const unsigned char *>(files[i]->data()),
+                  files[i]->size(), &result[start]);
+    result.append("\"}},");
+  }
+  result.append(body, head.size(), std::string::npos);
+  return result;
+}
+
+std::string generate_content_url(const std::string &model,
+                                 const std::string &api_key)
+{
+  return gemini_base_url + "/v1beta/models/" + model +
+         ":generateContent?key=" + api_key;
+}
+
+std::string query_gemini(const std::vector<std::string> &file_ids,
+                         const std::string &query, const json &schema,
+                         const std::string &api_key, const std::string &model,
+                         RetryScheduler &retry)
+{
+  PhaseTimer phase("generate");
+  std::string url = generate_content_url(model, api_key);
+  std::string json_data = generate_content_body(file_ids, query, schema);
+
+  // Error responses which outlast the retries are reported by the caller
+  return perform_with_retry("Generation", retry,
+                            {"Content-Type: application/json"},
+                            [&](CURL *curl)
+                            {
+                              curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                              curl_easy_setopt(curl, CURLOPT_POSTFIELDS,
+                                               json_data.c_str());
+                            })
+      .body;
+}
+
+// Sends one generateContent request per query, each with its own files,
+// concurrently on the transfer engine. Requests failing with retryable
+// errors are retried together.
+std::vector<std::string>
+query_gemini_parallel(const std::vector<std::vector<std::string>> &file_ids,
+                      const std::vector<std::string> &queries,
+                      const json &schema, const std::string &api_key,
+                      const std::string &model, RetryScheduler &retry)
+{
+  PhaseTimer phase("generate");
+  std::string url = generate_content_url(model, api_key);
+  std::vector<std::string> bodies(queries.size());
+  for (size_t i = 0; i < queries.size(); ++i)
+    bodies[i] = generate_content_body(file_ids[i], queries[i], schema);
+
+  const std::vector<HttpResponse> responses = perform_all_with_retry(
+      "Generation", retry, queries.size(), {"Content-Type: application/json"},
+      [&](CURL *curl, const size_t i)
+      {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, bodies[i].c_str());
+      });
+
+  // Transport failures are thrown, as by query_gemini, and error responses
+  // are left for the caller to report
+  std::vector<std::string> results;
+  for (const auto &response : responses)
+  {
+    if (response.result != CURLE_OK)
+    {
+      throw std::runtime_error(std::string("Generation failed: ") +
+                               curl_easy_strerror(response.result));
+    }
+    if (response.body.empty() && is_retryable_status(response.status))
+    {
+      throw std::runtime_error("Generation failed (HTTP " +
+                               std::to_string(response.status) + ")");
+    }
+    results.push_back(response.body);
+  }
+  return results;
+}
+
+// As above, with the same files for every query
+std::vector<std::string>
+query_gemini_parallel(const std::vector<std::string> &file_ids,
+                      const std::vector<std::string> &queries,
+                      const json &schema, const std::string &api_key,
+                      const std::string &model, RetryScheduler &retry)
+{
+  return query_gemini_parallel(
+      std::vector<std::vector<std::string>>(queries.size(), file_ids), queries,
+      schema, api_key, model, retry);
+}
+
+std::string gemini_error_message(const json &error)
+{
+  std::string error_msg = "Gemini API Error";
+
+  if (error.contains("code"))
+  {
+    error_msg += " " + std::to_string(error["code"].get<int>());
+  }
+
+  if (error.contains("message"))
+  {
+    error_msg += ": " + error["message"].get<std::string>();
+  }
+
+  if (error.contains("status"))
+  {
+    error_msg += " (Status: " + error["status"].get<std::string>() + ")";
+  }
+
+  return error_msg;
+}
+
+// Decodes a quiz, or a single question, from the events of nlohmann's SAX
+// parser, straight into the Quiz; strings are moved into place, and no DOM
+// is built. Members not in the schema are skipped.
+class QuizDecoder : public nlohmann::json_sax<json>
+{
+public:
+  explicit QuizDecoder(Quiz &quiz, const bool question_only = false)
+      : quiz_(quiz), question_only_(question_only)
+  {
+  }
+
+  bool null() override { return true; }
+  bool boolean(bool) override { return true; }
+  bool number_integer(number_integer_t value) override
+  {
+    return number(static_cast<double>(value));
+  }
+  bool number_unsigned(number_unsigned_t value) override
+  {
+    return number(static_cast<double>(value));
+  }
+  bool number_float(number_float_t value, const string_t &) override
+  {
+    return number(value);
+  }
+  bool binary(binary_t &) override { return true; }
+
+  bool string(string_t &value) override
+  {
+    if (Question *question = field_question())
+    {
+      const std::string &key = frames_.back().key;
+      if (key == "title")
+        question->title = std::move(value);
+      else if (key == "question")
+        question->question = std::move(value);
+      else if (key == "explanation")
+        question->explanation = std::move(value);
+    }
+    else if (in_options())
+    {
+      quiz_.questions.back().options.push_back(std::move(value));
+    }
+    else if (!question_only_ && frames_.size() == 1 &&
+             frames_[0].key == "category")
+    {
+      quiz_.category = std::move(value);
+    }
+    return true;
+  }
+
+  bool start_object(std::size_t) override
+  {
+    const bool question =
+        question_only_ ? frames_.empty()
+                       : frames_.size() == 2 && frames_[1].is_array &&
+                             frames_[0].key == "questions";
+    if (question)
+    {
+      quiz_.questions.emplace_back();
+      question_frame_ = frames_.size();
+    }
+    frames_.push_back({false, ""});
+    return true;
+  }
+
+  bool key(string_t &key) override
+  {
+    frames_.back().key = key; // Not moved, as a ResponseDecoder shares it
+    return true;
+  }
+
+  bool end_object() override
+  {
+    frames_.pop_back();
+    if (frames_.size() == question_frame_)
+      question_frame_ = NONE;
+    return true;
+  }
+
+  bool start_array(std::size_t) override
+  {
+    frames_.push_back({true, ""});
+    return true;
+  }
+
+  bool end_array() override
+  {
+    frames_.pop_back();
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &ex) override
+  {
+    throw std::runtime_error(std::string("Failed to parse quiz: ") +
+                             ex.what());
+  }
+
+private:
+  struct Frame
+  {
+    bool is_array;
+    std::string key; // Of the current member, if an object
+  };
+
+  static const size_t NONE = size_t(-1);
+
+  // The question, if the current value is one of its members
+  Question *field_question()
+  {
+    if (question_frame_ == NONE || frames_.size() != question_frame_ + 1)
+      return nullptr;
+    return &quiz_.questions.back();
+  }
+
+  bool in_options() const
+  {
+    return question_frame_ != NONE && frames_.size() == question_frame_ + 2 &&
+           frames_.back().is_array && frames_[question_frame_].key == "options";
+  }
+
+  bool number(const double value)
+  {
+    if (Question *question = field_question())
+    {
+      if (frames_.back().key == "correct_answer")
+        question->correct_answer = static_cast<int>(value);
+    }
+    return true;
+  }
+
+  Quiz &quiz_;
+  bool question_only_;
+  std::vector<Frame> frames_;
+  size_t question_frame_ = NONE; // Index of the current question's frame
+};
+
+// Decodes a generateContent response with a single SAX pass, finding the
+// model's text (candidates[0].content.parts[0].text) and any error, without
+// building a DOM. A quiz given directly, as the part or as the whole
+// response, is decoded as it goes.
+class ResponseDecoder : public nlohmann::json_sax<json>
+{
+public:
+  std::string text;
+  bool has_text = false;
+  bool has_candidates = false;
+  json error; // Members of "error" which gemini_error_message reports
+  json usage; // Token counts of "usageMetadata"
+  Quiz top_quiz, part_quiz;
+
+  bool null() override
+  {
+    return value([](json_sax &d) { return d.null(); });
+  }
+  bool boolean(bool b) override
+  {
+    return value([&](json_sax &d) { return d.boolean(b); });
+  }
+  bool number_integer(number_integer_t n) override
+  {
+    if (in_error())
+      error[frames_.back().key] = n;
+    else if (in_usage())
+      usage[frames_.back().key] = n;
+    return value([&](json_sax &d) { return d.number_integer(n); });
+  }
+  bool number_unsigned(number_unsigned_t n) override
+  {
+    if (in_error())
+      error[frames_.back().key] = n;
+    else if (in_usage())
+      usage[frames_.back().key] = n;
+    return value([&](json_sax &d) { return d.number_unsigned(n); });
+  }
+  bool number_float(number_float_t n, const string_t &s) override
+  {
+    return value([&](json_sax &d) { return d.number_float(n, s); });
+  }
+  bool binary(binary_t &b) override
+  {
+    return value([&](json_sax &d) { return d.binary(b); });
+  }
+
+  bool string(string_t &s) override
+  {
+    if (part_frame_ != NONE && frames_.size() == part_frame_ + 1 &&
+        frames_.back().key == "text")
+    {
+      text = std::move(s);
+      has_text = true;
+      return true;
+    }
+    if (in_error())
+    {
+      error[frames_.back().key] = std::move(s);
+      return true;
+    }
+    return value([&](json_sax &d) { return d.string(s); });
+  }
+
+  bool start_object(std::size_t n) override
+  {
+    value([&](json_sax &d) { return d.start_object(n); });
+    if (is_first_part())
+    {
+      part_frame_ = frames_.size();
+      part_decoder_.start_object(n);
+    }
+    frames_.push_back({false, "", 0});
+    return true;
+  }
+
+  bool key(string_t &k) override
+  {
+    if (frames_.size() == 1 && k == "candidates")
+      has_candidates = true;
+    frames_.back().key = k;
+    return forward([&](json_sax &d) { return d.key(k); });
+  }
+
+  bool end_object() override
+  {
+    forward([](json_sax &d) { return d.end_object(); });
+    frames_.pop_back();
+    if (frames_.size() == part_frame_)
+      part_frame_ = NONE;
+    return true;
+  }
+
+  bool start_array(std::size_t n) override
+  {
+    value([&](json_sax &d) { return d.start_array(n); });
+    frames_.push_back({true, "", 0});
+    return true;
+  }
+
+  bool end_array() override
+  {
+    forward([](json_sax &d) { return d.end_array(); });
+    frames_.pop_back();
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &ex) override
+  {
+    throw std::runtime_error(std::string("Failed to parse response: ") +
+                             ex.what());
+  }
+
+private:
+  struct Frame
+  {
+    bool is_array;
+    std::string key; // Of the current member, if an object
+    size_t count;    // Elements so far, if an array
+  };
+
+  static const size_t NONE = size_t(-1);
+
+  // Passes the event on to the quiz decoders
+  template <typename Event> bool forward(Event event)
+  {
+    event(top_decoder_);
+    if (part_frame_ != NONE && frames_.size() > part_frame_)
+      event(part_decoder_);
+    return true;
+  }
+
+  // As forward, for an event starting a value
+  template <typename Event> bool value(Event event)
+  {
+    if (!frames_.empty() && frames_.back().is_array)
+      ++frames_.back().count;
+    return forward(event);
+  }
+
+  // Whether the object starting now is candidates[0].content.parts[0]
+  bool is_first_part() const
+  {
+    return frames_.size() == 5 && frames_[0].key == "candidates" &&
+           frames_[1].is_array && frames_[1].count == 1 &&
+           frames_[2].key == "content" && frames_[3].key == "parts" &&
+           frames_[4].is_array && frames_[4].count == 1;
+  }
+
+  bool in_error() const
+  {
+    return frames_.size() == 2 && frames_[0].key == "error" &&
+           !frames_[1].is_array;
+  }
+
+  bool in_usage() const
+  {
+    return frames_.size() == 2 && frames_[0].key == "usageMetadata" &&
+           !frames_[1].is_array;
+  }
+
+  std::vector<Frame> frames_;
+  size_t part_frame_ = NONE; // Index of the first part's frame
+  QuizDecoder top_decoder_{top_quiz}, part_decoder_{part_quiz};
+};
+
+Quiz decode_quiz_response(const std::string &response,
+                          const bool record_usage)
+{
+  PhaseTimer phase("parse");
+  ResponseDecoder decoder;
+  json::sax_parse(response, &decoder);
+  if (record_usage)
+    metrics.record_usage(decoder.usage);
+
+  // Check for error responses
+  if (!decoder.error.empty())
+  {
+    throw GeminiApiError(gemini_error_message(decoder.error));
+  }
+
+  // Handle different response formats
+  if (decoder.has_text)
+  {
+    Quiz quiz;
+    QuizDecoder quiz_decoder(quiz);
+    json::sax_parse(decoder.text, &quiz_decoder);
+    return quiz;
+  }
+  return decoder.has_candidates ? std::move(decoder.part_quiz)
+                                : std::move(decoder.top_quiz);
+}
+
+Quiz extract_quiz_data(const std::string &response)
+{
+  Quiz quiz = decode_quiz_response(response);
+  remove_invalid_questions(quiz.questions);
+  return quiz;
+}
+
+// Whether the response holds a complete quiz conforming to the schema
+bool is_valid_quiz_response(const std::string &response)
+{
+  Quiz quiz;
+  try
+  {
+    quiz = decode_quiz_response(response, false);
+  }
+  catch (const std::exception &)
+  {
+    return false;
+  }
+
+  if (quiz.questions.empty())
+    return false;
+
+  for (const auto &question : quiz.questions)
+  {
+    if (question.title.empty() || !question_problem(question).empty())
+      return false;
+  }
+
+  return true;
+}
+
+// Recent generation latencies, in seconds, are kept per model
+const size_t LATENCY_HISTORY_SIZE = 100;
+
+std::mutex latency_history_mutex;
+
+std::filesystem::path get_latency_history_path()
+{
+  return get_cache_dir() / "latency.json";
+}
+
+std::vector<double> read_latency_history(const std::string &model)
+{
+  std::lock_guard<std::mutex> lock(latency_history_mutex);
+  std::ifstream file(get_latency_history_path());
+  json history = json::parse(file, nullptr, false);
+  if (history.is_discarded() || !history.contains(model) ||
+      !history[model].is_array())
+    return {};
+  return history[model].get<std::vector<double>>();
+}
+
+void record_latency(const std::string &model, const double seconds)
+{
+  std::lock_guard<std::mutex> lock(latency_history_mutex);
+  std::ifstream file(get_latency_history_path());
+  json history = json::parse(file, nullptr, false);
+  file.close();
+  if (!history.is_object())
+    history = json::object();
+
+  json &samples = history[model];
+  if (!samples.is_array())
+    samples = json::array();
+  samples.push_back(seconds);
+  if (samples.size() > LATENCY_HISTORY_SIZE)
+    samples.erase(samples.begin());
+
+  try
+  {
+    write_json_file(get_latency_history_path(), history);
+  }
+  catch (const std::exception &)
+  {
+    // The history only tunes hedging; losing a sample is harmless
+  }
+}
+
+// Until enough latencies have been recorded, duplicates are sent after this
+const size_t HEDGE_MIN_SAMPLES = 20;
+
+const std::chrono::milliseconds HEDGE_DEFAULT_DELAY(45000);
+
+std::chrono::milliseconds hedge_delay(const std::string &model,
+                                      const HedgePolicy &hedge)
+{
+  if (hedge.percentile == 0)
+    return hedge.delay;
+
+  std::vector<double> samples = read_latency_history(model);
+  if (samples.size() < HEDGE_MIN_SAMPLES)
+    return HEDGE_DEFAULT_DELAY;
+
+  const size_t rank = std::min(samples.size() - 1,
+                               samples.size() * hedge.percentile / 100);
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  return std::chrono::milliseconds(static_cast<int64_t>(samples[rank] * 1000));
+}
+
+// As query_gemini, but if no schema-valid response has arrived from the
+// primary model within the hedge delay, a duplicate request is sent to the
+// hedge model. The first valid response wins, and the other request is
+// cancelled; an invalid or failed response also triggers the duplicate
+// without waiting.
+std::string query_gemini_hedged(const std::vector<std::string> &file_ids,
+                                const std::string &query, const json &schema,
+                                const std::string &api_key,
+                                const std::string &model,
+                                const HedgePolicy &hedge,
+                                RetryScheduler &retry,
+                                const bool quiet = false)
+{
+  PhaseTimer phase("generate");
+  struct Attempt
+  {
+    std::string model;
+    std::string url;
+    CURL *curl = nullptr;
+    std::string result;
+    std::map<std::string, std::string> headers;
+    std::chrono::steady_clock::time_point start;
+    CURLcode res = CURLE_OK;
+    long response_code = 0;
+    bool done = false;
+  };
+
+  const std::string json_data = generate_content_body(file_ids, query, schema);
+  const std::chrono::milliseconds delay = hedge_delay(model, hedge);
+
+  while (true)
+  {
+    struct curl_slist *headers = nullptr;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    std::array<Attempt, 2> attempts;
+    attempts[0].model = model;
+    attempts[1].model = hedge.model;
+
+    // Attempts finished on the transfer engine, by index, with their results
+    std::mutex finished_mutex;
+    std::condition_variable finished_changed;
+    std::vector<std::pair<size_t, CURLcode>> finished;
+
+    auto cleanup_handles = [&]()
+    {
+      for (auto &attempt : attempts)
+      {
+        if (!attempt.curl)
+          continue;
+        // Cancelling a transfer still in progress also drops its callback
+        transfer_engine.cancel(attempt.curl);
+        release_curl_handle(attempt.curl);
+      }
+      curl_slist_free_all(headers);
+    };
+
+    auto start_attempt = [&](const size_t index)
+    {
+      Attempt &attempt = attempts[index];
+      attempt.curl = make_curl_handle();
+      if (!attempt.curl)
+      {
+        cleanup_handles();
+        throw std::runtime_error("Failed to initialize CURL");
+      }
+
+      attempt.url = generate_content_url(attempt.model, api_key);
+      attempt.start = std::chrono::steady_clock::now();
+
+      curl_easy_setopt(attempt.curl, CURLOPT_URL, attempt.url.c_str());
+      curl_easy_setopt(attempt.curl, CURLOPT_POSTFIELDS, json_data.c_str());
+      curl_easy_setopt(attempt.curl, CURLOPT_WRITEFUNCTION, write_callback);
+      curl_easy_setopt(attempt.curl, CURLOPT_WRITEDATA, &attempt.result);
+      curl_easy_setopt(attempt.curl, CURLOPT_HEADERFUNCTION, header_callback);
+      curl_easy_setopt(attempt.curl, CURLOPT_HEADERDATA, &attempt.headers);
+      curl_easy_setopt(attempt.curl, CURLOPT_HTTPHEADER, headers);
+      retry.apply_deadline(attempt.curl);
+
+      transfer_engine.submit(attempt.curl,
+                             [&, index](CURLcode res)
+                             {
+                               std::lock_guard<std::mutex> lock(finished_mutex);
+                               finished.emplace_back(index, res);
+                               finished_changed.notify_all();
+                             });
+    };
+
+    start_attempt(0);
+
+    Attempt *winner = nullptr;
+    Attempt *rejected = nullptr; // A final error response, not worth hedging
+    bool hedged = false;
+    while (!winner && !rejected)
+    {
+      auto timeout = std::chrono::milliseconds(1000);
+      if (!hedged)
+      {
+        timeout = std::min(
+            timeout, std::chrono::duration_cast<std::chrono::milliseconds>(
+                         delay - (std::chrono::steady_clock::now() -
+                                  attempts[0].start)) +
+                         std::chrono::milliseconds(1));
+      }
+
+      std::vector<std::pair<size_t, CURLcode>> completions;
+      {
+        std::unique_lock<std::mutex> lock(finished_mutex);
+        finished_changed.wait_for(lock, timeout,
+                                  [&] { return !finished.empty(); });
+        completions.swap(finished);
+      }
+
+      for (const auto &[index, res] : completions)
+      {
+        Attempt &attempt = attempts[index];
+        attempt.done = true;
+        attempt.res = res;
+        curl_easy_getinfo(attempt.curl, CURLINFO_RESPONSE_CODE,
+                          &attempt.response_code);
+
+        if (attempt.res == CURLE_OK && attempt.response_code == 200 &&
+            is_valid_quiz_response(attempt.result))
+        {
+          winner = &attempt;
+          break;
+        }
+        if (attempt.res == CURLE_OK && attempt.response_code != 200 &&
+            !is_retryable_status(attempt.response_code))
+          rejected = &attempt;
+      }
+      if (winner || rejected)
+        break;
+
+      const auto elapsed = std::chrono::steady_clock::now() - attempts[0].start;
+      if (!hedged && (attempts[0].done || elapsed >= delay))
+      {
+        if (!quiet)
+        {
+          std::cerr << "No valid response from " << model << " after "
+                    << std::fixed << std::setprecision(1)
+                    << std::chrono::duration<double>(elapsed).count()
+                    << " s; also trying " << hedge.model << "..."
+                    << std::endl;
+        }
+        start_attempt(1);
+        hedged = true;
+        continue;
+      }
+
+      if (attempts[0].done && attempts[1].done)
+        break;
+    }
+
+    if (winner)
+    {
+      record_latency(winner->model,
+                     std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - winner->start)
+                         .count());
+      std::string result = std::move(winner->result);
+      cleanup_handles();
+      return result;
+    }
+
+    if (rejected)
+    {
+      std::string result = std::move(rejected->result);
+      cleanup_handles();
+      return result; // Reported by the caller, as by query_gemini
+    }
+
+    cleanup_handles();
+
+    // Both requests failed: retry both if either failure was transient
+    std::string reason;
+    std::chrono::milliseconds retry_after(0);
+    CURLcode failure = CURLE_OK;
+    for (const auto &attempt : attempts)
+    {
+      if (attempt.res != CURLE_OK)
+      {
+        if (!is_retryable_error(attempt.res))
+        {
+          failure = attempt.res;
+          break;
+        }
+        reason = curl_easy_strerror(attempt.res);
+      }
+      else if (is_retryable_status(attempt.response_code))
+      {
+        reason = "HTTP " + std::to_string(attempt.response_code);
+        retry_after = std::max(
+            retry_after, get_retry_after(attempt.headers, attempt.result));
+      }
+    }
+
+    if (failure == CURLE_OK && !reason.empty() &&
+        retry.wait_before_retry("Generation", reason, retry_after))
+      continue;
+
+    if (failure == CURLE_OK)
+      failure = attempts[0].res;
+    if (failure != CURLE_OK)
+    {
+      throw std::runtime_error("CURL request failed: " +
+                               std::string(curl_easy_strerror(failure)));
+    }
+    return attempts[0].result;
+  }
+}
+
+// Lowercase words of the text, ignoring punctuation and markup
+std::vector<std::string> normalized_words(const std::string &text)
+{
+  std::vector<std::string> words;
+  std::string word;
+  for (const unsigned char c : text)
+  {
+    if (std::isalnum(c) || c >= 0x80)
+    {
+      word += static_cast<char>(std::tolower(c));
+    }
+    else if (!word.empty())
+    {
+      words.push_back(std::move(word));
+      word.clear();
+    }
+  }
+  if (!word.empty())
+    words.push_back(std::move(word));
+  return words;
+}
+
+// Drops exact and near-exact duplicates: questions whose normalized text
+// matches, or whose words overlap almost entirely with, an earlier question.
+// Returns the number of questions dropped.
+size_t remove_duplicate_questions(std::vector<Question> &questions,
+                                  const double similarity_threshold = 0.9)
+{
+  std::vector<std::string> texts;
+  std::vector<std::set<std::string>> word_sets;
+  std::vector<Question> unique;
+
+  for (auto &question : questions)
+  {
+    std::vector<std::string> words = normalized_words(question.question);
+    std::string text;
+    for (const auto &word : words)
+      text += word + ' ';
+    std::set<std::string> word_set(words.begin(), words.end());
+
+    bool duplicate = false;
+    for (size_t i = 0; i < texts.size() && !duplicate; ++i)
+    {
+      if (texts[i] == text)
+      {
+        duplicate = true;
+        break;
+      }
+
+      size_t common = 0;
+      for (const auto &word : word_set)
+        common += word_sets[i].count(word);
+      const size_t total = word_set.size() + word_sets[i].size() - common;
+      duplicate = total > 0 && double(common) / total >= similarity_threshold;
+    }
+
+    if (!duplicate)
+    {
+      texts.push_back(std::move(text));
+      word_sets.push_back(std::move(word_set));
+      unique.push_back(std::move(question));
+    }
+  }
+
+  const size_t dropped = questions.size() - unique.size();
+  questions = std::move(unique);
+  return dropped;
+}
+
+QuestionIndex::QuestionIndex(const std::filesystem::path &path,
+                             const double similarity_threshold)
+    : path_(path), threshold_(similarity_threshold)
+{
+  if (path.empty())
+    return;
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return;
+
+  char magic[sizeof(MAGIC)] = {};
+  file.read(magic, sizeof(magic));
+  if (file.gcount() == 0)
+    return;
+  if (file.gcount() != sizeof(magic) ||
+      std::memcmp(magic, MAGIC, sizeof(magic)) != 0)
+  {
+    throw std::runtime_error("Not a question index: " + path.string());
+  }
+
+  std::error_code ec;
+  const uintmax_t count =
+      std::filesystem::file_size(path, ec) / sizeof(Signature);
+  if (!ec)
+  {
+    signatures_.reserve(count);
+    buckets_.reserve(count * BANDS);
+    next_.reserve(count * BANDS);
+  }
+
+  Signature signature;
+  while (file.read(reinterpret_cast<char *>(signature.data()),
+                   sizeof(Signature)))
+    insert(signature);
+  saved_ = signatures_.size();
+}
+
+size_t QuestionIndex::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return signatures_.size();
+}
+
+size_t QuestionIndex::remove_similar(std::vector<Question> &questions)
+{
+  std::vector<Question> kept;
+  for (auto &question : questions)
+  {
+    if (add(question))
+      kept.push_back(std::move(question));
+  }
+  const size_t dropped = questions.size() - kept.size();
+  questions = std::move(kept);
+  return dropped;
+}
+
+bool QuestionIndex::add(const Question &question)
+{
+  const Signature signature = signature_of(question);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (contains_similar(signature))
+    return false;
+  insert(signature);
+  return true;
+}
+
+void QuestionIndex::save()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (path_.empty() || saved_ == signatures_.size())
+    return;
+
+  std::error_code ec;
+  const bool is_new = !std::filesystem::exists(path_, ec) ||
+                      std::filesystem::file_size(path_, ec) == 0;
+  std::string data = is_new ? std::string(MAGIC, sizeof(MAGIC)) : "";
+  data.append(reinterpret_cast<const char *>(signatures_[saved_].data()),
+              (signatures_.size() - saved_) * sizeof(Signature));
+
+  // One write of whole records, so concurrent runs appending to the same
+  // index do not interleave within a record
+  std::ofstream file(path_, std::ios::binary | std::ios::app);
+  if (!file.write(data.data(), std::streamsize(data.size())))
+  {
+    throw std::runtime_error("Unable to write question index: " +
+                             path_.string());
+  }
+  saved_ = signatures_.size();
+}
+
+uint64_t QuestionIndex::mix(uint64_t x)
+{
+  // splitmix64's finalizer
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+uint64_t QuestionIndex::hash_word(const std::string &word)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const unsigned char c : word)
+    hash = (hash ^ c) * 0x100000001b3ull;
+  return hash;
+}
+
+QuestionIndex::Signature QuestionIndex::signature_of(const Question &question)
+{
+  std::string text = question.question;
+  for (const auto &option : question.options)
+    text += ' ' + option;
+  std::vector<std::string> words = normalized_words(text);
+  std::sort(words.begin(), words.end());
+  words.erase(std::unique(words.begin(), words.end()), words.end());
+
+  Signature signature;
+  signature.fill(UINT32_MAX);
+  for (const auto &word : words)
+  {
+    const uint64_t hash = hash_word(word);
+    for (size_t i = 0; i < HASHES; ++i)
+    {
+      const uint32_t value =
+          static_cast<uint32_t>(mix(hash + (i + 1) * 0x9e3779b97f4a7c15ull));
+      signature[i] = std::min(signature[i], value);
+    }
+  }
+  return signature;
+}
+
+uint64_t QuestionIndex::bucket_of(const Signature &signature, const size_t band)
+{
+  uint64_t key = band;
+  for (size_t row = 0; row < ROWS; ++row)
+    key = mix(key ^ signature[band * ROWS + row]);
+  return key;
+}
+
+bool QuestionIndex::contains_similar(const Signature &signature) const
+{
+  const size_t required = static_cast<size_t>(threshold_ * HASHES + 0.5);
+  for (size_t band = 0; band < BANDS; ++band)
+  {
+    auto head = buckets_.find(bucket_of(signature, band));
+    if (head == buckets_.end())
+      continue;
+    for (uint32_t i = head->second; i != NONE; i = next_[i * BANDS + band])
+    {
+      size_t equal = 0;
+      for (size_t j = 0; j < HASHES; ++j)
+        equal += signatures_[i][j] == signature[j];
+      if (equal >= required)
+        return true;
+    }
+  }
+  return false;
+}
+
+void QuestionIndex::insert(const Signature &signature)
+{
+  const uint32_t i = static_cast<uint32_t>(signatures_.size());
+  signatures_.push_back(signature);
+  for (size_t band = 0; band < BANDS; ++band)
+  {
+    auto [head, added] = buckets_.emplace(bucket_of(signature, band), i);
+    next_.push_back(added ? NONE : head->second);
+    head->second = i;
+  }
+}
+
+Quiz generate_quiz_sharded(const std::vector<std::string> &file_ids,
+                           const int num_questions, const int shards,
+                           const std::string &constraints, const json &schema,
+                           const std::string &api_key, RetryScheduler &retry,
+                           const bool quiet,
+                           const std::string &model,
+                           const HedgePolicy *hedge)
+{
+  std::vector<std::string> queries;
+  for (int i = 0; i < shards; ++i)
+  {
+    const int count = num_questions / shards + (i < num_questions % shards);
+    if (count == 0)
+      continue;
+
+    queries.push_back(
+        "From both the text and images in the provided files, generate " +
+        std::to_string(count) + " multiple choice questions." +
+        " This request is part " + std::to_string(i + 1) + " of " +
+        std::to_string(shards) +
+        ": divide the subject matter of the provided files into " +
+        std::to_string(shards) +
+        " distinct subtopic areas, and draw these questions only from area " +
+        std::to_string(i + 1) +
+        ", so that they do not overlap with questions from the other parts." +
+        constraints);
+  }
+
+  if (!quiet)
+    std::cout << "Sending " << queries.size()
+              << " concurrent generation requests..." << std::endl;
+
+  std::vector<std::string> responses;
+  if (hedge)
+  {
+    // Each shard is hedged independently
+    std::vector<std::future<std::string>> shards;
+    for (const auto &query : queries)
+    {
+      shards.push_back(std::async(std::launch::async, query_gemini_hedged,
+                                  std::cref(file_ids), std::cref(query),
+                                  std::cref(schema), std::cref(api_key),
+                                  std::cref(model), std::cref(*hedge), std::ref(retry),
+                                  quiet));
+    }
+    for (auto &shard : shards)
+      responses.push_back(shard.get());
+  }
+  else
+  {
+    responses =
+        query_gemini_parallel(file_ids, queries, schema, api_key, model, retry);
+  }
+
+  Quiz quiz;
+  for (const auto &response : responses)
+  {
+    Quiz shard = extract_quiz_data(response);
+    if (quiz.category.empty())
+      quiz.category = std::move(shard.category);
+    std::move(shard.questions.begin(), shard.questions.end(),
+              std::back_inserter(quiz.questions));
+  }
+
+  const size_t dropped = remove_duplicate_questions(quiz.questions);
+  if (!quiet && dropped > 0)
+    std::cout << "Dropped " << dropped << " duplicate questions." << std::endl;
+
+  return quiz;
+}
+
+void QuizStreamParser::feed(const std::string &text)
+{
+  buffer_ += text;
+
+  for (; pos_ < buffer_.size(); ++pos_)
+  {
+    const char c = buffer_[pos_];
+
+    if (in_string_)
+    {
+      if (escaped_)
+        escaped_ = false;
+      else if (c == '\\')
+        escaped_ = true;
+      else if (c == '"')
+        end_string();
+      continue;
+    }
+
+    switch (c)
+    {
+    case '"':
+      in_string_ = true;
+      string_start_ = pos_;
+      break;
+    case '{':
+    case '[':
+      if (depth_ == 0)
+        expect_key_ = true;
+      else if (depth_ == 1 && c == '[' && key_ == "questions")
+        in_questions_ = true;
+      else if (depth_ == 2 && in_questions_ && c == '{')
+        object_start_ = pos_;
+      ++depth_;
+      break;
+    case '}':
+    case ']':
+      --depth_;
+      if (depth_ == 2 && object_start_ != std::string::npos)
+      {
+        Quiz quiz;
+        QuizDecoder decoder(quiz, true);
+        json::sax_parse(buffer_.begin() + object_start_,
+                        buffer_.begin() + pos_ + 1, &decoder);
+        on_question(quiz.questions.back());
+        object_start_ = std::string::npos;
+      }
+      else if (depth_ == 1)
+      {
+        in_questions_ = false;
+      }
+      break;
+    case ':':
+      if (depth_ == 1)
+        expect_key_ = false;
+      break;
+    case ',':
+      if (depth_ == 1)
+        expect_key_ = true;
+      break;
+    }
+  }
+
+  compact();
+}
+
+void QuizStreamParser::end_string()
+{
+  in_string_ = false;
+  if (depth_ != 1)
+    return;
+
+  std::string value =
+      json::parse(buffer_.begin() + string_start_, buffer_.begin() + pos_ + 1)
+          .get<std::string>();
+  if (expect_key_)
+    key_ = std::move(value);
+  else if (key_ == "category" && on_category)
+    on_category(value);
+}
+
+void QuizStreamParser::compact()
+{
+  size_t keep = pos_;
+  if (object_start_ != std::string::npos)
+    keep = object_start_;
+  else if (in_string_)
+    keep = string_start_;
+
+  buffer_.erase(0, keep);
+  pos_ -= keep;
+  if (object_start_ != std::string::npos)
+    object_start_ -= keep;
+  if (in_string_)
+    string_start_ -= keep;
+}
+
+struct StreamState
+{
+  CURL *curl;
+  std::function<void(const std::string &)> on_text;
+  std::string pending;    // Incomplete line of the event stream
+  std::string event_data; // Data lines of the current event
+  std::string error_body; // Body of a non-200 response
+  bool received = false; // Whether any text has been passed to on_text
+  json usage;            // The latest usageMetadata, which is cumulative
+  std::exception_ptr error;
+};
+
+void dispatch_stream_event(StreamState *state)
+{
+  json chunk = json::parse(state->event_data);
+  state->event_data.clear();
+
+  if (chunk.contains("error"))
+  {
+    throw GeminiApiError(gemini_error_message(chunk["error"]));
+  }
+
+  if (chunk.contains("usageMetadata"))
+    state->usage = std::move(chunk["usageMetadata"]);
+
+  if (!chunk.contains("candidates") || chunk["candidates"].empty())
+    return;
+
+  const json &candidate = chunk["candidates"][0];
+  if (!candidate.contains("content") || !candidate["content"].contains("parts"))
+    return;
+
+  for (const auto &part : candidate["content"]["parts"])
+  {
+    if (part.contains("text") && !part.value("thought", false))
+    {
+      state->received = true;
+      state->on_text(part["text"].get<std::string>());
+    }
+  }
+}
+
+// Splits the server-sent event stream into events. Exceptions must not
+// propagate through libcurl, so they are stored and the transfer aborted.
+size_t stream_write_callback(void *contents, size_t size, size_t nmemb,
+                             StreamState *state)
+{
+  size_t total_size = size * nmemb;
+
+  long response_code = 0;
+  curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &response_code);
+  if (response_code != 200)
+  {
+    state->error_body.append((char *)contents, total_size);
+    return total_size;
+  }
+
+  state->pending.append((char *)contents, total_size);
+
+  try
+  {
+    size_t line_end;
+    while ((line_end = state->pending.find('\n')) != std::string::npos)
+    {
+      std::string line = state->pending.substr(0, line_end);
+      state->pending.erase(0, line_end + 1);
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+
+      if (line.empty())
+      {
+        if (!state->event_data.empty())
+          dispatch_stream_event(state);
+      }
+      else if (line.compare(0, 5, "data:") == 0)
+      {
+        if (!state->event_data.empty())
+          state->event_data += '\n';
+        state->event_data += line.substr(line[5] == ' ' ? 6 : 5);
+      }
+    }
+  }
+  catch (...)
+  {
+    state->error = std::current_exception();
+    return 0;
+  }
+
+  return total_size;
+}
+
+// As query_gemini, but via streamGenerateContent; on_text receives each
+// fragment of the model's output as it arrives. A failed request is retried
+// only if none of its output has been passed on yet.
+void query_gemini_stream(const std::vector<std::string> &file_ids,
+                         const std::string &query, const json &schema,
+                         const std::string &api_key,
+                         const std::function<void(const std::string &)> &on_text,
+                         const std::string &model, RetryScheduler &retry)
+{
+  PhaseTimer phase("generate");
+  std::string url = gemini_base_url + "/v1beta/models/" + model +
+                    ":streamGenerateContent?alt=sse&key=" + api_key;
+  std::string json_data = generate_content_body(file_ids, query, schema);
+
+  StreamState state;
+  auto setup = [&](CURL *curl)
+  {
+    state = StreamState();
+    state.curl = curl;
+    state.on_text = on_text;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state);
+  };
+
+  // Output already passed on cannot be taken back, so is not retried
+  auto inspect = [&](HttpResponse &response)
+  {
+    if (state.error)
+    {
+      std::rethrow_exception(state.error);
+    }
+    response.body = state.error_body;
+    return !state.received;
+  };
+
+  perform_with_retry("Generation", retry, {"Content-Type: application/json"},
+                     setup, inspect);
+
+  if (!state.error_body.empty())
+  {
+    json response = json::parse(state.error_body, nullptr, false);
+    if (response.is_array() && !response.empty())
+      response = response[0];
+    if (response.is_object() && response.contains("error"))
+      throw GeminiApiError(gemini_error_message(response["error"]));
+    throw GeminiApiError("Gemini API Error: " + state.error_body);
+  }
+
+  if (!state.event_data.empty())
+  {
+    dispatch_stream_event(&state);
+  }
+  metrics.record_usage(state.usage);
+}
+
+// Streams the quiz and passes GIFT text to emit as soon as each question is
+// complete. The category line comes first, so any questions arriving before
+// the category are held back until it does. The quiz is also collected into
+// streamed, if given. Questions rejected by accept, if given, are dropped.
+void stream_quiz_as_gift(const std::vector<std::string> &file_ids,
+                         const std::string &query, const json &schema,
+                         const std::string &api_key,
+                         const std::string &context_override,
+                         const std::function<void(const std::string &)> &emit,
+                         RetryScheduler &retry,
+                         const std::string &model = GEMINI_MODEL_FLASH,
+                         Quiz *streamed = nullptr,
+                         const std::function<bool(const Question &)> &accept =
+                             nullptr)
+{
+  bool category_emitted = false;
+  std::vector<std::string> held;
+
+  auto emit_category = [&](const std::string &category)
+  {
+    emit(convert_category_to_gift(category, context_override));
+    category_emitted = true;
+    for (const auto &gift : held)
+      emit(gift);
+    held.clear();
+  };
+
+  if (!context_override.empty())
+    emit_category("");
+
+  QuizStreamParser parser;
+  parser.on_category = [&](const std::string &category)
+  {
+    if (streamed)
+      streamed->category = category;
+    if (!category_emitted)
+      emit_category(category);
+  };
+  parser.on_question = [&](Question &question)
+  {
+    const std::string problem = question_problem(question);
+    if (!problem.empty())
+    {
+      std::cerr << "Dropped question \"" << question.title
+                << "\": " << problem << std::endl;
+      return;
+    }
+    if (accept && !accept(question))
+      return;
+    std::string gift = convert_question_to_gift(question);
+    if (category_emitted)
+      emit(gift);
+    else
+      held.push_back(std::move(gift));
+    if (streamed)
+      streamed->questions.push_back(std::move(question));
+  };
+
+  query_gemini_stream(file_ids, query, schema, api_key,
+                      [&parser](const std::string &text) { parser.feed(text); },
+                      model, retry);
+
+  if (!category_emitted)
+    emit_category("");
+}
+
+std::string build_quiz_query(const int num_questions,
+                             const std::string &custom_prompt)
+{
+  if (!custom_prompt.empty())
+    return custom_prompt + QUIZ_QUERY_CONSTRAINTS;
+
+  return "From both the text and images in the provided files, generate " +
+         std::to_string(num_questions) + " multiple choice questions." +
+         QUIZ_QUERY_CONSTRAINTS;
+}
+
+// Total size of the cached responses; the least recently used are evicted
+const uintmax_t RESPONSE_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+
+std::filesystem::path get_response_cache_dir()
+{
+  return get_cache_dir() / "responses";
+}
+
+std::string response_cache_key(const std::vector<std::string> &filenames,
+                               const std::string &query, const json &schema,
+                               const std::string &model, const int shards,
+                               const bool per_document,
+                               const HedgePolicy *hedge)
+{
+  Sha256 sha;
+  auto add = [&sha](const std::string &field)
+  {
+    const std::string length = std::to_string(field.size()) + ":";
+    sha.update(length.data(), length.size());
+    sha.update(field.data(), field.size());
+  };
+
+  for (const auto &filename : filenames)
+    add(hash_file(filename));
+  add(query);
+  add(schema.dump());
+  add(model);
+  add(std::to_string(shards));
+  if (per_document)
+    add("per-document");
+  if (image_budget > 0)
+    add("image-budget:" + std::to_string(image_budget));
+  if (hedge)
+    add("hedge:" + hedge->model);
+  return sha.hex_digest();
+}
+
+json quiz_to_json(const Quiz &quiz)
+{
+  json questions = json::array();
+  for (const auto &question : quiz.questions)
+  {
+    questions.push_back({{"title", question.title},
+                         {"question", question.question},
+                         {"options", question.options},
+                         {"correct_answer", question.correct_answer},
+                         {"explanation", question.explanation}});
+  }
+  return {{"category", quiz.category}, {"questions", std::move(questions)}};
+}
+
+std::optional<Quiz> load_cached_quiz(const std::string &key)
+{
+  const std::filesystem::path path = get_response_cache_dir() / (key + ".json");
+  std::ifstream file(path, std::ios::binary);
+  if (!file.good())
+    return std::nullopt;
+  const std::string data((std::istreambuf_iterator<char>(file)), {});
+  file.close();
+
+  Quiz quiz;
+  try
+  {
+    QuizDecoder decoder(quiz);
+    json::sax_parse(data, &decoder);
+  }
+  catch (const std::exception &)
+  {
+    return std::nullopt;
+  }
+  if (quiz.questions.empty())
+    return std::nullopt;
+
+  std::error_code ec;
+  std::filesystem::last_write_time(
+      path, std::filesystem::file_time_type::clock::now(), ec);
+  return quiz;
+}
+
+// Caches the quiz, then evicts the least recently used entries until the
+// cache fits within RESPONSE_CACHE_MAX_BYTES
+void store_cached_quiz(const std::string &key, const Quiz &quiz)
+{
+  const std::filesystem::path dir = get_response_cache_dir();
+  write_json_file(dir / (key + ".json"), quiz_to_json(quiz));
+  evict_cache_files(dir, RESPONSE_CACHE_MAX_BYTES);
+}
+
+void write_quiz_output(const Quiz &quiz, const std::string &output_file,
+                       const std::string &context_override,
+                       const bool quiet)
+{
+  if (!output_file.empty())
+  {
+    std::ofstream file(output_file);
+    if (!file.is_open())
+    {
+      throw std::runtime_error("Unable to open output file: " + output_file);
+    }
+    write_gift_format(file, quiz, context_override);
+    file.close();
+    if (!quiet)
+      std::cout << "GIFT quiz saved to: " << output_file << std::endl;
+  }
+  else
+  {
+    write_gift_format(std::cout, quiz, context_override);
+    std::cout << std::endl;
+  }
+}
+
+// Appended to a query, so the model does not repeat the questions titled
+std::string exclusion_clause(const std::vector<std::string> &titles)
+{
+  if (titles.empty())
+    return "";
+  std::string clause =
+      " Do not repeat, or paraphrase, any of the questions titled:";
+  for (const auto &title : titles)
+    clause += " \"" + title + "\";";
+  return clause;
+}
+
+// Requests for more questions, after some were dropped as similar to those
+// in the question index, stop after this many
+const int QUESTION_INDEX_BACKFILL_ROUNDS = 2;
+
+// Asks for the missing number of questions again, steering the model away
+// from the titles seen so far; and keeps those not similar to a question in
+// the index. Returns the new questions.
+std::vector<Question> backfill_questions(size_t missing,
+                                         std::vector<std::string> titles,
+                                         QuestionIndex &index,
+                                         const std::vector<std::string>
+                                             &file_ids,
+                                         const json &schema,
+                                         const std::string &api_key,
+                                         RetryScheduler &retry,
+                                         const std::string &model,
+                                         const bool quiet)
+{
+  std::vector<Question> added;
+  for (int round = 0; round < QUESTION_INDEX_BACKFILL_ROUNDS && missing > 0;
+       ++round)
+  {
+    if (!quiet)
+      std::cout << "Requesting " << missing
+                << " more questions to replace those already in the question "
+                   "bank."
+                << std::endl;
+
+    const std::string query =
+        build_quiz_query(int(missing)) + exclusion_clause(titles);
+
+    Quiz extra = extract_quiz_data(
+        query_gemini(file_ids, query, schema, api_key, model, retry));
+    if (extra.questions.size() > missing)
+      extra.questions.resize(missing);
+    for (const auto &question : extra.questions)
+      titles.push_back(question.title);
+
+    index.remove_similar(extra.questions);
+    missing -= extra.questions.size();
+    std::move(extra.questions.begin(), extra.questions.end(),
+              std::back_inserter(added));
+  }
+  return added;
+}
+
+// In per-document generation, a document's share of the questions follows
+// its length in pages; other files are counted in pages of this many bytes
+const uintmax_t DOCUMENT_PAGE_BYTES = 3000;
+
+// Documents shorter than this many pages are grouped into one request
+const double DOCUMENT_GROUP_MIN_PAGES = 5;
+
+// Counts the page objects of a PDF ("/Type /Page", not "/Type /Pages");
+// those inside compressed object streams are not seen, so this may be zero
+size_t count_pdf_pages(const MappedFile &file)
+{
+  static const std::string_view type = "/Type";
+  const std::string_view data(file.data(), file.size());
+  size_t pages = 0;
+  for (size_t pos = data.find(type); pos != std::string_view::npos;
+       pos = data.find(type, pos))
+  {
+    pos += type.size();
+    while (pos < data.size() && std::isspace((unsigned char)data[pos]))
+      ++pos;
+    if (data.compare(pos, 5, "/Page") == 0 &&
+        (pos + 5 == data.size() || !std::isalnum((unsigned char)data[pos + 5])))
+      ++pages;
+  }
+  return pages;
+}
+
+double document_pages(const std::string &filename)
+{
+  const std::string mime_type = get_mime_type(filename);
+  if (mime_type.compare(0, 6, "image/") == 0)
+    return 1;
+
+  MappedFile file(filename);
+  if (mime_type == "application/pdf")
+  {
+    if (const size_t pages = count_pdf_pages(file))
+      return double(pages);
+  }
+  return std::max(1.0, double(file.size()) / DOCUMENT_PAGE_BYTES);
+}
+
+std::vector<DocumentGroup>
+plan_document_groups(const std::vector<std::string> &file_ids,
+                     const std::vector<double> &pages, const int num_questions)
+{
+  std::vector<DocumentGroup> groups;
+  DocumentGroup small;
+  for (size_t i = 0; i < file_ids.size(); ++i)
+  {
+    DocumentGroup &group = pages[i] < DOCUMENT_GROUP_MIN_PAGES
+                               ? small
+                               : groups.emplace_back();
+    group.file_ids.push_back(file_ids[i]);
+    group.pages += pages[i];
+    if (small.pages >= DOCUMENT_GROUP_MIN_PAGES)
+      groups.push_back(std::exchange(small, DocumentGroup()));
+  }
+  if (!small.file_ids.empty())
+    groups.push_back(std::move(small));
+
+  int remaining = num_questions;
+  if (remaining >= int(groups.size()))
+  {
+    for (auto &group : groups)
+      group.num_questions = 1;
+    remaining -= int(groups.size());
+  }
+
+  double total_pages = 0;
+  for (const auto &group : groups)
+    total_pages += group.pages;
+
+  std::vector<std::pair<double, size_t>> remainders;
+  int allocated = 0;
+  for (size_t i = 0; i < groups.size(); ++i)
+  {
+    const double share = remaining * groups[i].pages / total_pages;
+    const int whole = int(share);
+    groups[i].num_questions += whole;
+    allocated += whole;
+    remainders.emplace_back(share - whole, i);
+  }
+  std::stable_sort(remainders.begin(), remainders.end(),
+                   [](const auto &a, const auto &b) { return a.first > b.first; });
+  for (int i = 0; i < remaining - allocated; ++i)
+    ++groups[remainders[i].second].num_questions;
+
+  groups.erase(std::remove_if(groups.begin(), groups.end(),
+                              [](const DocumentGroup &group)
+                              { return group.num_questions == 0; }),
+               groups.end());
+  return groups;
+}
+
+// Sends one request per document group, concurrently, and merges the
+// results: each group's questions are interleaved in proportion to its
+// share, so no document dominates any part of the quiz; duplicates across
+// documents are dropped, and a group short of its share (after an
+// overlong answer is trimmed, or duplicates dropped) is asked once more.
+// The category is taken from the group with the most questions.
+Quiz generate_quiz_per_document(const std::vector<DocumentGroup> &groups,
+                                const std::string &constraints,
+                                const json &schema, const std::string &api_key,
+                                RetryScheduler &retry,
+                                const bool quiet = false,
+                                const std::string &model = GEMINI_MODEL_FLASH,
+                                const HedgePolicy *hedge = nullptr)
+{
+  auto query_for = [&](const int count, const std::string &extra)
+  {
+    return "From both the text and images in the provided files, generate " +
+           std::to_string(count) + " multiple choice questions." + extra +
+           constraints;
+  };
+
+  auto generate = [&](const std::vector<size_t> &which,
+                      const std::vector<int> &counts,
+                      const std::vector<std::string> &extras)
+  {
+    std::vector<std::vector<std::string>> file_ids;
+    std::vector<std::string> queries;
+    for (size_t j = 0; j < which.size(); ++j)
+    {
+      file_ids.push_back(groups[which[j]].file_ids);
+      queries.push_back(query_for(counts[j], extras[j]));
+    }
+
+    std::vector<std::string> responses;
+    if (hedge)
+    {
+      // Each document's request is hedged independently
+      std::vector<std::future<std::string>> requests;
+      for (size_t j = 0; j < queries.size(); ++j)
+      {
+        requests.push_back(std::async(
+            std::launch::async, query_gemini_hedged, std::cref(file_ids[j]),
+            std::cref(queries[j]), std::cref(schema), std::cref(api_key),
+            std::cref(model), std::cref(*hedge), std::ref(retry), quiet));
+      }
+      for (auto &request : requests)
+        responses.push_back(request.get());
+    }
+    else
+    {
+      responses = query_gemini_parallel(file_ids, queries, schema, api_key,
+                                        model, retry);
+    }
+
+    std::vector<Quiz> quizzes;
+    for (size_t j = 0; j < responses.size(); ++j)
+    {
+      quizzes.push_back(extract_quiz_data(responses[j]));
+      if (quizzes.back().questions.size() > size_t(counts[j]))
+        quizzes.back().questions.resize(counts[j]);
+    }
+    return quizzes;
+  };
+
+  if (!quiet)
+    std::cout << "Sending " << groups.size()
+              << " concurrent generation requests, one per document group..."
+              << std::endl;
+
+  std::vector<size_t> all(groups.size());
+  std::iota(all.begin(), all.end(), 0);
+  std::vector<int> counts;
+  for (const auto &group : groups)
+    counts.push_back(group.num_questions);
+  std::vector<Quiz> quizzes =
+      generate(all, counts, std::vector<std::string>(groups.size()));
+
+  // Interleaves the groups' questions: the next question is always taken
+  // from the group furthest behind its share of those taken so far
+  auto merge = [&]()
+  {
+    std::vector<size_t> taken(quizzes.size(), 0);
+    std::vector<Question> merged;
+    for (;;)
+    {
+      size_t best = quizzes.size();
+      double best_progress = 0;
+      for (size_t i = 0; i < quizzes.size(); ++i)
+      {
+        if (taken[i] == quizzes[i].questions.size())
+          continue;
+        const double progress = (taken[i] + 0.5) / groups[i].num_questions;
+        if (best == quizzes.size() || progress < best_progress)
+        {
+          best = i;
+          best_progress = progress;
+        }
+      }
+      if (best == quizzes.size())
+        break;
+      merged.push_back(quizzes[best].questions[taken[best]++]);
+    }
+    return merged;
+  };
+
+  // Drops duplicates from the merged quiz, and from each group's questions,
+  // so that each group's shortfall is known
+  auto deduplicate = [&]()
+  {
+    std::vector<Question> merged = merge();
+    const size_t dropped = remove_duplicate_questions(merged);
+    std::set<std::string> kept;
+    for (const auto &question : merged)
+      kept.insert(question.title + '\n' + question.question);
+    for (auto &quiz : quizzes)
+    {
+      quiz.questions.erase(
+          std::remove_if(quiz.questions.begin(), quiz.questions.end(),
+                         [&](const Question &question)
+                         {
+                           return !kept.erase(question.title + '\n' +
+                                              question.question);
+                         }),
+          quiz.questions.end());
+    }
+    return dropped;
+  };
+
+  const size_t dropped = deduplicate();
+  if (!quiet && dropped > 0)
+    std::cout << "Dropped " << dropped << " duplicate questions." << std::endl;
+
+  std::vector<size_t> short_groups;
+  std::vector<int> shortfalls;
+  std::vector<std::string> exclusions;
+  std::vector<std::string> titles;
+  for (const auto &quiz : quizzes)
+    for (const auto &question : quiz.questions)
+      titles.push_back(question.title);
+  for (size_t i = 0; i < groups.size(); ++i)
+  {
+    const size_t have = quizzes[i].questions.size();
+    if (have < size_t(groups[i].num_questions))
+    {
+      short_groups.push_back(i);
+      shortfalls.push_back(groups[i].num_questions - int(have));
+      exclusions.push_back(exclusion_clause(titles));
+    }
+  }
+
+  if (!short_groups.empty())
+  {
+    if (!quiet)
+      std::cout << "Asking " << short_groups.size()
+                << " document groups for the questions they are short of..."
+                << std::endl;
+    std::vector<Quiz> extra = generate(short_groups, shortfalls, exclusions);
+    for (size_t j = 0; j < short_groups.size(); ++j)
+    {
+      auto &questions = quizzes[short_groups[j]].questions;
+      std::move(extra[j].questions.begin(), extra[j].questions.end(),
+                std::back_inserter(questions));
+    }
+    deduplicate();
+  }
+
+  Quiz quiz;
+  size_t largest = 0;
+  for (size_t i = 0; i < groups.size(); ++i)
+  {
+    if (groups[i].num_questions > groups[largest].num_questions)
+      largest = i;
+  }
+  quiz.category = quizzes[largest].category;
+  for (size_t i = 0; quiz.category.empty() && i < quizzes.size(); ++i)
+    quiz.category = quizzes[i].category;
+  quiz.questions = merge();
+  return quiz;
+}
+
+void run_quiz_generation(const std::vector<std::string> &file_ids,
+                         const std::string &api_key,
+                         const GenerationOptions &options,
+                         RetryScheduler &retry)
+{
+  json schema = generate_quiz_schema();
+  const std::string query =
+      build_quiz_query(options.num_questions, options.custom_prompt);
+
+  bool satisfied = false;
+  while (!satisfied)
+  {
+    std::string gift_output;
+    try
+    {
+      if (options.stream)
+      {
+        // Each question is shown, or written, as soon as it is complete
+        std::ofstream file;
+        if (!options.interactive && !options.out &&
+            !options.output_file.empty())
+        {
+          file.open(options.output_file);
+          if (!file.is_open())
+          {
+            throw std::runtime_error("Unable to open output file: " +
+                                     options.output_file);
+          }
+        }
+        std::ostream &sink = options.out       ? *options.out
+                             : file.is_open() ? file
+                                              : std::cout;
+
+        if (options.interactive)
+          std::cout << "\n";
+
+        Quiz streamed;
+        std::vector<std::string> titles;
+        size_t dropped = 0;
+        auto accept = [&](const Question &question)
+        {
+          titles.push_back(question.title);
+          if (options.index->add(question))
+            return true;
+          ++dropped;
+          return false;
+        };
+        stream_quiz_as_gift(file_ids, query, schema, api_key,
+                            options.context_override,
+                            [&](const std::string &gift)
+                            {
+                              sink << gift << std::flush;
+                              if (options.interactive)
+                                gift_output += gift;
+                            },
+                            retry, options.model,
+                            options.cache_key.empty() ? nullptr : &streamed,
+                            options.index ? accept
+                                  : std::function<bool(const Question &)>());
+
+        if (options.index && dropped > 0)
+        {
+          if (!options.quiet)
+            std::cout << "Dropped " << dropped
+                      << " questions already in the question bank."
+                      << std::endl;
+          if (options.custom_prompt.empty())
+          {
+            for (const auto &question :
+                 backfill_questions(dropped, titles, *options.index, file_ids,
+                                    schema, api_key, retry, options.model,
+                                    options.quiet))
+              sink << convert_question_to_gift(question) << std::flush;
+          }
+        }
+
+        if (!options.cache_key.empty() && !streamed.questions.empty())
+          store_cached_quiz(options.cache_key, streamed);
+
+        if (!options.interactive)
+        {
+          if (options.lease)
+            options.lease->release();
+          if (options.index)
+            options.index->save();
+          if (options.out)
+          {
+            options.out->flush();
+          }
+          else if (file.is_open())
+          {
+            file.close();
+            if (!options.quiet)
+              std::cout << "GIFT quiz saved to: " << options.output_file
+                        << std::endl;
+          }
+          else
+          {
+            std::cout << std::endl;
+          }
+          return;
+        }
+      }
+      else
+      {
+        Quiz quiz_data;
+        if (options.documents)
+        {
+          quiz_data = generate_quiz_per_document(*options.documents,
+                                                 QUIZ_QUERY_CONSTRAINTS,
+                                                 schema, api_key, retry,
+                                                 options.quiet, options.model,
+                                                 options.hedge);
+        }
+        else if (options.shards > 1)
+        {
+          quiz_data = generate_quiz_sharded(
+              file_ids, options.num_questions, options.shards,
+              QUIZ_QUERY_CONSTRAINTS, schema, api_key, retry, options.quiet,
+              options.model, options.hedge);
+        }
+        else
+        {
+          std::string response =
+              options.hedge
+                  ? query_gemini_hedged(file_ids, query, schema, api_key,
+                                        options.model, *options.hedge, retry,
+                                        options.quiet)
+                  : query_gemini(file_ids, query, schema, api_key,
+                                 options.model, retry);
+          // std::cout << "Gemini response: " << response << std::endl;
+          quiz_data = extract_quiz_data(response);
+        }
+
+        if (options.index)
+        {
+          std::vector<std::string> titles;
+          for (const auto &question : quiz_data.questions)
+            titles.push_back(question.title);
+          const size_t dropped =
+              options.index->remove_similar(quiz_data.questions);
+          if (!options.quiet && dropped > 0)
+            std::cout << "Dropped " << dropped
+                      << " questions already in the question bank."
+                      << std::endl;
+          if (dropped > 0 && options.custom_prompt.empty())
+          {
+            std::vector<Question> extra =
+                backfill_questions(dropped, titles, *options.index, file_ids,
+                                   schema, api_key, retry, options.model,
+                                   options.quiet);
+            std::move(extra.begin(), extra.end(),
+                      std::back_inserter(quiz_data.questions));
+          }
+        }
+
+        if (!options.interactive)
+        {
+          if (options.lease)
+            options.lease->release();
+          if (!options.cache_key.empty() && !quiz_data.questions.empty())
+            store_cached_quiz(options.cache_key, quiz_data);
+
+          // Rendered straight to the output, with no intermediate copy
+          if (options.out)
+          {
+            write_gift_format(*options.out, quiz_data,
+                              options.context_override);
+            options.out->flush();
+          }
+          else
+          {
+            write_quiz_output(quiz_data, options.output_file,
+                              options.context_override, options.quiet);
+          }
+          if (options.index)
+            options.index->save();
+          return;
+        }
+
+        gift_output =
+            convert_to_gift_format(quiz_data, options.context_override);
+      }
+    }
+    catch (const GeminiApiError &e)
+    {
+      // Retryable failures have already been retried by the scheduler; only
+      // an interactive user is asked whether to go on
+      if (!options.interactive)
+        throw;
+
+      std::cerr << e.what() << std::endl;
+      std::cout << "Try again? (y/n): ";
+      std::string user_input;
+      std::getline(std::cin, user_input);
+
+      if (user_input != "y" && user_input != "Y" && user_input != "yes" &&
+          user_input != "Yes")
+      {
+        throw std::runtime_error("User chose to exit after API error");
+      }
+      continue; // Skip to next iteration of the while loop
+    }
+
+    if (options.interactive)
+    {
+      if (options.stream)
+        std::cout << std::endl; // Already shown as it streamed in
+      else
+        std::cout << "\n" << gift_output << std::endl;
+
+      std::cout << "Is this output good enough? (y/n): ";
+      std::string user_input;
+      std::getline(std::cin, user_input);
+
+      satisfied = (user_input == "y" || user_input == "Y" ||
+                   user_input == "yes" || user_input == "Yes");
+    }
+    else
+    {
+      satisfied = true; // Exit after first generation
+    }
+
+    if (satisfied)
+    {
+      if (options.lease)
+        options.lease->release();
+      if (!options.output_file.empty())
+      {
+        PhaseTimer phase("write");
+        std::ofstream file(options.output_file);
+        if (!file.is_open())
+        {
+          throw std::runtime_error("Unable to open output file: " +
+                                   options.output_file);
+        }
+        file << gift_output;
+        file.close();
+        if (!options.quiet)
+          std::cout << "GIFT quiz saved to: " << options.output_file
+                    << std::endl;
+      }
+    }
+  }
+}
+
+GiftAppendPlan plan_gift_append(const std::string &output_file,
+                                const int target_size,
+                                const std::string &context_override)
+{
+  GiftAppendPlan plan;
+  plan.output_file = output_file;
+
+  std::vector<GiftCategory> categories;
+  std::error_code ec;
+  if (std::filesystem::exists(output_file, ec))
+  {
+    MappedFile file(output_file);
+    categories = parse_gift(file.data(), file.size());
+    // A blank line must separate the first new question from the last
+    const std::string tail(file.data() + file.size() - std::min<size_t>(
+                                                         file.size(), 2),
+                           file.data() + file.size());
+    if (!tail.empty() && tail.back() != '\n')
+      plan.separator = "\n\n";
+    else if (tail.size() == 2 && tail != "\n\n")
+      plan.separator = "\n";
+  }
+
+  const GiftCategory *category = nullptr;
+  for (const auto &candidate : categories)
+  {
+    std::copy(candidate.questions.begin(), candidate.questions.end(),
+              std::back_inserter(plan.bank));
+    if (context_override.empty() || candidate.name == context_override)
+      category = &candidate;
+  }
+
+  if (category)
+  {
+    // Questions can follow the last category directly; an earlier category
+    // is named again
+    plan.new_category = category != &categories.back();
+    plan.existing = category->questions.size();
+    for (const auto &question : category->questions)
+      plan.titles.push_back(question.title);
+  }
+  plan.missing = plan.existing < size_t(target_size)
+                     ? size_t(target_size) - plan.existing
+                     : 0;
+  return plan;
+}
+
+void append_quiz_generation(const GiftAppendPlan &plan,
+                            const std::vector<std::string> &file_ids,
+                            const std::string &api_key,
+                            const GenerationOptions &options,
+                            RetryScheduler &retry)
+{
+  json schema = generate_quiz_schema();
+  const std::string exclusions = exclusion_clause(plan.titles);
+  const int count = int(plan.missing);
+
+  Quiz quiz;
+  if (options.shards > 1)
+  {
+    quiz = generate_quiz_sharded(file_ids, count, options.shards,
+                                 QUIZ_QUERY_CONSTRAINTS + exclusions, schema,
+                                 api_key, retry, options.quiet, options.model,
+                                 options.hedge);
+  }
+  else
+  {
+    const std::string query = build_quiz_query(count) + exclusions;
+    quiz = extract_quiz_data(
+        options.hedge
+            ? query_gemini_hedged(file_ids, query, schema, api_key,
+                                  options.model, *options.hedge, retry,
+                                  options.quiet)
+            : query_gemini(file_ids, query, schema, api_key, options.model,
+                           retry));
+  }
+  if (quiz.questions.size() > plan.missing)
+    quiz.questions.resize(plan.missing);
+
+  QuestionIndex bank_index;
+  QuestionIndex &similar = options.index ? *options.index : bank_index;
+  for (const auto &question : plan.bank)
+    similar.add(question);
+  std::vector<std::string> titles = plan.titles;
+  for (const auto &question : quiz.questions)
+    titles.push_back(question.title);
+  const size_t dropped = similar.remove_similar(quiz.questions);
+  if (dropped > 0)
+  {
+    if (!options.quiet)
+      std::cout << "Dropped " << dropped
+                << " questions already in the question bank." << std::endl;
+    std::vector<Question> extra =
+        backfill_questions(dropped, titles, similar, file_ids, schema, api_key,
+                           retry, options.model, options.quiet);
+    std::move(extra.begin(), extra.end(), std::back_inserter(quiz.questions));
+  }
+
+  // The file may have been edited since it was planned, if not through
+  // --append (which holds its lock throughout); so it is planned again, and
+  // the questions meanwhile added to the category count towards its size
+  PhaseTimer phase("write");
+  const GiftAppendPlan current =
+      plan_gift_append(plan.output_file, int(plan.existing + plan.missing),
+                       options.context_override);
+  if (quiz.questions.size() > current.missing)
+    quiz.questions.resize(current.missing);
+  std::string gift = current.separator;
+  if (current.new_category)
+    gift += convert_category_to_gift(quiz.category, options.context_override);
+  for (const auto &question : quiz.questions)
+    append_question_gift(gift, question);
+
+  const std::filesystem::path path(plan.output_file);
+  const std::filesystem::path tmp = temporary_path(path);
+  std::error_code ec;
+  const std::filesystem::file_status status = std::filesystem::status(path, ec);
+  auto fail = [&]()
+  {
+    std::filesystem::remove(tmp, ec);
+    throw std::runtime_error("Unable to append to output file: " +
+                             plan.output_file);
+  };
+  if (std::filesystem::exists(status) &&
+      !std::filesystem::copy_file(path, tmp, ec))
+    fail();
+  std::ofstream file(tmp, std::ios::binary | std::ios::app);
+  if (!file.write(gift.data(), std::streamsize(gift.size())) ||
+      (file.close(), file.fail()))
+    fail();
+  if (std::filesystem::exists(status))
+    std::filesystem::permissions(tmp, status.permissions(), ec);
+  std::filesystem::rename(tmp, path, ec);
+  if (ec)
+    fail();
+
+  if (options.index)
+    options.index->save();
+  if (!options.quiet)
+    std::cout << "Appended " << quiz.questions.size() << " questions to "
+              << plan.output_file << ", making "
+              << current.existing + quiz.questions.size()
+              << " in its category." << std::endl;
+}
+
+std::vector<std::string>
+cache_context(const std::vector<std::string> &file_ids,
+              const std::string &api_key, const std::string &model,
+              const int ttl, const bool quiet, const bool use_cache,
+              RetryScheduler &retry, const HedgePolicy *hedge)
+{
+  if (ttl <= 0 || file_ids.empty() || (hedge && hedge->model != model))
+    return file_ids;
+
+  PhaseTimer phase("cache");
+  // Keyed by the model, the system instruction and the files; inline files
+  // by their content
+  Sha256 sha;
+  auto add = [&sha](const std::string &field)
+  {
+    const std::string length = std::to_string(field.size()) + ":";
+    sha.update(length.data(), length.size());
+    sha.update(field.data(), field.size());
+  };
+  add(model);
+  add(QUIZ_QUERY_CONSTRAINTS);
+  for (const auto &file_id : file_ids)
+  {
+    add(is_inline_file(file_id)
+            ? hash_file(file_id.substr(INLINE_FILE_PREFIX.size()))
+            : file_id);
+  }
+  const std::string key = sha.hex_digest();
+
+  std::optional<UploadCache> cache;
+  if (use_cache)
+  {
+    cache.emplace(get_context_cache_path(), CONTEXT_CACHE_MARGIN_SECONDS);
+    if (const UploadCache::Entry *entry = cache->lookup(key))
+    {
+      if (!quiet)
+        std::cout << "Reusing the context cache of these files." << std::endl;
+      return {CACHED_CONTENT_PREFIX + entry->file_id};
+    }
+  }
+
+  json parts = json::array();
+  for (const auto &file_id : file_ids)
+  {
+    if (!is_inline_file(file_id))
+    {
+      parts.push_back(
+          {{"file_data",
+            {{"file_uri", gemini_base_url + "/v1beta/files/" + file_id}}}});
+      continue;
+    }
+    const std::string filename = file_id.substr(INLINE_FILE_PREFIX.size());
+    MappedFile file(filename);
+    std::string data(base64_encoded_size(file.size()), '\0');
+    base64_encode(reinterpret_cast<const unsigned char *>(file.data()),
+                  file.size(), data.data());
+    parts.push_back({{"inline_data",
+                      {{"mime_type", get_mime_type(filename)},
+                       {"data", std::move(data)}}}});
+  }
+
+  const json request = {
+      {"model", "models/" + model},
+      {"contents", {{{"role", "user"}, {"parts", std::move(parts)}}}},
+      {"systemInstruction", {{"parts", {{{"text", QUIZ_QUERY_CONSTRAINTS}}}}}},
+      {"ttl", std::to_string(ttl) + "s"}};
+  const std::string body = request.dump();
+  const std::string url =
+      gemini_base_url + "/v1beta/cachedContents?key=" + api_key;
+
+  const HttpResponse created = perform_with_retry(
+      "Context caching", retry, {"Content-Type: application/json"},
+      [&](CURL *curl)
+      {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+      });
+
+  const json response = json::parse(created.body, nullptr, false);
+  if (created.status != 200 || response.is_discarded() ||
+      !response.contains("name"))
+  {
+    if (!quiet)
+    {
+      std::cout << "Context caching unavailable ("
+                << (response.is_object() && response.contains("error")
+                        ? gemini_error_message(response["error"])
+                        : "HTTP " + std::to_string(created.status))
+                << "); the files are sent with each request." << std::endl;
+    }
+    return file_ids;
+  }
+
+  const std::string name = response["name"];
+  if (cache && response.contains("expireTime"))
+  {
+    cache->store(key, {name, parse_rfc3339_utc(response["expireTime"])});
+    cache->save();
+  }
+  if (!use_cache)
+    file_lifecycle.mark_disposable(CACHED_CONTENT_PREFIX + name);
+  if (!quiet)
+    std::cout << "Cached the files for " << ttl << " s as " << name << "."
+              << std::endl;
+  return {CACHED_CONTENT_PREFIX + name};
+}
+
+QuizJob parse_quiz_job(const json &entry, const std::string &where,
+                       const std::function<std::string(const std::string &)>
+                           &resolve,
+                       const bool hedged)
+{
+  if (!entry.is_object())
+  {
+    throw std::runtime_error(where + ": must be a JSON object");
+  }
+
+  QuizJob job;
+  for (const auto &filename : entry.value("files", json::array()))
+    job.files.push_back(resolve(filename.get<std::string>()));
+  job.custom_prompt = entry.value("prompt", "");
+  job.context = entry.value("context", "");
+  job.output_file = entry.value("output", "");
+  if (!job.output_file.empty())
+    job.output_file = resolve(job.output_file);
+  job.shards = std::max(entry.value("shards", 1), 1);
+  job.model = resolve_model_name(entry.value("model", ""));
+  job.stream = entry.value("stream", false);
+
+  if (entry.contains("num_questions"))
+  {
+    if (!job.custom_prompt.empty())
+    {
+      throw std::runtime_error(
+          where + ": cannot specify both num_questions and prompt");
+    }
+    job.num_questions = entry["num_questions"].get<int>();
+    if (job.num_questions <= 0)
+    {
+      throw std::runtime_error(where +
+                               ": number of questions must be positive");
+    }
+  }
+
+  if (job.files.empty() && job.custom_prompt.empty())
+  {
+    throw std::runtime_error(where + ": needs \"files\" or \"prompt\"");
+  }
+  if (job.shards > 1 && !job.custom_prompt.empty())
+  {
+    throw std::runtime_error(where + ": cannot specify both shards and prompt");
+  }
+  if (job.shards > 1 && job.stream)
+  {
+    throw std::runtime_error(where + ": cannot specify both shards and stream");
+  }
+  if (hedged && job.stream)
+  {
+    throw std::runtime_error(where + ": cannot specify stream with --hedge");
+  }
+
+  return job;
+}
+
+std::vector<QuizJob> load_manifest(const std::string &manifest_file,
+                                   const bool hedged)
+{
+  std::ifstream file(manifest_file);
+  if (!file.good())
+  {
+    throw std::runtime_error("Manifest not found: " + manifest_file);
+  }
+
+  json manifest = json::parse(file, nullptr, false);
+  if (manifest.is_discarded())
+  {
+    throw std::runtime_error("Manifest is not valid JSON: " + manifest_file);
+  }
+
+  const json &job_list =
+      manifest.is_object() && manifest.contains("jobs") ? manifest["jobs"]
+                                                        : manifest;
+  if (!job_list.is_array())
+  {
+    throw std::runtime_error("Manifest must contain an array of jobs");
+  }
+
+  const std::filesystem::path base =
+      std::filesystem::path(manifest_file).parent_path();
+  auto resolve = [&base](const std::string &path)
+  {
+    std::filesystem::path p(path);
+    return p.is_absolute() ? path : (base / p).string();
+  };
+
+  std::vector<QuizJob> jobs;
+  for (const auto &entry : job_list)
+  {
+    const std::string where = "manifest job " + std::to_string(jobs.size() + 1);
+    QuizJob job = parse_quiz_job(entry, where, resolve, hedged);
+    if (job.output_file.empty())
+    {
+      throw std::runtime_error(where + ": needs an \"output\" file");
+    }
+    jobs.push_back(std::move(job));
+  }
+
+  return jobs;
+}
+
+void run_quiz_job(const QuizJob &job, const JobOptions &options,
+                  RetryScheduler &retry, std::ostream *out)
+{
+  GenerationOptions generation;
+  generation.num_questions = job.num_questions;
+  generation.output_file = job.output_file;
+  generation.quiet = true;
+  generation.custom_prompt = job.custom_prompt;
+  generation.context_override = job.context;
+  generation.shards = job.shards;
+  generation.stream = job.stream;
+  generation.model = job.model.empty() ? options.model : job.model;
+  generation.hedge = options.hedge;
+  generation.out = out;
+  generation.index = options.index;
+
+  if (options.use_response_cache)
+  {
+    generation.cache_key = response_cache_key(
+        job.files, build_quiz_query(job.num_questions, job.custom_prompt),
+        generate_quiz_schema(), generation.model, job.shards, false,
+        options.hedge);
+    if (std::optional<Quiz> cached = load_cached_quiz(generation.cache_key))
+    {
+      if (out)
+        write_gift_format(*out, *cached, job.context);
+      else
+        write_quiz_output(*cached, job.output_file, job.context, true);
+      return;
+    }
+  }
+
+  const std::vector<std::string> file_ids =
+      upload_files(job.files, options.api_key, retry, true,
+                   options.use_upload_cache, options.resumable_threshold,
+                   options.inline_threshold);
+  FileLease lease(file_ids);
+  const std::vector<std::string> generation_ids = cache_context(
+      file_ids, options.api_key, generation.model, options.context_cache_ttl,
+      true, options.use_upload_cache, retry, options.hedge);
+  lease.add(generation_ids);
+  generation.lease = &lease;
+  run_quiz_generation(generation_ids, options.api_key, generation, retry);
+}
+
+size_t run_manifest(const std::vector<QuizJob> &jobs,
+                    const JobOptions &options, const int max_jobs,
+                    const bool quiet)
+{
+  std::atomic<size_t> next_job{0};
+  std::atomic<size_t> failures{0};
+  std::mutex output_mutex;
+
+  auto worker = [&]()
+  {
+    for (size_t i = next_job++; i < jobs.size(); i = next_job++)
+    {
+      const QuizJob &job = jobs[i];
+      const std::string label = "[" + std::to_string(i + 1) + "/" +
+                                std::to_string(jobs.size()) + "] " +
+                                job.output_file;
+      auto start = std::chrono::steady_clock::now();
+      RetryScheduler retry(options.retry_policy, quiet, label + ": ");
+
+      try
+      {
+        run_quiz_job(job, options, retry);
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if (!quiet)
+        {
+          std::lock_guard<std::mutex> lock(output_mutex);
+          std::cout << label << ": done in " << std::fixed
+                    << std::setprecision(1) << elapsed.count() << " s"
+                    << std::endl;
+        }
+      }
+      catch (const std::exception &e)
+      {
+        ++failures;
+
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << label << ": Error: " << e.what() << std::endl;
+      }
+    }
+  };
+
+  const size_t num_workers =
+      std::min(jobs.size(), static_cast<size_t>(std::max(max_jobs, 1)));
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; ++i)
+    workers.emplace_back(worker);
+  for (auto &thread : workers)
+    thread.join();
+
+  return failures;
+}
+
+} // namespace giftgen::detail
@@ -0,0 +1,329 @@
+// Quiz generation with generateContent: the queries, decoding of responses,
+// hedging, sharding and streaming, the response cache, per-document
+// generation, appending to GIFT files, context caching, and manifests.
+#pragma once
+
+#include "gift.hpp"
+#include "upload.hpp"
+
+namespace giftgen::detail
+{
+
+json generate_quiz_schema();
+
+// Instructions appended to every query, and to each shard's
+inline const std::string QUIZ_QUERY_CONSTRAINTS =
+    " Ensure these are formatted according to the provided"
+    " json schema. Ensure that any code excerpts in the generated"
+    " questions or answers are surrounded by a pair of backticks."
+    " Also ensure each question includes a short title: if a question"
+    " is based on content from a provided file, start the question"
+    " title using a short version of the relevant file's title or"
+    " overall theme. Do not refer to the files provided by an ordinal"
+    " word, such as \"first\" or \"second\". When referring to an"
+    " image, do this only using one or two words which relate to the"
+    " content of the image itself; though vary (avoid) this if it"
+    " might help answer the question. Also generate a short category"
+    " name (less than 30 characters) that summarizes the topic or"
+    " subject area of the questions based on the provided context.";
+
+std::string query_gemini(const std::vector<std::string> &file_ids,
+                         const std::string &query, const json &schema,
+                         const std::string &api_key, const std::string &model,
+                         RetryScheduler &retry);
+
+class GeminiApiError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Decodes the quiz from a generateContent response, as it is; error
+// responses are thrown as GeminiApiError. The response's token usage is added
+// to the metrics unless record_usage is false.
+Quiz decode_quiz_response(const std::string &response,
+                          const bool record_usage = true);
+
+// As decode_quiz_response, but drops any questions unfit to be written
+Quiz extract_quiz_data(const std::string &response);
+
+struct HedgePolicy
+{
+  std::string model; // Model for the duplicate request; may be the primary's
+  std::chrono::milliseconds delay{0}; // Used if percentile is zero
+  int percentile = 95; // Of the primary model's recent latencies
+};
+
+// An index of every question written to a question bank, kept in a file so
+// that later runs can drop new questions which paraphrase earlier ones. Each
+// question is reduced to a MinHash signature of the words of its text and
+// options; signatures agreeing in a fraction of their positions estimate the
+// questions' word overlap (Jaccard similarity). Candidates are found by LSH:
+// each band of rows is hashed to a bucket, and only questions sharing a
+// bucket with the new question are compared.
+class QuestionIndex
+{
+public:
+  static constexpr size_t HASHES = 32;
+  static constexpr size_t ROWS = 4; // Per band
+  static constexpr size_t BANDS = HASHES / ROWS;
+  using Signature = std::array<uint32_t, HASHES>;
+
+  // Without a path, the index is held in memory only
+  explicit QuestionIndex(const std::filesystem::path &path = {},
+                         const double similarity_threshold = 0.7);
+
+  size_t size() const;
+
+  // Drops the questions similar to one indexed, or to one kept before them,
+  // and indexes the rest. Returns the number of questions dropped.
+  size_t remove_similar(std::vector<Question> &questions);
+
+  // Indexes the question unless it is similar to one already indexed
+  bool add(const Question &question);
+
+  // Appends the questions indexed since the last save to the file
+  void save();
+
+private:
+  static constexpr char MAGIC[8] = {'M', 'G', 'G', 'Q', 'I', 'D', 'X', '1'};
+
+  static uint64_t mix(uint64_t x);
+
+  // FNV-1a; unlike std::hash, stable across builds, as the index persists
+  static uint64_t hash_word(const std::string &word);
+
+  static Signature signature_of(const Question &question);
+
+  static uint64_t bucket_of(const Signature &signature, const size_t band);
+
+  bool contains_similar(const Signature &signature) const;
+
+  void insert(const Signature &signature);
+
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  std::filesystem::path path_;
+  double threshold_;
+  mutable std::mutex mutex_;
+  std::vector<Signature> signatures_;
+  size_t saved_ = 0; // Signatures already in the file
+  // Each bucket is a chain through next_, which holds, for each signature
+  // and band, the previous signature in the same bucket
+  std::unordered_map<uint64_t, uint32_t> buckets_;
+  std::vector<uint32_t> next_;
+};
+
+// Splits the questions across concurrent requests, each steered towards a
+// different part of the material, then merges the results into one quiz.
+Quiz generate_quiz_sharded(const std::vector<std::string> &file_ids,
+                           const int num_questions, const int shards,
+                           const std::string &constraints, const json &schema,
+                           const std::string &api_key, RetryScheduler &retry,
+                           const bool quiet = false,
+                           const std::string &model = GEMINI_MODEL_FLASH,
+                           const HedgePolicy *hedge = nullptr);
+
+// Scans the model's JSON output incrementally as it streams in, reporting
+// the category and each element of the "questions" array once complete.
+// Text preceding whatever is still being scanned is discarded.
+class QuizStreamParser
+{
+public:
+  std::function<void(const std::string &)> on_category;
+  std::function<void(Question &)> on_question;
+
+  void feed(const std::string &text);
+
+private:
+  void end_string();
+
+  void compact();
+
+  std::string buffer_;
+  size_t pos_ = 0;
+  int depth_ = 0;
+  bool in_string_ = false;
+  bool escaped_ = false;
+  bool expect_key_ = false;
+  bool in_questions_ = false;
+  size_t string_start_ = 0;
+  size_t object_start_ = std::string::npos;
+  std::string key_;
+};
+
+std::string build_quiz_query(const int num_questions,
+                             const std::string &custom_prompt = "");
+
+// Identifies the quiz generated from these inputs: the file contents (and
+// the image budget, which changes what is sent of them), the final query,
+// the response schema, the model and any hedge model, the number of shards
+// and whether the documents were asked for questions separately
+std::string response_cache_key(const std::vector<std::string> &filenames,
+                               const std::string &query, const json &schema,
+                               const std::string &model, const int shards = 1,
+                               const bool per_document = false,
+                               const HedgePolicy *hedge = nullptr);
+
+// The quiz cached under the key, if any, which becomes the most recently used
+std::optional<Quiz> load_cached_quiz(const std::string &key);
+
+// Renders the quiz as GIFT straight to the output file, or to stdout
+void write_quiz_output(const Quiz &quiz, const std::string &output_file,
+                       const std::string &context_override,
+                       const bool quiet = false);
+
+// The length of a document in pages: counted for a PDF, one for an image,
+// and estimated from the size otherwise
+double document_pages(const std::string &filename);
+
+// The files sent together in one per-document request, and the number of
+// questions asked of them
+struct DocumentGroup
+{
+  std::vector<std::string> file_ids;
+  double pages = 0;
+  int num_questions = 0;
+};
+
+// Gives each large document a request of its own, and groups the small ones
+// (in order) until a group is as long as a large document; then shares the
+// questions out in proportion to the groups' pages, by largest remainder.
+// Each group gets at least one question, if there are enough; groups given
+// none are dropped.
+std::vector<DocumentGroup>
+plan_document_groups(const std::vector<std::string> &file_ids,
+                     const std::vector<double> &pages, const int num_questions);
+
+// How run_quiz_generation generates the quiz, and where its output goes
+struct GenerationOptions
+{
+  int num_questions = 5;
+  std::string output_file; // Empty for stdout
+  bool interactive = false;
+  bool quiet = false;
+  std::string custom_prompt;
+  std::string context_override;
+  int shards = 1;
+  bool stream = false;
+  std::string model = GEMINI_MODEL_FLASH;
+  const HedgePolicy *hedge = nullptr;
+  std::string cache_key;       // Of the response cache; empty for none
+  std::ostream *out = nullptr; // Instead of the output file or stdout
+  QuestionIndex *index = nullptr;
+  const std::vector<DocumentGroup> *documents = nullptr;
+  FileLease *lease = nullptr;
+};
+
+// Generates the quiz, asking an interactive user for approval. Otherwise the
+// GIFT output goes to out, if given, rather than to the output file or stdout.
+// With an index, questions similar to those already in the question bank are
+// dropped, and replaced unless a custom prompt was given. With documents, the
+// document groups are asked for their questions separately. If given, the
+// lease on the files is released once they are no longer needed, so they can
+// be deleted while the output is written.
+void run_quiz_generation(const std::vector<std::string> &file_ids,
+                         const std::string &api_key,
+                         const GenerationOptions &options,
+                         RetryScheduler &retry);
+
+// The part of a GIFT file which --append tops up: the last category named by
+// --context or, without --context, the file's last category
+struct GiftAppendPlan
+{
+  std::string output_file;
+  bool new_category = true; // Whether a $CATEGORY line must be written first
+  std::string separator; // Ends the file with a blank line, if it does not
+  size_t existing = 0;        // Questions already in the category
+  size_t missing = 0;         // Questions to generate
+  std::vector<std::string> titles; // Of the category's questions
+  std::vector<Question> bank;      // Every question in the file
+};
+
+GiftAppendPlan plan_gift_append(const std::string &output_file,
+                                const int target_size,
+                                const std::string &context_override);
+
+// Generates the questions missing from the plan's category, steering the
+// model away from those already there, and appends them to the file. Those
+// similar to a question anywhere in the file, or in the index if given, are
+// dropped and replaced. The file is replaced by a copy with the questions
+// appended, so readers never see a partly appended file; the caller holds
+// the file's FileLock from planning until this returns, so concurrent runs
+// do not lose each other's questions.
+void append_quiz_generation(const GiftAppendPlan &plan,
+                            const std::vector<std::string> &file_ids,
+                            const std::string &api_key,
+                            const GenerationOptions &options,
+                            RetryScheduler &retry);
+
+// Puts the files, and QUIZ_QUERY_CONSTRAINTS, in a context cache on the
+// server for ttl seconds, and returns the file IDs to generate with: the
+// cache alone. The model reads the files once, when the cache is made, rather
+// than with every request. A cache made earlier for the same files and model
+// is reused while it lives (if use_cache). A cache belongs to one model, so
+// none is used if hedging may send requests to another; and if none can be
+// made (e.g. the files are too short for caching), the file IDs are returned
+// unchanged.
+std::vector<std::string>
+cache_context(const std::vector<std::string> &file_ids,
+              const std::string &api_key, const std::string &model,
+              const int ttl, const bool quiet, const bool use_cache,
+              RetryScheduler &retry, const HedgePolicy *hedge = nullptr);
+
+struct QuizJob
+{
+  std::vector<std::string> files;
+  int num_questions = 5;
+  std::string custom_prompt;
+  std::string context;
+  std::string output_file;
+  int shards = 1;
+  std::string model; // Empty for the --model default
+  bool stream = false;
+};
+
+// Reads one job, as given in a manifest or sent to a server; resolve maps
+// each path given to the path used. As on the command line, a job cannot
+// stream if hedged is set (--hedge), as hedging does not apply to streams.
+QuizJob parse_quiz_job(const json &entry, const std::string &where,
+                       const std::function<std::string(const std::string &)>
+                           &resolve,
+                       const bool hedged = false);
+
+// Reads a manifest: either a JSON array of jobs or an object with a "jobs"
+// array. Relative paths are resolved against the manifest's directory.
+std::vector<QuizJob> load_manifest(const std::string &manifest_file,
+                                   const bool hedged = false);
+
+// The settings shared by the jobs of a manifest, or of the server; a job may
+// override the model
+struct JobOptions
+{
+  std::string api_key;
+  bool use_upload_cache = true;
+  bool use_response_cache = true;
+  uintmax_t resumable_threshold = DEFAULT_RESUMABLE_THRESHOLD;
+  uintmax_t inline_threshold = 0;
+  int context_cache_ttl = 0;
+  RetryPolicy retry_policy;
+  std::string model = GEMINI_MODEL_FLASH;
+  const HedgePolicy *hedge = nullptr;
+  QuestionIndex *index = nullptr;
+};
+
+// Runs a job quietly: its quiz is taken from the response cache, or else its
+// files are uploaded and the quiz generated. The GIFT output goes to out, if
+// given, rather than to the job's output file.
+void run_quiz_job(const QuizJob &job, const JobOptions &options,
+                  RetryScheduler &retry, std::ostream *out = nullptr);
+
+// Runs the jobs on a pool of max_jobs workers. Each worker takes the next job
+// and runs its upload, generation and output in turn; so while one job is
+// uploading, others are generating or writing their GIFT output.
+// Returns the number of failed jobs.
+size_t run_manifest(const std::vector<QuizJob> &jobs,
+                    const JobOptions &options, const int max_jobs,
+                    const bool quiet = false);
+
+} // namespace giftgen::detail
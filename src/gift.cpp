@@ -0,0 +1,939 @@
+#include "gift.hpp"
+
+#include "transport.hpp"
+
+namespace giftgen::detail
+{
+
+bool is_gift_special(const char c)
+{
+  return c == '{' || c == '}' || c == '#' || c == ':' || c == '~' || c == '=';
+}
+
+#if defined(MOODLE_GIFT_GEN_SSE2) || defined(MOODLE_GIFT_GEN_AVX2)
+
+unsigned count_trailing_zeros(const uint32_t mask)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+#endif
+
+size_t find_gift_special(const char *text, const size_t size)
+{
+  size_t i = 0;
+
+#ifdef MOODLE_GIFT_GEN_AVX2
+  for (; i + 32 <= size; i += 32)
+  {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+    __m256i match = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{'));
+    match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+    match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+    match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')));
+    match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~')));
+    match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')));
+    const uint32_t mask = uint32_t(_mm256_movemask_epi8(match));
+    if (mask)
+      return i + count_trailing_zeros(mask);
+  }
+#endif
+
+#ifdef MOODLE_GIFT_GEN_SSE2
+  for (; i + 16 <= size; i += 16)
+  {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+    __m128i match = _mm_cmpeq_epi8(v, _mm_set1_epi8('{'));
+    match = _mm_or_si128(match, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+    match = _mm_or_si128(match, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+    match = _mm_or_si128(match, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+    match = _mm_or_si128(match, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+    match = _mm_or_si128(match, _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+    const uint32_t mask = uint32_t(_mm_movemask_epi8(match));
+    if (mask)
+      return i + count_trailing_zeros(mask);
+  }
+#endif
+
+  for (; i < size; ++i)
+  {
+    if (is_gift_special(text[i]))
+      return i;
+  }
+  return size;
+}
+
+// The length of the text once escaped
+size_t escaped_gift_size(const std::string &text)
+{
+  size_t size = text.size();
+  for (size_t i = find_gift_special(text.data(), text.size()); i < text.size();
+       i += 1 + find_gift_special(text.data() + i + 1, text.size() - i - 1))
+    ++size;
+  return size;
+}
+
+// Appends the text with its GIFT control characters escaped; the runs
+// between them are copied whole.
+void append_escaped_gift(std::string &out, const std::string &text)
+{
+  const char *p = text.data();
+  size_t remaining = text.size();
+  while (remaining > 0)
+  {
+    const size_t run = find_gift_special(p, remaining);
+    out.append(p, run);
+    if (run == remaining)
+      break;
+    out += '\\';
+    out += p[run];
+    p += run + 1;
+    remaining -= run + 1;
+  }
+}
+
+std::string get_timestamp_suffix()
+{
+  auto now = std::chrono::system_clock::now();
+  auto time_t_now = std::chrono::system_clock::to_time_t(now);
+  std::tm local_tm = *std::localtime(&time_t_now);
+
+  std::ostringstream oss;
+  oss << std::put_time(&local_tm, "%A %d-%m-%Y %H:%M:%S");
+  return oss.str();
+}
+
+std::string convert_category_to_gift(const std::string &quiz_category,
+                                    const std::string &context_override)
+{
+  std::string category;
+  if (!context_override.empty())
+  {
+    category = context_override;
+  }
+  else
+  {
+    if (!quiz_category.empty())
+    {
+      category = quiz_category;
+    }
+    else
+    {
+      category = "Quiz";
+    }
+    // Append timestamp to category only when LLM-generated
+    category += " " + get_timestamp_suffix();
+  }
+
+  return "\n$CATEGORY: " + category + "\n\n";
+}
+
+// The exact length of the question's GIFT text, so that it can be rendered
+// without reallocation
+size_t gift_question_size(const Question &question)
+{
+  size_t size = 0;
+  if (!question.title.empty())
+    size += escaped_gift_size(question.title) + 5; // "::" and "::\n"
+  size += escaped_gift_size(question.question) + 13; // "[markdown]" and " {\n"
+
+  for (const auto &option : question.options)
+    size += escaped_gift_size(option) + 2; // '=' or '~', and '\n'
+
+  return size + 3; // "}\n\n"
+}
+
+void append_question_gift(std::string &out, const Question &question)
+{
+  if (!question.title.empty())
+  {
+    out += "::";
+    append_escaped_gift(out, question.title);
+    out += "::\n";
+  }
+  out += "[markdown]";
+  append_escaped_gift(out, question.question);
+  out += " {\n";
+
+  for (size_t i = 0; i < question.options.size(); ++i)
+  {
+    out += (int(i) == question.correct_answer) ? '=' : '~';
+    append_escaped_gift(out, question.options[i]);
+    out += '\n';
+  }
+
+  out += "}\n\n";
+}
+
+std::string convert_question_to_gift(const Question &question)
+{
+  std::string gift_output;
+  gift_output.reserve(gift_question_size(question));
+  append_question_gift(gift_output, question);
+  return gift_output;
+}
+
+std::string convert_to_gift_format(const Quiz &quiz,
+                                   const std::string &context_override)
+{
+  PhaseTimer phase("render");
+
+  // Add category line at the top
+  std::string category = convert_category_to_gift(quiz.category,
+                                                  context_override);
+
+  size_t size = category.size();
+  for (const auto &question : quiz.questions)
+    size += gift_question_size(question);
+
+  std::string gift_output;
+  gift_output.reserve(size);
+  gift_output += category;
+  for (const auto &question : quiz.questions)
+    append_question_gift(gift_output, question);
+
+  return gift_output;
+}
+
+void write_gift_format(std::ostream &sink, const Quiz &quiz,
+                       const std::string &context_override)
+{
+  const size_t block_size = 1 << 20;
+
+  // Rendering and writing alternate, so each is timed block by block
+  auto start = std::chrono::steady_clock::now();
+  std::string buffer =
+      convert_category_to_gift(quiz.category, context_override);
+  buffer.reserve(block_size);
+  auto flush = [&]()
+  {
+    const auto rendered = std::chrono::steady_clock::now();
+    metrics.record_phase("render", start, rendered);
+    sink.write(buffer.data(), std::streamsize(buffer.size()));
+    start = std::chrono::steady_clock::now();
+    metrics.record_phase("write", rendered, start);
+  };
+
+  for (const auto &question : quiz.questions)
+  {
+    const size_t size = gift_question_size(question);
+    if (buffer.size() + size > block_size)
+    {
+      flush();
+      buffer.clear();
+    }
+    append_question_gift(buffer, question);
+  }
+  flush();
+}
+
+const char *gift_question_type_name(const GiftQuestionType type)
+{
+  switch (type)
+  {
+  case GiftQuestionType::MultipleChoice:
+    return "multiple choice";
+  case GiftQuestionType::ShortAnswer:
+    return "short answer";
+  case GiftQuestionType::Matching:
+    return "matching";
+  case GiftQuestionType::TrueFalse:
+    return "true/false";
+  case GiftQuestionType::Numerical:
+    return "numerical";
+  case GiftQuestionType::Essay:
+    return "essay";
+  case GiftQuestionType::Description:
+    return "description";
+  }
+  return "unknown";
+}
+
+// Appends the text with its GIFT escapes removed: a backslash before a
+// control character or a backslash, and "\n" for a newline. The runs
+// between backslashes are copied whole.
+void append_unescaped_gift(std::string &out, const char *text,
+                           const size_t size)
+{
+  const char *p = text;
+  const char *const end = text + size;
+  while (p < end)
+  {
+    const void *found = std::memchr(p, '\\', size_t(end - p));
+    const char *slash = found ? static_cast<const char *>(found) : end;
+    out.append(p, slash);
+    if (slash + 1 >= end)
+    {
+      out.append(slash, end);
+      break;
+    }
+    const char c = slash[1];
+    if (is_gift_special(c) || c == '\\' || c == 'n')
+      out += c == 'n' ? '\n' : c;
+    else
+      out.append(slash, 2);
+    p = slash + 2;
+  }
+}
+
+bool is_gift_space(const char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Sets out to the text between begin and end, without surrounding
+// whitespace, unescaped; out's storage is reused
+void read_gift_field(const char *begin, const char *end, std::string &out)
+{
+  while (begin < end && is_gift_space(*begin))
+    ++begin;
+  while (end > begin && is_gift_space(end[-1]))
+    --end;
+  out.clear();
+  append_unescaped_gift(out, begin, size_t(end - begin));
+}
+
+// The first unescaped occurrence of c in [begin, end), or end. Runs without
+// a backslash are searched by memchr.
+const char *find_unescaped(const char *begin, const char *end, const char c)
+{
+  while (begin < end)
+  {
+    const void *found = std::memchr(begin, c, size_t(end - begin));
+    if (!found)
+      return end;
+    const char *at = static_cast<const char *>(found);
+
+    // Escaped if preceded by an odd number of backslashes
+    const char *slash = at;
+    while (slash > begin && slash[-1] == '\\')
+      --slash;
+    if ((at - slash) % 2 == 0)
+      return at;
+    begin = at + 1;
+  }
+  return end;
+}
+
+void GiftParser::parse(const char *data, const size_t size,
+                       const size_t first_line)
+{
+  const char *p = data;
+  const char *const end = data + size;
+  size_t line = first_line;
+  std::string item; // An item with comment lines, once they are removed
+
+  while (p < end)
+  {
+    // Find the item's lines, up to a blank line
+    const char *item_start = nullptr;
+    size_t item_line = line;
+    bool has_comments = false;
+    item.clear();
+    while (p < end)
+    {
+      const char *eol =
+          static_cast<const char *>(std::memchr(p, '\n', size_t(end - p)));
+      const char *next = eol ? eol + 1 : end;
+      const char *q = p;
+      while (q < next && is_gift_space(*q))
+        ++q;
+
+      if (q == next) // Blank
+      {
+        ++line;
+        p = next;
+        if (item_start)
+          break;
+        continue;
+      }
+
+      if (next - q >= 2 && q[0] == '/' && q[1] == '/')
+      {
+        if (item_start && !has_comments)
+          item.assign(item_start, p);
+        has_comments = true;
+      }
+      else
+      {
+        if (!item_start)
+        {
+          item_start = p;
+          item_line = line;
+        }
+        if (has_comments)
+          item.append(p, next);
+      }
+      ++line;
+      p = next;
+    }
+
+    if (!item_start)
+      continue;
+    if (has_comments)
+      parse_item(item.data(), item.data() + item.size(), item_line);
+    else
+      parse_item(item_start, p, item_line);
+  }
+}
+
+void GiftParser::error(const size_t line, const std::string &message)
+{
+  if (on_error)
+    on_error(line, message);
+}
+
+void GiftParser::parse_item(const char *p, const char *end, size_t line)
+{
+  while (p < end && is_gift_space(*p))
+    ++p;
+
+  const std::string category_prefix = "$CATEGORY:";
+  if (size_t(end - p) >= category_prefix.size() &&
+      std::equal(category_prefix.begin(), category_prefix.end(), p))
+  {
+    const char *eol = std::find(p, end, '\n');
+    read_gift_field(p + category_prefix.size(), eol, scratch_);
+    if (on_category)
+      on_category(scratch_);
+    // A question may follow on the next line
+    for (p = eol; p < end && is_gift_space(*p); ++p)
+    {
+      if (*p == '\n')
+        ++line;
+    }
+    if (p == end)
+      return;
+  }
+
+  GiftQuestion &question = question_;
+  question.type = GiftQuestionType::Description;
+  question.title.clear();
+  question.format.clear();
+  question.text.clear();
+  question.line = line;
+  answer_count_ = 0;
+
+  if (end - p >= 2 && p[0] == ':' && p[1] == ':')
+  {
+    const char *title_end = p + 2;
+    while ((title_end = find_unescaped(title_end, end, ':')) < end &&
+           (title_end + 1 == end || title_end[1] != ':'))
+      ++title_end;
+    if (title_end >= end)
+    {
+      error(line, "title is not closed by \"::\"");
+      return;
+    }
+    read_gift_field(p + 2, title_end, question.title);
+    p = title_end + 2;
+  }
+
+  const char *open = find_unescaped(p, end, '{');
+  const char *text = p;
+  while (text < open && is_gift_space(*text))
+    ++text;
+  if (text < open && *text == '[')
+  {
+    const char *format_end = find_unescaped(text, open, ']');
+    if (format_end < open)
+    {
+      question.format.assign(text + 1, format_end);
+      text = format_end + 1;
+    }
+  }
+
+  if (open == end)
+  {
+    if (find_unescaped(p, end, '}') != end)
+    {
+      error(line, "\"}\" without \"{\"");
+      return;
+    }
+    read_gift_field(text, end, question.text);
+    deliver(question);
+    return;
+  }
+
+  const char *close = find_unescaped(open + 1, end, '}');
+  if (close == end)
+  {
+    error(line, "answers are not closed by \"}\"");
+    return;
+  }
+  if (find_unescaped(open + 1, close, '{') != close)
+  {
+    error(line, "\"{\" inside the answers");
+    return;
+  }
+
+  if (find_unescaped(close + 1, end, '{') != end)
+  {
+    error(line, "second question without a blank line before it");
+    return;
+  }
+
+  // Text after the answers makes a "missing word" question
+  read_gift_field(text, open, question.text);
+  read_gift_field(close + 1, end, scratch_);
+  if (!scratch_.empty())
+    question.text += " _____ " + scratch_;
+  if (question.text.empty())
+  {
+    error(line, "question has no text");
+    return;
+  }
+
+  if (parse_answers(question, open + 1, close, line))
+    deliver(question);
+}
+
+bool GiftParser::parse_answers(GiftQuestion &question, const char *p,
+                               const char *end, const size_t line)
+{
+  while (p < end && is_gift_space(*p))
+    ++p;
+  while (end > p && is_gift_space(end[-1]))
+    --end;
+
+  if (p == end)
+  {
+    question.type = GiftQuestionType::Essay;
+    return true;
+  }
+
+  if (*p == '#')
+  {
+    question.type = GiftQuestionType::Numerical;
+    return split_answers(question, p + 1, end, line, true);
+  }
+
+  const char *feedback = find_unescaped(p, end, '#');
+  std::string value(p, feedback);
+  while (!value.empty() && is_gift_space(value.back()))
+    value.pop_back();
+  std::transform(value.begin(), value.end(), value.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  if (value == "T" || value == "TRUE" || value == "F" || value == "FALSE")
+  {
+    question.type = GiftQuestionType::TrueFalse;
+    GiftAnswer &answer = next_answer(question);
+    answer.correct = value[0] == 'T';
+    answer.text = answer.correct ? "true" : "false";
+    if (feedback < end)
+      read_gift_field(feedback + 1, end, answer.feedback);
+    return true;
+  }
+
+  if (*p != '=' && *p != '~')
+  {
+    error(line, "answers must start with \"=\" or \"~\"");
+    return false;
+  }
+  if (!split_answers(question, p, end, line, false))
+    return false;
+
+  bool any_wrong = false;
+  bool any_correct = false;
+  bool matching = false;
+  for (size_t i = 0; i < answer_count_; ++i)
+  {
+    const GiftAnswer &answer = question.answers[i];
+    any_wrong |= !answer.correct;
+    any_correct |= answer.correct || answer.weight.value_or(0) > 0;
+    matching |= answer.text.find("->") != std::string::npos;
+  }
+
+  if (matching && !any_wrong)
+  {
+    question.type = GiftQuestionType::Matching;
+    if (answer_count_ < 2)
+    {
+      error(line, "matching question has fewer than two pairs");
+      return false;
+    }
+    return true;
+  }
+  if (!any_wrong)
+  {
+    question.type = GiftQuestionType::ShortAnswer;
+    return true;
+  }
+
+  question.type = GiftQuestionType::MultipleChoice;
+  if (!any_correct)
+  {
+    error(line, "multiple choice question has no correct answer");
+    return false;
+  }
+  if (answer_count_ < 2)
+  {
+    error(line, "multiple choice question has fewer than two answers");
+    return false;
+  }
+  return true;
+}
+
+GiftAnswer &GiftParser::next_answer(GiftQuestion &question)
+{
+  if (answer_count_ == question.answers.size())
+    question.answers.emplace_back();
+  GiftAnswer &answer = question.answers[answer_count_++];
+  answer.text.clear();
+  answer.correct = false;
+  answer.weight.reset();
+  answer.feedback.clear();
+  return answer;
+}
+
+bool GiftParser::split_answers(GiftQuestion &question, const char *p,
+                               const char *end, const size_t line,
+                               const bool numerical)
+{
+  const char *const block = p;
+  auto find_start = [&](const char *from)
+  {
+    while (from < end)
+    {
+      from += find_gift_special(from, size_t(end - from));
+      if (from == end)
+        break;
+      const char *slash = from;
+      while (slash > block && slash[-1] == '\\')
+        --slash;
+      if ((*from == '=' || (!numerical && *from == '~')) &&
+          (from - slash) % 2 == 0)
+        break;
+      ++from;
+    }
+    return from;
+  };
+
+  while (p < end)
+  {
+    while (p < end && is_gift_space(*p))
+      ++p;
+    if (p == end)
+      break;
+
+    GiftAnswer &answer = next_answer(question);
+    const char *start = p;
+    if (*p == '=' || (!numerical && *p == '~'))
+    {
+      answer.correct = *p == '=';
+      ++start;
+    }
+    else
+    {
+      answer.correct = true; // The only answer of a numerical question
+    }
+
+    const char *next = find_start(start);
+
+    if (start < next && *start == '%')
+    {
+      const char *weight_end = find_unescaped(start + 1, next, '%');
+      if (weight_end == next)
+      {
+        error(line, "answer weight is not closed by \"%\"");
+        return false;
+      }
+      try
+      {
+        answer.weight = std::stod(std::string(start + 1, weight_end));
+      }
+      catch (const std::exception &)
+      {
+        error(line, "answer weight is not a number");
+        return false;
+      }
+      start = weight_end + 1;
+    }
+
+    const char *feedback = find_unescaped(start, next, '#');
+    read_gift_field(start, feedback, answer.text);
+    if (feedback < next)
+      read_gift_field(feedback + 1, next, answer.feedback);
+    if (answer.text.empty())
+    {
+      error(line, "empty answer");
+      return false;
+    }
+    p = next;
+  }
+
+  if (answer_count_ == 0)
+  {
+    error(line, "no answers");
+    return false;
+  }
+  return true;
+}
+
+void GiftParser::deliver(GiftQuestion &question)
+{
+  question.answers.resize(answer_count_);
+  if (on_question)
+    on_question(question);
+}
+
+std::string question_problem(const Question &question)
+{
+  auto blank = [](const std::string &text)
+  {
+    return std::all_of(text.begin(), text.end(),
+                       [](char c) { return is_gift_space(c); });
+  };
+
+  if (blank(question.question))
+    return "no question text";
+  if (question.options.size() < 2)
+    return "fewer than two options";
+  if (std::any_of(question.options.begin(), question.options.end(), blank))
+    return "an empty option";
+  if (question.correct_answer < 0 ||
+      question.correct_answer >= int(question.options.size()))
+    return "no correct answer";
+  return "";
+}
+
+size_t remove_invalid_questions(std::vector<Question> &questions)
+{
+  const size_t before = questions.size();
+  questions.erase(
+      std::remove_if(questions.begin(), questions.end(),
+                     [](const Question &question)
+                     {
+                       const std::string problem = question_problem(question);
+                       if (!problem.empty())
+                         std::cerr << "Dropped question \"" << question.title
+                                   << "\": " << problem << std::endl;
+                       return !problem.empty();
+                     }),
+      questions.end());
+  return before - questions.size();
+}
+
+std::vector<GiftCategory> parse_gift(const char *text, const size_t size)
+{
+  std::vector<GiftCategory> categories(1);
+  GiftParser parser;
+  parser.on_category = [&](const std::string &name)
+  {
+    categories.emplace_back();
+    categories.back().name = name;
+  };
+  parser.on_question = [&](GiftQuestion &parsed)
+  {
+    if (parsed.type == GiftQuestionType::Description)
+      return;
+    Question question;
+    question.title = std::move(parsed.title);
+    question.question = std::move(parsed.text);
+    for (auto &answer : parsed.answers)
+    {
+      if (answer.correct && question.correct_answer < 0)
+        question.correct_answer = int(question.options.size());
+      question.options.push_back(std::move(answer.text));
+    }
+    categories.back().questions.push_back(std::move(question));
+  };
+  parser.parse(text, size);
+
+  if (categories.front().questions.empty())
+    categories.erase(categories.begin());
+  return categories;
+}
+
+// What --validate reports for each file, and in total
+struct GiftStatistics
+{
+  uintmax_t bytes = 0;
+  size_t categories = 0;
+  size_t errors = 0;
+  std::map<GiftQuestionType, size_t> questions;
+
+  void add(const GiftStatistics &other)
+  {
+    bytes += other.bytes;
+    categories += other.categories;
+    errors += other.errors;
+    for (const auto &[type, count] : other.questions)
+      questions[type] += count;
+  }
+};
+
+// Large files are validated in parts of about this size, in parallel
+const size_t GIFT_VALIDATION_PART_SIZE = 32 << 20;
+
+// A malformed item, at a line counted from the start of its part
+struct GiftError
+{
+  size_t line;
+  std::string message;
+};
+
+// Checks part of a GIFT file, adding each malformed item to errors
+GiftStatistics validate_gift_part(const char *data, const size_t size,
+                                  std::vector<GiftError> &errors)
+{
+  GiftStatistics stats;
+  stats.bytes = size;
+
+  GiftParser parser;
+  parser.on_category = [&](const std::string &) { ++stats.categories; };
+  parser.on_question = [&](GiftQuestion &question)
+  { ++stats.questions[question.type]; };
+  parser.on_error = [&](const size_t line, const std::string &message)
+  {
+    ++stats.errors;
+    errors.push_back({line, message});
+  };
+  parser.parse(data, size, 1);
+  return stats;
+}
+
+// The end of the first blank line ("\n\n", or "\n\r\n" in CRLF files)
+// starting at or after from; or end, if there is none
+const char *find_blank_line_end(const char *from, const char *const end)
+{
+  for (const char *p = from; p < end; ++p)
+  {
+    p = static_cast<const char *>(std::memchr(p, '\n', size_t(end - p)));
+    if (!p)
+      return end;
+    if (p + 1 < end && p[1] == '\n')
+      return p + 2;
+    if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+      return p + 3;
+  }
+  return end;
+}
+
+void print_gift_statistics(std::ostream &out, const std::string &name,
+                           const GiftStatistics &stats)
+{
+  size_t total = 0;
+  for (const auto &[type, count] : stats.questions)
+    total += count;
+  out << name << ": " << total << " questions in " << stats.categories
+      << " categories";
+  for (const auto &[type, count] : stats.questions)
+    out << ", " << count << " " << gift_question_type_name(type);
+  out << "; " << stats.errors << " errors" << std::endl;
+}
+
+size_t validate_gift_files(const std::vector<std::string> &filenames,
+                           const bool quiet)
+{
+  struct Part
+  {
+    size_t file;
+    const char *data;
+    size_t size;
+    size_t lines; // Newlines within the part
+    GiftStatistics stats;
+    std::vector<GiftError> errors;
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::unique_ptr<MappedFile>> files(filenames.size());
+  std::vector<std::string> failures(filenames.size());
+  std::vector<Part> parts;
+  for (size_t i = 0; i < filenames.size(); ++i)
+  {
+    try
+    {
+      files[i] = std::make_unique<MappedFile>(filenames[i]);
+    }
+    catch (const std::exception &e)
+    {
+      failures[i] = e.what();
+      continue;
+    }
+
+    const char *p = files[i]->data();
+    const char *const end = p + files[i]->size();
+    do
+    {
+      const char *split = end;
+      if (size_t(end - p) > GIFT_VALIDATION_PART_SIZE)
+        split = find_blank_line_end(p + GIFT_VALIDATION_PART_SIZE, end);
+      parts.push_back({i, p, size_t(split - p), 0, GiftStatistics{},
+                       std::vector<GiftError>{}});
+      p = split;
+    } while (p < end);
+  }
+
+  std::atomic<size_t> next{0};
+  auto worker = [&]()
+  {
+    for (size_t i = next++; i < parts.size(); i = next++)
+    {
+      Part &part = parts[i];
+      part.lines = size_t(std::count(part.data, part.data + part.size, '\n'));
+      part.stats = validate_gift_part(part.data, part.size, part.errors);
+    }
+  };
+
+  const size_t num_workers = std::min<size_t>(
+      parts.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; ++i)
+    workers.emplace_back(worker);
+  for (auto &thread : workers)
+    thread.join();
+
+  // Each part's first line follows the lines of the parts before it
+  std::vector<GiftStatistics> results(filenames.size());
+  size_t first_line = 1;
+  for (size_t i = 0; i < parts.size(); ++i)
+  {
+    const Part &part = parts[i];
+    if (i > 0 && parts[i - 1].file != part.file)
+      first_line = 1;
+    for (const auto &error : part.errors)
+      std::cerr << filenames[part.file] << ":" << first_line + error.line - 1
+                << ": " << error.message << "\n";
+    first_line += part.lines;
+    results[part.file].add(part.stats);
+  }
+
+  GiftStatistics total;
+  for (size_t i = 0; i < filenames.size(); ++i)
+  {
+    if (!failures[i].empty())
+    {
+      std::cerr << filenames[i] << ": " << failures[i] << std::endl;
+      ++total.errors;
+      continue;
+    }
+    if (!quiet)
+      print_gift_statistics(std::cout, filenames[i], results[i]);
+    total.add(results[i]);
+  }
+
+  if (!quiet && filenames.size() > 1)
+    print_gift_statistics(std::cout, "Total", total);
+  if (!quiet)
+  {
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Read " << std::fixed << std::setprecision(1)
+              << total.bytes / 1e6 << " MB in " << std::setprecision(2)
+              << elapsed.count() << " s (" << std::setprecision(0)
+              << total.bytes / 1e6 / std::max(elapsed.count(), 1e-6)
+              << " MB/s)." << std::endl;
+  }
+  return total.errors;
+}
+
+} // namespace giftgen::detail
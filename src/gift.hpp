@@ -0,0 +1,129 @@
+// Rendering, parsing and validation of GIFT
+#pragma once
+
+#include "common.hpp"
+
+namespace giftgen::detail
+{
+
+// Index of the first GIFT control character in the text, or size if none.
+// Blocks of 32 (AVX2) or 16 (SSE2) bytes are compared with all six at once.
+size_t find_gift_special(const char *text, const size_t size);
+
+std::string convert_category_to_gift(const std::string &quiz_category,
+                                    const std::string &context_override);
+
+// Renders the question's GIFT text at the end of out
+void append_question_gift(std::string &out, const Question &question);
+
+std::string convert_question_to_gift(const Question &question);
+
+std::string convert_to_gift_format(const Quiz &quiz,
+                                   const std::string &context_override);
+
+// As convert_to_gift_format, but writes to the stream, rendering through a
+// buffer which is reused for each block of questions
+void write_gift_format(std::ostream &sink, const Quiz &quiz,
+                       const std::string &context_override);
+
+// The kinds of GIFT question, as distinguished by their answers
+enum class GiftQuestionType
+{
+  MultipleChoice, // "=" and "~" answers
+  ShortAnswer,    // Only "=" answers
+  Matching,       // "=a -> b" pairs
+  TrueFalse,      // {T} or {F}
+  Numerical,      // {#...}
+  Essay,          // {}
+  Description     // No answers
+};
+
+struct GiftAnswer
+{
+  std::string text; // For numerical questions, the number and any tolerance
+  bool correct = false;        // Given by "=" (or, for true/false, T)
+  std::optional<double> weight; // Percentage, from "%50%"
+  std::string feedback;         // Following "#"
+};
+
+struct GiftQuestion
+{
+  GiftQuestionType type = GiftQuestionType::Description;
+  std::string title;
+  std::string format; // E.g. "markdown", from "[markdown]"; empty if none
+  std::string text;
+  std::vector<GiftAnswer> answers;
+  size_t line = 0; // Where the question starts, from 1
+};
+
+// Reads GIFT text in one pass, as Moodle does: items are separated by blank
+// lines, and lines starting with "//" are comments. Each question, category
+// and malformed item is passed to the corresponding callback as it is read.
+// The question passed is reused for the next, so its strings and answers
+// keep their storage; a callback may move from it.
+class GiftParser
+{
+public:
+  std::function<void(const std::string &name)> on_category;
+  std::function<void(GiftQuestion &question)> on_question;
+  std::function<void(size_t line, const std::string &message)> on_error;
+
+  // first_line numbers the lines of a part of a larger text
+  void parse(const char *data, const size_t size, const size_t first_line = 1);
+
+private:
+  void error(const size_t line, const std::string &message);
+
+  void parse_item(const char *p, const char *end, size_t line);
+
+  bool parse_answers(GiftQuestion &question, const char *p, const char *end,
+                     const size_t line);
+
+  // The next answer of the question, reusing one left from an earlier
+  // question if there is one
+  GiftAnswer &next_answer(GiftQuestion &question);
+
+  // Splits answers at each unescaped "=" or "~" (numerical answers have at
+  // most one, and "~" cannot start one), reading any weight and feedback.
+  // The control characters are found by find_gift_special's SIMD scan.
+  bool split_answers(GiftQuestion &question, const char *p, const char *end,
+                     const size_t line, const bool numerical);
+
+  void deliver(GiftQuestion &question);
+
+  GiftQuestion question_;
+  size_t answer_count_ = 0; // Of question_.answers, in use
+  std::string scratch_;
+};
+
+// The problem which makes a generated question unfit to be written as GIFT
+// (e.g. an out-of-range correct answer, which would leave it with no "="
+// answer), or an empty string if there is none
+std::string question_problem(const Question &question);
+
+// Drops the questions which are unfit to be written, with a warning for
+// each. Returns the number dropped.
+size_t remove_invalid_questions(std::vector<Question> &questions);
+
+// A category of a GIFT file and the questions following it
+struct GiftCategory
+{
+  std::string name; // Empty for questions before any $CATEGORY line
+  std::vector<Question> questions;
+};
+
+// Reads the questions of GIFT text by category, as generated questions: the
+// answers become options, and the first correct answer the correct one.
+// Malformed items are skipped.
+std::vector<GiftCategory> parse_gift(const char *text, const size_t size);
+
+// Validates the GIFT files, and prints the malformed items and statistics of
+// each. Each file is mapped and split into parts at blank lines (which
+// always separate items), so that all the parts of all the files are
+// parsed in parallel. Each part counts its own lines, so the line numbers of
+// its errors are known once every part before it has been parsed. Returns
+// the total number of errors.
+size_t validate_gift_files(const std::vector<std::string> &filenames,
+                           const bool quiet);
+
+} // namespace giftgen::detail
@@ -0,0 +1,489 @@
+#ifndef _WIN32
+#include "server.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace giftgen::detail
+{
+
+// Set by SIGINT or SIGTERM; the server then stops accepting connections
+volatile std::sig_atomic_t server_stop_requested = 0;
+
+extern "C" void request_server_stop(int) { server_stop_requested = 1; }
+
+bool send_all(const int fd, const char *data, const size_t size)
+{
+  size_t sent = 0;
+  while (sent < size)
+  {
+    const ssize_t n = ::send(fd, data + sent, size - sent, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    sent += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool send_all(const int fd, const std::string &data)
+{
+  return send_all(fd, data.data(), data.size());
+}
+
+// Requests larger than this (a job is a few hundred bytes) are refused
+const size_t SERVER_MAX_REQUEST_BYTES = 1 << 20;
+
+// Reads the next request of the connection; buffer carries over any bytes
+// received after it. Returns false once the connection is closed, or on a
+// malformed request.
+bool read_server_request(const int fd, std::string &buffer,
+                         ServerRequest &request)
+{
+  auto receive = [&]()
+  {
+    char chunk[16384];
+    ssize_t n;
+    do
+      n = ::recv(fd, chunk, sizeof(chunk), 0);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0 || buffer.size() + size_t(n) > SERVER_MAX_REQUEST_BYTES)
+      return false;
+    buffer.append(chunk, static_cast<size_t>(n));
+    return true;
+  };
+
+  size_t header_end;
+  while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+  {
+    if (!receive())
+      return false;
+  }
+
+  request = ServerRequest{};
+  size_t line_end = buffer.find("\r\n");
+  std::istringstream request_line(buffer.substr(0, line_end));
+  request_line >> request.method >> request.path;
+  request.path = request.path.substr(0, request.path.find('?'));
+
+  while (line_end < header_end)
+  {
+    const size_t start = line_end + 2;
+    line_end = buffer.find("\r\n", start);
+    const std::string line = buffer.substr(start, line_end - start);
+    const size_t colon = line.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    const size_t value_start = line.find_first_not_of(' ', colon + 1);
+    request.headers[name] =
+        value_start == std::string::npos ? "" : line.substr(value_start);
+  }
+  buffer.erase(0, header_end + 4);
+
+  // Only requests of a known length are accepted; as sent by curl and by
+  // HTTP client libraries for a JSON body
+  if (request.headers.count("transfer-encoding"))
+    return false;
+  size_t length = 0;
+  if (request.headers.count("content-length"))
+  {
+    try
+    {
+      length = std::stoul(request.headers["content-length"]);
+    }
+    catch (const std::exception &)
+    {
+      return false;
+    }
+  }
+  if (length > SERVER_MAX_REQUEST_BYTES)
+    return false;
+
+  if (request.headers["expect"] == "100-continue" &&
+      !send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n"))
+    return false;
+
+  while (buffer.size() < length)
+  {
+    if (!receive())
+      return false;
+  }
+  request.body = buffer.substr(0, length);
+  buffer.erase(0, length);
+  return true;
+}
+
+bool send_server_response(const int fd, const int status,
+                          const std::string &reason, const json &body)
+{
+  const std::string content = body.dump() + "\n";
+  return send_all(fd, "HTTP/1.1 " + std::to_string(status) + " " + reason +
+                          "\r\nContent-Type: application/json"
+                          "\r\nContent-Length: " +
+                          std::to_string(content.size()) + "\r\n\r\n" +
+                          content);
+}
+
+// Sends a job's GIFT output as the chunked body of an HTTP response, one
+// chunk per flush. The status line is only sent with the first chunk; so a
+// job failing before any output can still be answered with an error.
+class ChunkedResponseBuf : public std::streambuf
+{
+public:
+  explicit ChunkedResponseBuf(const int fd) : fd_(fd), buffer_(1 << 16)
+  {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
+  bool started() const { return started_; }
+
+  // Sends whatever is buffered and the terminating chunk
+  bool finish()
+  {
+    return sync() == 0 && (started_ || send_head()) &&
+           send_all(fd_, "0\r\n\r\n");
+  }
+
+protected:
+  int overflow(int c) override
+  {
+    if (sync() != 0)
+      return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override
+  {
+    const size_t size = static_cast<size_t>(pptr() - pbase());
+    if (size == 0)
+      return 0;
+    char length[32];
+    std::snprintf(length, sizeof(length), "%zx\r\n", size);
+    if ((!started_ && !send_head()) || !send_all(fd_, length) ||
+        !send_all(fd_, pbase(), size) || !send_all(fd_, "\r\n"))
+      return -1;
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return 0;
+  }
+
+private:
+  bool send_head()
+  {
+    started_ = true;
+    return send_all(fd_, "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: text/plain; charset=utf-8\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n");
+  }
+
+  int fd_;
+  std::vector<char> buffer_;
+  bool started_ = false;
+};
+
+QuizServer::QuizServer(const ServerOptions &options)
+    : options_(options),
+      root_(std::filesystem::weakly_canonical(
+          options.root.empty() ? std::filesystem::current_path()
+                               : std::filesystem::path(options.root)))
+{
+}
+
+void QuizServer::run()
+{
+  listen();
+  std::signal(SIGPIPE, SIG_IGN); // Failed sends are reported by send()
+  std::signal(SIGINT, request_server_stop);
+  std::signal(SIGTERM, request_server_stop);
+  if (!options_.quiet)
+    std::cout << "Serving quiz jobs on " << options_.address
+              << ", with files under " << root_.string() << "."
+              << std::endl;
+  if (unix_path_.empty() && options_.token.empty())
+    std::cerr << "Warning: any user of this machine may send jobs to port "
+              << port_ << "; set MOODLE_GIFT_GEN_SERVE_TOKEN to require a "
+                 "token."
+              << std::endl;
+
+  while (!server_stop_requested)
+  {
+    pollfd listener{listen_fd_, POLLIN, 0};
+    if (::poll(&listener, 1, 250) <= 0)
+      continue;
+    const int fd = ::accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0)
+      continue;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    connections_.insert(fd);
+    std::thread([this, fd] { serve(fd); }).detach();
+  }
+
+  // Running jobs are completed; idle connections are closed
+  if (!options_.quiet)
+    std::cout << "Stopping; waiting for running jobs." << std::endl;
+  ::close(listen_fd_);
+  if (!unix_path_.empty())
+    std::filesystem::remove(unix_path_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (int fd : connections_)
+    ::shutdown(fd, SHUT_RD);
+  closed_.wait(lock, [this] { return connections_.empty(); });
+}
+
+void QuizServer::listen()
+{
+  const std::string unix_prefix = "unix:";
+  if (options_.address.rfind(unix_prefix, 0) == 0)
+  {
+    unix_path_ = options_.address.substr(unix_prefix.size());
+    sockaddr_un address{};
+    if (unix_path_.empty() ||
+        unix_path_.size() >= sizeof(address.sun_path))
+    {
+      throw std::runtime_error("Invalid socket path: " + unix_path_);
+    }
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, unix_path_.c_str(),
+                 sizeof(address.sun_path) - 1);
+
+    // A socket left behind by a server which did not exit cleanly
+    std::error_code ec;
+    if (std::filesystem::is_socket(unix_path_, ec))
+      std::filesystem::remove(unix_path_, ec);
+
+    listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0 ||
+        ::bind(listen_fd_, reinterpret_cast<sockaddr *>(&address),
+               sizeof(address)) < 0 ||
+        ::listen(listen_fd_, SOMAXCONN) < 0)
+    {
+      throw std::runtime_error("Unable to listen on " + unix_path_ + ": " +
+                               std::strerror(errno));
+    }
+    return;
+  }
+
+  // Jobs name local files, so only local clients are served
+  std::string port = options_.address;
+  for (const std::string host : {"localhost:", "127.0.0.1:"})
+  {
+    if (port.rfind(host, 0) == 0)
+      port = port.substr(host.size());
+  }
+  if (port.empty() || port.size() > 5 ||
+      port.find_first_not_of("0123456789") != std::string::npos ||
+      std::stoi(port) > 65535)
+  {
+    throw std::runtime_error("Invalid --serve address: " +
+                             options_.address +
+                             " (use unix:PATH or localhost:PORT)");
+  }
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(static_cast<uint16_t>(std::stoi(port)));
+  port_ = port;
+  listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  if (listen_fd_ < 0 ||
+      ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                   sizeof(reuse)) < 0 ||
+      ::bind(listen_fd_, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+      ::listen(listen_fd_, SOMAXCONN) < 0)
+  {
+    throw std::runtime_error("Unable to listen on port " + port + ": " +
+                             std::strerror(errno));
+  }
+}
+
+void QuizServer::serve(const int fd)
+{
+  std::string buffer;
+  ServerRequest request;
+  while (read_server_request(fd, buffer, request))
+  {
+    bool keep_alive;
+    const std::string refusal = refuse(request);
+    if (!refusal.empty())
+    {
+      keep_alive =
+          send_server_response(fd, 403, "Forbidden", {{"error", refusal}});
+    }
+    else if (request.path == "/jobs" && request.method == "POST" &&
+             request.headers["content-type"].rfind("application/json", 0) !=
+                 0)
+    {
+      keep_alive = send_server_response(
+          fd, 415, "Unsupported Media Type",
+          {{"error", "Jobs must be sent as application/json"}});
+    }
+    else if (request.path == "/jobs" && request.method == "POST")
+    {
+      keep_alive = run_job(fd, request);
+    }
+    else if (request.path == "/health" && request.method == "GET")
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      const json health = {{"status", "ok"},
+                           {"queued", queued_},
+                           {"running", running_},
+                           {"done", done_},
+                           {"failed", failed_}};
+      lock.unlock();
+      keep_alive = send_server_response(fd, 200, "OK", health);
+    }
+    else if (request.path == "/jobs" || request.path == "/health")
+    {
+      keep_alive = send_server_response(
+          fd, 405, "Method Not Allowed",
+          {{"error", request.method + " is not supported by " +
+                         request.path}});
+    }
+    else
+    {
+      keep_alive = send_server_response(
+          fd, 404, "Not Found", {{"error", "No such path: " + request.path}});
+    }
+
+    if (!keep_alive || request.headers["connection"] == "close")
+      break;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  connections_.erase(fd);
+  ::close(fd);
+  closed_.notify_all();
+}
+
+std::string QuizServer::refuse(ServerRequest &request) const
+{
+  if (request.headers.count("origin"))
+    return "Requests from web pages are not served";
+  if (unix_path_.empty() && request.headers["host"] != "localhost:" + port_ &&
+      request.headers["host"] != "127.0.0.1:" + port_)
+    return "Host must be localhost:" + port_;
+  if (!options_.token.empty())
+  {
+    // Compared in full, so the time taken reveals nothing of the token
+    const std::string expected = "Bearer " + options_.token;
+    const std::string &given = request.headers["authorization"];
+    unsigned char differ = given.size() != expected.size();
+    for (size_t i = 0; i < expected.size(); ++i)
+      differ |= (i < given.size() ? given[i] : 0) ^ expected[i];
+    if (differ)
+      return "Missing or wrong Authorization token";
+  }
+  return "";
+}
+
+std::string QuizServer::confine(const std::string &path) const
+{
+  const std::filesystem::path resolved =
+      std::filesystem::weakly_canonical(root_ / path);
+  const std::filesystem::path relative = resolved.lexically_relative(root_);
+  if (relative.empty() || *relative.begin() == "..")
+  {
+    throw std::runtime_error(path +
+                             " is outside the server's root directory");
+  }
+  return resolved.string();
+}
+
+bool QuizServer::run_job(const int fd, const ServerRequest &request)
+{
+  QuizJob job;
+  try
+  {
+    json entry = json::parse(request.body);
+    job = parse_quiz_job(
+        entry, "job", [this](const std::string &path)
+        { return confine(path); }, options_.job.hedge != nullptr);
+  }
+  catch (const std::exception &e)
+  {
+    return send_server_response(fd, 400, "Bad Request",
+                                {{"error", e.what()}});
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  const std::string label = "[job " + std::to_string(++next_job_) + "] " +
+                            (job.output_file.empty() ? "response"
+                                                     : job.output_file);
+  ++queued_;
+  slot_free_.wait(lock, [this]
+                  { return running_ < size_t(options_.max_jobs); });
+  --queued_;
+  ++running_;
+  lock.unlock();
+
+  const auto start = std::chrono::steady_clock::now();
+  RetryScheduler retry(options_.job.retry_policy, true, label + ": ");
+  ChunkedResponseBuf response(fd);
+  std::ostream out(&response);
+  out.exceptions(std::ios::badbit); // A client gone away abandons the job
+  std::ostream *sink = job.output_file.empty() ? &out : nullptr;
+
+  std::string error;
+  int status = 500;
+  try
+  {
+    run_quiz_job(job, options_.job, retry, sink);
+  }
+  catch (const GeminiApiError &e)
+  {
+    error = e.what();
+    status = 502;
+  }
+  catch (const std::exception &e)
+  {
+    error = e.what();
+  }
+
+  // Once output has been sent, a failure can only be shown by closing the
+  // connection before the response is complete
+  bool keep_alive;
+  if (!error.empty())
+    keep_alive = !response.started() &&
+                 send_server_response(fd, status, status == 502
+                                                      ? "Bad Gateway"
+                                                      : "Internal Server Error",
+                                      {{"error", error}});
+  else if (sink)
+    keep_alive = response.finish();
+  else
+    keep_alive = send_server_response(fd, 200, "OK",
+                                      {{"output", job.output_file}});
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  lock.lock();
+  --running_;
+  ++(error.empty() ? done_ : failed_);
+  slot_free_.notify_one();
+  if (!error.empty())
+    std::cerr << label << ": Error: " << error << std::endl;
+  else if (!options_.quiet)
+    std::cout << label << ": done in " << std::fixed << std::setprecision(1)
+              << elapsed.count() << " s" << std::endl;
+  return keep_alive;
+}
+
+} // namespace giftgen::detail
+
+#endif
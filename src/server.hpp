@@ -0,0 +1,82 @@
+// The job server of --serve, over HTTP on a TCP or Unix socket
+#pragma once
+
+#ifndef _WIN32
+#include "generation.hpp"
+
+namespace giftgen::detail
+{
+
+// The settings of a server, and of the jobs it runs
+struct ServerOptions
+{
+  std::string address; // "unix:PATH", or "[localhost:]PORT"
+  std::string root;    // Jobs' paths must lie within; empty for the cwd
+  std::string token;   // Required as "Authorization: Bearer", if not empty
+  int max_jobs = 4;
+  bool quiet = false;
+  JobOptions job;
+};
+
+struct ServerRequest
+{
+  std::string method;
+  std::string path;
+  std::map<std::string, std::string> headers; // Lowercase names
+  std::string body;
+};
+
+// Serves quiz jobs until SIGINT or SIGTERM. Every job shares the process's
+// transfer engine, connection pool, TLS sessions and caches; so, unlike a
+// new process per quiz, a job starts with these already warm.
+//
+//   POST /jobs    A job as in a manifest; the GIFT output is the response
+//                 (streamed as each question completes, with "stream"), or
+//                 is written to the job's "output" file
+//   GET /health   The number of jobs queued, running, done and failed
+class QuizServer
+{
+public:
+  explicit QuizServer(const ServerOptions &options);
+
+  void run();
+
+private:
+  void listen();
+
+  void serve(const int fd);
+
+  // Why the request is refused, or empty if it is not. Jobs read and write
+  // local files, so requests from web pages (which carry an Origin, or, by
+  // DNS rebinding, a foreign Host) are refused; as are requests without the
+  // token, if one is set.
+  std::string refuse(ServerRequest &request) const;
+
+  // The path given in a job, relative to the root directory; paths outside
+  // it (including through symbolic links) are refused
+  std::string confine(const std::string &path) const;
+
+  // Runs the job once one of the max_jobs slots is free, and sends its
+  // response. Returns whether the connection can take another request.
+  bool run_job(const int fd, const ServerRequest &request);
+
+  ServerOptions options_;
+  std::filesystem::path root_;
+  int listen_fd_ = -1;
+  std::string unix_path_;
+  std::string port_;
+
+  std::mutex mutex_;
+  std::set<int> connections_;
+  std::condition_variable closed_;
+  std::condition_variable slot_free_;
+  size_t next_job_ = 0;
+  size_t queued_ = 0;
+  size_t running_ = 0;
+  size_t done_ = 0;
+  size_t failed_ = 0;
+};
+
+} // namespace giftgen::detail
+
+#endif
@@ -0,0 +1,1060 @@
+#include "transport.hpp"
+
+#include "upload.hpp"
+
+namespace giftgen::detail
+{
+
+size_t write_callback(void *contents, size_t size, size_t nmemb,
+                      std::string *result)
+{
+  size_t total_size = size * nmemb;
+  result->append((char *)contents, total_size);
+  return total_size;
+}
+
+size_t header_callback(char *buffer, size_t size, size_t nitems,
+                       std::map<std::string, std::string> *headers)
+{
+  size_t total_size = size * nitems;
+  std::string line(buffer, total_size);
+
+  size_t colon = line.find(':');
+  if (colon != std::string::npos)
+  {
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    size_t start = line.find_first_not_of(" \t", colon + 1);
+    size_t end = line.find_last_not_of(" \t\r\n");
+    (*headers)[name] = start == std::string::npos || end < start
+                           ? ""
+                           : line.substr(start, end - start + 1);
+  }
+
+  return total_size;
+}
+
+void Metrics::record_phase(const std::string &phase,
+                           const std::chrono::steady_clock::time_point start,
+                           const std::chrono::steady_clock::time_point end)
+{
+  if (!enabled())
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto thread = threads_.emplace(std::this_thread::get_id(),
+                                 int(threads_.size()) + 1);
+  spans_.push_back({phase, thread.first->second, start, end});
+}
+
+void Metrics::record_transfer(CURL *curl)
+{
+  if (!enabled())
+    return;
+
+  Transfer transfer;
+  transfer.end = std::chrono::steady_clock::now();
+  char *url = nullptr;
+  char *method = nullptr;
+  curl_off_t dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0;
+  curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+  curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_METHOD, &method);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &transfer.status);
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &transfer.bytes_up);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &transfer.bytes_down);
+  if (total == 0 && transfer.status == 0)
+    return;
+
+  const std::string target = url ? url : "";
+  if (target.find("/upload/") != std::string::npos)
+    transfer.kind = "upload";
+  else if (target.find("/cachedContents") != std::string::npos)
+    transfer.kind = "cache";
+  else if (method && std::string(method) == "DELETE")
+    transfer.kind = "delete";
+  else if (target.find(":streamGenerateContent") != std::string::npos)
+    transfer.kind = "stream";
+  else if (target.find(":generateContent") != std::string::npos)
+    transfer.kind = "generate";
+  else
+    transfer.kind = "status";
+
+  // Each is the time from the start of the transfer, in microseconds
+  transfer.timings = {{"dns", dns},   {"connect", connect}, {"tls", tls},
+                      {"ttfb", ttfb}, {"total", total}};
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  transfers_.push_back(std::move(transfer));
+}
+
+void Metrics::record_usage(const json &usage)
+{
+  if (!enabled() || !usage.is_object())
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  tokens_["input"] = tokens_["input"].get<int64_t>() +
+                     usage.value("promptTokenCount", int64_t(0));
+  tokens_["output"] = tokens_["output"].get<int64_t>() +
+                      usage.value("candidatesTokenCount", int64_t(0));
+  tokens_["thinking"] = tokens_["thinking"].get<int64_t>() +
+                        usage.value("thoughtsTokenCount", int64_t(0));
+  tokens_["cached"] = tokens_["cached"].get<int64_t>() +
+                      usage.value("cachedContentTokenCount", int64_t(0));
+}
+
+void Metrics::save() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const bool prometheus =
+      std::filesystem::path(summary_file).extension() == ".prom";
+  if (!summary_file.empty())
+  {
+    write(summary_file,
+          prometheus ? prometheus_summary() : json_summary().dump(2) + "\n");
+  }
+  if (!trace_file.empty())
+    write(trace_file, trace().dump() + "\n");
+}
+
+double Metrics::seconds(const curl_off_t microseconds)
+{
+  return double(microseconds) / 1e6;
+}
+
+int64_t Metrics::microseconds_since_start(
+    const std::chrono::steady_clock::time_point time) const
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(time -
+                                                               start_)
+      .count();
+}
+
+std::map<std::string, std::pair<double, int>> Metrics::phase_totals() const
+{
+  std::map<std::string, std::pair<double, int>> totals;
+  for (const auto &span : spans_)
+  {
+    auto &total = totals[span.phase];
+    total.first += std::chrono::duration<double>(span.end - span.start)
+                       .count();
+    ++total.second;
+  }
+  return totals;
+}
+
+json Metrics::json_summary() const
+{
+  json summary = {{"phases", json::object()},
+                  {"transfers", json::array()},
+                  {"tokens", tokens_}};
+  for (const auto &[phase, total] : phase_totals())
+    summary["phases"][phase] = {{"seconds", total.first},
+                                {"count", total.second}};
+
+  for (const auto &transfer : transfers_)
+  {
+    json entry = {{"kind", transfer.kind},
+                  {"status", transfer.status},
+                  {"bytes_up", transfer.bytes_up},
+                  {"bytes_down", transfer.bytes_down}};
+    for (const auto &[name, time] : transfer.timings)
+      entry[name + "_seconds"] = seconds(time);
+    summary["transfers"].push_back(std::move(entry));
+  }
+  return summary;
+}
+
+std::string Metrics::prometheus_summary() const
+{
+  std::ostringstream out;
+  out << std::setprecision(9);
+  const std::string prefix = "moodle_gift_gen_";
+  auto metric = [&](const std::string &name, const std::string &help)
+  {
+    out << "# HELP " << prefix << name << " " << help << "\n"
+        << "# TYPE " << prefix << name << " counter\n";
+  };
+
+  const auto totals = phase_totals();
+  metric("phase_seconds_total", "Wall time spent in each phase");
+  for (const auto &[phase, total] : totals)
+    out << prefix << "phase_seconds_total{phase=\"" << phase << "\"} "
+        << total.first << "\n";
+  metric("phase_runs_total", "Times each phase ran");
+  for (const auto &[phase, total] : totals)
+    out << prefix << "phase_runs_total{phase=\"" << phase << "\"} "
+        << total.second << "\n";
+
+  std::map<std::string, int> counts;
+  std::map<std::string, std::map<std::string, curl_off_t>> times, bytes;
+  for (const auto &transfer : transfers_)
+  {
+    ++counts[transfer.kind];
+    for (const auto &[name, time] : transfer.timings)
+      times[transfer.kind][name] += time;
+    bytes[transfer.kind]["up"] += transfer.bytes_up;
+    bytes[transfer.kind]["down"] += transfer.bytes_down;
+  }
+  metric("transfers_total", "Transfers of each kind");
+  for (const auto &[kind, count] : counts)
+    out << prefix << "transfers_total{kind=\"" << kind << "\"} " << count
+        << "\n";
+  metric("transfer_seconds_total",
+         "Time from the start of each transfer until DNS resolution, "
+         "connection, TLS handshake, first byte and completion");
+  for (const auto &[kind, timings] : times)
+  {
+    for (const auto &[name, time] : timings)
+      out << prefix << "transfer_seconds_total{kind=\"" << kind
+          << "\",timing=\"" << name << "\"} " << seconds(time) << "\n";
+  }
+  metric("transfer_bytes_total", "Bytes sent and received");
+  for (const auto &[kind, directions] : bytes)
+  {
+    for (const auto &[direction, count] : directions)
+      out << prefix << "transfer_bytes_total{kind=\"" << kind
+          << "\",direction=\"" << direction << "\"} " << count << "\n";
+  }
+  metric("tokens_total", "Tokens used by generation requests");
+  for (const auto &[type, count] : tokens_.items())
+    out << prefix << "tokens_total{type=\"" << type << "\"} "
+        << count.get<int64_t>() << "\n";
+  return out.str();
+}
+
+json Metrics::trace() const
+{
+  json events = json::array();
+  events.push_back({{"name", "process_name"}, {"ph", "M"}, {"pid", 1},
+                    {"args", {{"name", "phases"}}}});
+  events.push_back({{"name", "process_name"}, {"ph", "M"}, {"pid", 2},
+                    {"args", {{"name", "transfers"}}}});
+
+  for (const auto &span : spans_)
+  {
+    events.push_back({{"name", span.phase},
+                      {"cat", "phase"},
+                      {"ph", "X"},
+                      {"pid", 1},
+                      {"tid", span.thread},
+                      {"ts", microseconds_since_start(span.start)},
+                      {"dur", std::chrono::duration_cast<
+                                  std::chrono::microseconds>(span.end -
+                                                             span.start)
+                                  .count()}});
+  }
+
+  std::vector<const Transfer *> transfers;
+  for (const auto &transfer : transfers_)
+    transfers.push_back(&transfer);
+  auto start_of = [this](const Transfer *transfer)
+  {
+    return microseconds_since_start(transfer->end) -
+           transfer->timings.back().second;
+  };
+  std::sort(transfers.begin(), transfers.end(),
+            [&](const Transfer *a, const Transfer *b)
+            { return start_of(a) < start_of(b); });
+
+  std::vector<int64_t> lane_ends;
+  for (const Transfer *transfer : transfers)
+  {
+    const int64_t start = start_of(transfer);
+    size_t lane = 0;
+    while (lane < lane_ends.size() && lane_ends[lane] > start)
+      ++lane;
+    if (lane == lane_ends.size())
+      lane_ends.push_back(0);
+    lane_ends[lane] = microseconds_since_start(transfer->end);
+
+    json args = {{"status", transfer->status},
+                 {"bytes_up", transfer->bytes_up},
+                 {"bytes_down", transfer->bytes_down}};
+    for (const auto &[name, time] : transfer->timings)
+      args[name + "_ms"] = double(time) / 1e3;
+    events.push_back({{"name", transfer->kind},
+                      {"cat", "transfer"},
+                      {"ph", "X"},
+                      {"pid", 2},
+                      {"tid", lane + 1},
+                      {"ts", start},
+                      {"dur", transfer->timings.back().second},
+                      {"args", std::move(args)}});
+  }
+
+  return {{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+}
+
+void Metrics::write(const std::string &filename, const std::string &data)
+{
+  std::ofstream file(filename);
+  file << data;
+  if (!file.good())
+    std::cerr << "Unable to write metrics to " << filename << std::endl;
+}
+
+Metrics metrics;
+
+PhaseTimer::PhaseTimer(const char *phase)
+    : phase_(phase), start_(std::chrono::steady_clock::now())
+{
+}
+
+PhaseTimer::~PhaseTimer()
+{
+  metrics.record_phase(phase_, start_, std::chrono::steady_clock::now());
+}
+
+void TransferEngine::start(const long max_host_connections)
+{
+  multi_ = curl_multi_init();
+  if (!multi_)
+  {
+    throw std::runtime_error("Failed to initialize CURL multi handle");
+  }
+  curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  if (max_host_connections > 0)
+    curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      max_host_connections);
+
+  stopping_ = false;
+  thread_ = std::thread([this] { run(); });
+}
+
+void TransferEngine::stop()
+{
+  if (!multi_)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  curl_multi_wakeup(multi_);
+  thread_.join();
+
+  curl_multi_cleanup(multi_);
+  multi_ = nullptr;
+}
+
+void TransferEngine::submit(CURL *curl, Callback on_done)
+{
+  if (!multi_)
+  {
+    on_done(curl_easy_perform(curl));
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.emplace_back(curl, std::move(on_done));
+  }
+  curl_multi_wakeup(multi_);
+}
+
+void TransferEngine::cancel(CURL *curl)
+{
+  if (!multi_)
+    return;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  cancels_.push_back(curl);
+  curl_multi_wakeup(multi_);
+  idle_.wait(lock,
+             [&]
+             {
+               return running_ != curl &&
+                      std::find(cancels_.begin(), cancels_.end(), curl) ==
+                          cancels_.end();
+             });
+}
+
+CURLcode TransferEngine::perform(CURL *curl)
+{
+  auto done = std::make_shared<std::promise<CURLcode>>();
+  std::future<CURLcode> result = done->get_future();
+  submit(curl, [done](CURLcode res) { done->set_value(res); });
+  return result.get();
+}
+
+std::vector<CURLcode>
+TransferEngine::perform_all(const std::vector<CURL *> &handles)
+{
+  struct Batch
+  {
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<CURLcode> results;
+    size_t remaining = 0;
+  };
+
+  auto batch = std::make_shared<Batch>();
+  batch->results.assign(handles.size(), CURLE_FAILED_INIT);
+  for (CURL *curl : handles)
+  {
+    if (curl)
+      ++batch->remaining;
+  }
+
+  for (size_t i = 0; i < handles.size(); ++i)
+  {
+    if (!handles[i])
+      continue;
+
+    submit(handles[i],
+           [batch, i](CURLcode res)
+           {
+             std::lock_guard<std::mutex> lock(batch->mutex);
+             batch->results[i] = res;
+             if (--batch->remaining == 0)
+               batch->finished.notify_all();
+           });
+  }
+
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  batch->finished.wait(lock, [&] { return batch->remaining == 0; });
+  return batch->results;
+}
+
+void TransferEngine::fail_all(std::vector<Completion> &done,
+                              const CURLcode result)
+{
+  for (auto &[curl, on_done] : active_)
+  {
+    curl_multi_remove_handle(multi_, curl);
+    done.push_back({curl, std::move(on_done), result});
+  }
+  active_.clear();
+  for (auto &[curl, on_done] : pending_)
+    done.push_back({curl, std::move(on_done), result});
+  pending_.clear();
+}
+
+void TransferEngine::complete(std::vector<Completion> &done)
+{
+  for (auto &completion : done)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = completion.curl;
+    }
+    completion.on_done(completion.result);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = nullptr;
+    }
+    idle_.notify_all();
+  }
+  done.clear();
+}
+
+void TransferEngine::run()
+{
+  std::vector<Completion> done;
+  while (true)
+  {
+    bool stopping;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (CURL *curl : cancels_)
+      {
+        pending_.erase(std::remove_if(pending_.begin(), pending_.end(),
+                                      [&](const auto &entry)
+                                      { return entry.first == curl; }),
+                       pending_.end());
+        if (active_.erase(curl))
+          curl_multi_remove_handle(multi_, curl);
+      }
+      if (!cancels_.empty())
+      {
+        cancels_.clear();
+        idle_.notify_all();
+      }
+
+      stopping = stopping_;
+      if (stopping)
+        fail_all(done, CURLE_ABORTED_BY_CALLBACK);
+
+      for (auto &[curl, on_done] : pending_)
+      {
+        if (curl_multi_add_handle(multi_, curl) == CURLM_OK)
+          active_.emplace(curl, std::move(on_done));
+        else
+          done.push_back({curl, std::move(on_done), CURLE_FAILED_INIT});
+      }
+      pending_.clear();
+    }
+
+    if (stopping)
+    {
+      complete(done);
+      return;
+    }
+
+    int running_handles;
+    CURLMcode mc = curl_multi_perform(multi_, &running_handles);
+
+    int msgs_left;
+    while (CURLMsg *msg = curl_multi_info_read(multi_, &msgs_left))
+    {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      CURL *curl = msg->easy_handle;
+      const CURLcode result = msg->data.result;
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = active_.find(curl);
+      if (it == active_.end())
+        continue;
+      curl_multi_remove_handle(multi_, curl);
+      done.push_back({curl, std::move(it->second), result});
+      active_.erase(it);
+    }
+
+    if (mc == CURLM_OK)
+    {
+      complete(done);
+      mc = curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+    }
+    if (mc != CURLM_OK)
+    {
+      std::cerr << "Transfer engine: " << curl_multi_strerror(mc)
+                << std::endl;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fail_all(done, CURLE_FAILED_INIT);
+      }
+      complete(done);
+    }
+  }
+}
+
+TransferEngine transfer_engine;
+
+// Process-wide transport state: every handle shares one DNS cache, TLS
+// session cache and connection pool, so each phase (and each concurrent job)
+// reuses connections to the Gemini host rather than repeating the DNS, TCP
+// and TLS setup.
+struct Transport
+{
+  CURLSH *share = nullptr;
+  std::mutex locks[CURL_LOCK_DATA_LAST];
+
+  // Resolved addresses persisted between runs, as "host:port" -> addresses
+  bool persist_dns = false;
+  std::mutex dns_mutex;
+  std::map<std::string, std::set<std::string>> dns_addresses;
+  std::map<std::string, int64_t> dns_expiry;
+  curl_slist *resolve = nullptr;
+};
+
+Transport transport;
+
+// Persisted DNS results are trusted for at most this long
+const int64_t DNS_CACHE_SECONDS = 5 * 60;
+
+std::filesystem::path get_dns_cache_path()
+{
+  return get_cache_dir() / "dns.json";
+}
+
+void transport_lock(CURL *, curl_lock_data data, curl_lock_access, void *)
+{
+  transport.locks[data].lock();
+}
+
+void transport_unlock(CURL *, curl_lock_data data, void *)
+{
+  transport.locks[data].unlock();
+}
+
+// Call after curl_global_init
+void init_transport(const bool persist_dns = false,
+                    const long max_connections = 0)
+{
+  transport.share = curl_share_init();
+  if (!transport.share)
+  {
+    throw std::runtime_error("Failed to initialize CURL share handle");
+  }
+
+  curl_share_setopt(transport.share, CURLSHOPT_LOCKFUNC, transport_lock);
+  curl_share_setopt(transport.share, CURLSHOPT_UNLOCKFUNC, transport_unlock);
+  curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+  transfer_engine.start(max_connections);
+
+  transport.persist_dns = persist_dns;
+  if (!persist_dns)
+    return;
+
+  std::ifstream file(get_dns_cache_path());
+  json data = json::parse(file, nullptr, false);
+  if (data.is_discarded() || !data.is_object())
+    return;
+
+  const int64_t now = unix_time_now();
+  for (const auto &[host_port, entry] : data.items())
+  {
+    const int64_t expiry = entry.value("expiry", int64_t(0));
+    if (expiry <= now || !entry.contains("addresses"))
+      continue;
+
+    std::string addresses;
+    for (const auto &address : entry["addresses"])
+    {
+      std::string a = address.get<std::string>();
+      addresses += (addresses.empty() ? "" : ",") +
+                   (a.find(':') != std::string::npos ? "[" + a + "]" : a);
+    }
+    if (!addresses.empty())
+    {
+      transport.resolve = curl_slist_append(
+          transport.resolve, (host_port + ":" + addresses).c_str());
+    }
+  }
+}
+
+// Call before curl_global_cleanup
+void cleanup_transport()
+{
+  finish_file_lifecycle();
+  transfer_engine.stop();
+  metrics.save();
+
+  if (transport.persist_dns && !transport.dns_addresses.empty())
+  {
+    std::ifstream in(get_dns_cache_path());
+    json data = json::parse(in, nullptr, false);
+    if (data.is_discarded() || !data.is_object())
+      data = json::object();
+    in.close();
+
+    for (const auto &[host_port, addresses] : transport.dns_addresses)
+    {
+      data[host_port] = {{"addresses", addresses},
+                         {"expiry", transport.dns_expiry[host_port]}};
+    }
+
+    write_json_file(get_dns_cache_path(), data);
+  }
+
+  curl_slist_free_all(transport.resolve);
+  transport.resolve = nullptr;
+  if (transport.share)
+    curl_share_cleanup(transport.share);
+  transport.share = nullptr;
+}
+
+CURL *make_curl_handle()
+{
+  CURL *curl = curl_easy_init();
+  if (!curl)
+    return nullptr;
+
+  if (transport.share)
+    curl_easy_setopt(curl, CURLOPT_SHARE, transport.share);
+  if (transport.resolve)
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, transport.resolve);
+
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+  curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, long(DNS_CACHE_SECONDS));
+
+  return curl;
+}
+
+void release_curl_handle(CURL *curl)
+{
+  if (!curl)
+    return;
+
+  metrics.record_transfer(curl);
+
+  if (transport.persist_dns)
+  {
+    char *ip = nullptr;
+    char *url = nullptr;
+    long port = 0;
+    curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+    curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &port);
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+
+    CURLU *cu = curl_url();
+    char *host = nullptr;
+    if (ip && *ip && url && port > 0 &&
+        curl_url_set(cu, CURLUPART_URL, url, 0) == CURLUE_OK &&
+        curl_url_get(cu, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+        ip != std::string(host))
+    {
+      const std::string host_port = std::string(host) + ":" +
+                                    std::to_string(port);
+      std::lock_guard<std::mutex> lock(transport.dns_mutex);
+      transport.dns_addresses[host_port].insert(ip);
+      transport.dns_expiry[host_port] = unix_time_now() + DNS_CACHE_SECONDS;
+    }
+    curl_free(host);
+    curl_url_cleanup(cu);
+  }
+
+  curl_easy_cleanup(curl);
+}
+
+bool is_retryable_status(const long response_code)
+{
+  return response_code == 408 || response_code == 429 ||
+         response_code == 500 || response_code == 502 ||
+         response_code == 503 || response_code == 504;
+}
+
+bool is_retryable_error(const CURLcode res)
+{
+  switch (res)
+  {
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_HTTP2:
+  case CURLE_HTTP2_STREAM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+std::chrono::milliseconds
+get_retry_after(const std::map<std::string, std::string> &headers,
+                const std::string &body)
+{
+  auto it = headers.find("retry-after");
+  if (it != headers.end() && !it->second.empty())
+  {
+    if (std::isdigit(static_cast<unsigned char>(it->second[0])))
+      return std::chrono::seconds(std::atol(it->second.c_str()));
+
+    time_t when = curl_getdate(it->second.c_str(), nullptr);
+    if (when > 0)
+      return std::chrono::seconds(std::max<int64_t>(when - unix_time_now(), 0));
+  }
+
+  json response = json::parse(body, nullptr, false);
+  if (response.is_array() && !response.empty())
+    response = response[0];
+  if (response.is_object() && response.contains("error") &&
+      response["error"].contains("details"))
+  {
+    for (const auto &detail : response["error"]["details"])
+    {
+      if (detail.contains("retryDelay") && detail["retryDelay"].is_string())
+      {
+        // Formatted as a protobuf Duration, e.g. "37s" or "0.5s"
+        double seconds = std::atof(
+            detail["retryDelay"].get<std::string>().c_str());
+        return std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
+      }
+    }
+  }
+
+  return std::chrono::milliseconds(0);
+}
+
+RetryScheduler::RetryScheduler(const RetryPolicy &policy,
+                               const bool quiet,
+                               const std::string &label)
+    : policy_(policy), quiet_(quiet), label_(label),
+      start_(std::chrono::steady_clock::now()), rng_(std::random_device{}())
+{
+}
+
+void RetryScheduler::apply_deadline(CURL *curl) const
+{
+  if (policy_.deadline.count() > 0)
+  {
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS,
+                     std::max<long>(long(remaining().count()), 1));
+  }
+}
+
+bool RetryScheduler::wait_before_retry(
+    const std::string &what, const std::string &reason,
+    const std::chrono::milliseconds retry_after)
+{
+  std::chrono::milliseconds delay;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (retries_ >= policy_.max_retries)
+      return false;
+
+    const int64_t cap = std::min<int64_t>(
+        policy_.max_delay.count(),
+        policy_.base_delay.count() << std::min(retries_, 20));
+    std::uniform_int_distribution<int64_t> jitter(0, cap);
+    delay = std::max(std::chrono::milliseconds(jitter(rng_)), retry_after);
+
+    if (policy_.deadline.count() > 0 && delay >= remaining())
+      return false;
+
+    ++retries_;
+    if (!quiet_)
+    {
+      std::cerr << label_ << what << " failed (" << reason << "); retrying in "
+                << std::fixed << std::setprecision(1)
+                << delay.count() / 1000.0 << " s..." << std::endl;
+    }
+  }
+
+  std::this_thread::sleep_for(delay);
+  return true;
+}
+
+std::chrono::milliseconds RetryScheduler::remaining() const
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      start_ + policy_.deadline - std::chrono::steady_clock::now());
+}
+
+HttpResponse perform_request(const std::vector<std::string> &header_lines,
+                             const std::function<void(CURL *)> &setup)
+{
+  HttpResponse response;
+  CURL *curl = make_curl_handle();
+  if (!curl)
+  {
+    throw std::runtime_error("Failed to initialize CURL");
+  }
+
+  struct curl_slist *headers = nullptr;
+  for (const auto &line : header_lines)
+    headers = curl_slist_append(headers, line.c_str());
+
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.body);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response.headers);
+  setup(curl);
+
+  response.result = transfer_engine.perform(curl);
+  if (response.result == CURLE_OK)
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
+
+  curl_slist_free_all(headers);
+  release_curl_handle(curl);
+  return response;
+}
+
+HttpResponse
+perform_with_retry(const std::string &what, RetryScheduler &retry,
+                   const std::vector<std::string> &header_lines,
+                   const std::function<void(CURL *)> &setup,
+                   const std::function<bool(HttpResponse &)> &inspect)
+{
+  while (true)
+  {
+    HttpResponse response = perform_request(header_lines,
+                                            [&](CURL *curl)
+                                            {
+                                              retry.apply_deadline(curl);
+                                              setup(curl);
+                                            });
+    const bool retryable = !inspect || inspect(response);
+
+    if (response.result != CURLE_OK)
+    {
+      const std::string reason = curl_easy_strerror(response.result);
+      if (retryable && is_retryable_error(response.result) &&
+          retry.wait_before_retry(what, reason))
+        continue;
+      throw std::runtime_error(what + " failed: " + reason);
+    }
+
+    if (retryable && is_retryable_status(response.status) &&
+        retry.wait_before_retry(
+            what, "HTTP " + std::to_string(response.status),
+            get_retry_after(response.headers, response.body)))
+      continue;
+    return response;
+  }
+}
+
+std::vector<HttpResponse>
+perform_all_with_retry(const std::string &what, RetryScheduler &retry,
+                       const size_t count,
+                       const std::vector<std::string> &header_lines,
+                       const std::function<void(CURL *, size_t)> &setup)
+{
+  std::vector<HttpResponse> responses(count);
+  std::vector<size_t> pending(count);
+  std::iota(pending.begin(), pending.end(), 0);
+
+  while (!pending.empty())
+  {
+    struct curl_slist *headers = nullptr;
+    for (const auto &line : header_lines)
+      headers = curl_slist_append(headers, line.c_str());
+
+    std::vector<CURL *> handles(pending.size(), nullptr);
+    auto cleanup_handles = [&]()
+    {
+      for (CURL *handle : handles)
+        release_curl_handle(handle);
+      curl_slist_free_all(headers);
+    };
+
+    for (size_t j = 0; j < pending.size(); ++j)
+    {
+      handles[j] = make_curl_handle();
+      if (!handles[j])
+      {
+        cleanup_handles();
+        throw std::runtime_error("Failed to initialize CURL");
+      }
+
+      HttpResponse &response = responses[pending[j]];
+      response = HttpResponse();
+      curl_easy_setopt(handles[j], CURLOPT_HTTPHEADER, headers);
+      curl_easy_setopt(handles[j], CURLOPT_WRITEFUNCTION, write_callback);
+      curl_easy_setopt(handles[j], CURLOPT_WRITEDATA, &response.body);
+      curl_easy_setopt(handles[j], CURLOPT_HEADERFUNCTION, header_callback);
+      curl_easy_setopt(handles[j], CURLOPT_HEADERDATA, &response.headers);
+      retry.apply_deadline(handles[j]);
+      setup(handles[j], pending[j]);
+    }
+
+    const std::vector<CURLcode> outcomes = transfer_engine.perform_all(handles);
+
+    std::vector<size_t> retry_pending;
+    std::string reason;
+    std::chrono::milliseconds retry_after(0);
+    for (size_t j = 0; j < pending.size(); ++j)
+    {
+      HttpResponse &response = responses[pending[j]];
+      response.result = outcomes[j];
+      if (response.result == CURLE_OK)
+      {
+        curl_easy_getinfo(handles[j], CURLINFO_RESPONSE_CODE,
+                          &response.status);
+      }
+
+      if (response.result != CURLE_OK && is_retryable_error(response.result))
+      {
+        reason = curl_easy_strerror(response.result);
+        retry_pending.push_back(pending[j]);
+      }
+      else if (is_retryable_status(response.status))
+      {
+        reason = "HTTP " + std::to_string(response.status);
+        retry_after = std::max(
+            retry_after, get_retry_after(response.headers, response.body));
+        retry_pending.push_back(pending[j]);
+      }
+    }
+
+    cleanup_handles();
+
+    if (retry_pending.empty() ||
+        !retry.wait_before_retry(what, reason, retry_after))
+      break;
+    pending = std::move(retry_pending);
+  }
+
+  return responses;
+}
+
+// The settings in which other differs from active, by name
+std::string transport_conflicts(const TransportSettings &active,
+                                const TransportSettings &other)
+{
+  std::string names;
+  auto check = [&names](const bool same, const char *name)
+  {
+    if (!same)
+      names += (names.empty() ? "" : ", ") + std::string(name);
+  };
+  check(other.base_url == active.base_url, "base_url");
+  check(other.api_key == active.api_key, "api_key");
+  check(other.persist_dns == active.persist_dns, "persist_dns");
+  check(other.max_connections == active.max_connections, "max_connections");
+  check(other.max_uploads == active.max_uploads, "max_uploads");
+  check(other.max_upload_rate == active.max_upload_rate, "max_upload_rate");
+  return names;
+}
+
+// The command line and every Generator share the transport: the first user
+// sets it up, and the last tears it down. A later user whose settings differ
+// is refused, rather than silently run with the first user's.
+std::mutex transport_users_mutex;
+
+size_t transport_users = 0;
+
+TransportSettings active_transport_settings;
+
+void acquire_transport(const TransportSettings &settings)
+{
+  std::lock_guard<std::mutex> lock(transport_users_mutex);
+  if (transport_users > 0)
+  {
+    const std::string conflicts =
+        transport_conflicts(active_transport_settings, settings);
+    if (!conflicts.empty())
+    {
+      throw std::runtime_error(
+          "Options conflict with the transport already in use (" + conflicts +
+          "); every Generator in the process, and the command line, share "
+          "it");
+    }
+    ++transport_users;
+    return;
+  }
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  try
+  {
+    gemini_base_url = settings.base_url;
+    init_transport(settings.persist_dns, settings.max_connections);
+    upload_scheduler.configure(settings.max_uploads,
+                               settings.max_upload_rate);
+    file_lifecycle.start(settings.api_key, settings.quiet);
+  }
+  catch (...)
+  {
+    cleanup_transport();
+    curl_global_cleanup();
+    throw;
+  }
+  active_transport_settings = settings;
+  ++transport_users;
+}
+
+void release_transport()
+{
+  std::lock_guard<std::mutex> lock(transport_users_mutex);
+  if (--transport_users == 0)
+  {
+    cleanup_transport();
+    curl_global_cleanup();
+  }
+}
+
+TransportUser::TransportUser(const TransportSettings &settings)
+{
+  acquire_transport(settings);
+}
+
+} // namespace giftgen::detail
@@ -0,0 +1,287 @@
+// The HTTP transport: the transfer engine driving every request, the
+// connection and DNS settings shared by all users of the library, metrics,
+// and retries.
+#pragma once
+
+#include "common.hpp"
+
+namespace giftgen::detail
+{
+
+size_t write_callback(void *contents, size_t size, size_t nmemb,
+                      std::string *result);
+
+// Collects response headers, with lowercase names
+size_t header_callback(char *buffer, size_t size, size_t nitems,
+                       std::map<std::string, std::string> *headers);
+
+// Wall time per phase, statistics of each transfer and token usage, written
+// on exit to the files given by --metrics and --trace. Nothing is recorded
+// unless one of them is given.
+class Metrics
+{
+public:
+  std::string summary_file; // JSON, or Prometheus text if named "*.prom"
+  std::string trace_file;   // Chrome trace event format
+
+  bool enabled() const { return !summary_file.empty() || !trace_file.empty(); }
+
+  void record_phase(const std::string &phase,
+                    const std::chrono::steady_clock::time_point start,
+                    const std::chrono::steady_clock::time_point end);
+
+  // Records a finished (or abandoned) transfer; handles never performed are
+  // ignored
+  void record_transfer(CURL *curl);
+
+  // Adds the token counts of a response's usageMetadata
+  void record_usage(const json &usage);
+
+  // Failures are reported, but are not errors of the run itself
+  void save() const;
+
+private:
+  struct Span
+  {
+    std::string phase;
+    int thread;
+    std::chrono::steady_clock::time_point start, end;
+  };
+
+  struct Transfer
+  {
+    std::string kind; // "upload", "status", "generate", "stream" or "delete"
+    long status = 0;
+    std::vector<std::pair<std::string, curl_off_t>> timings;
+    curl_off_t bytes_up = 0, bytes_down = 0;
+    std::chrono::steady_clock::time_point end;
+  };
+
+  static double seconds(const curl_off_t microseconds);
+
+  int64_t microseconds_since_start(
+      const std::chrono::steady_clock::time_point time) const;
+
+  // Total time and count of each phase
+  std::map<std::string, std::pair<double, int>> phase_totals() const;
+
+  json json_summary() const;
+
+  std::string prometheus_summary() const;
+
+  // Phases are shown per thread; transfers, which overlap, are spread over
+  // as many lanes as are needed
+  json trace() const;
+
+  static void write(const std::string &filename, const std::string &data);
+
+  mutable std::mutex mutex_;
+  const std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+  std::map<std::thread::id, int> threads_;
+  std::vector<Span> spans_;
+  std::vector<Transfer> transfers_;
+  json tokens_ = {{"input", 0}, {"output", 0}, {"thinking", 0}, {"cached", 0}};
+};
+
+extern Metrics metrics;
+
+// Records the enclosing scope as a phase of the run
+class PhaseTimer
+{
+public:
+  explicit PhaseTimer(const char *phase);
+  ~PhaseTimer();
+
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+  const char *phase_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// The event loop behind every transfer: one multi handle, multiplexing over
+// HTTP/2 where possible, driven by one thread with curl_multi_poll. libcurl
+// waits on its sockets with poll() rather than select(), so the number of
+// concurrent transfers is not capped by FD_SETSIZE. Completion callbacks run
+// on the engine thread and must not themselves wait on the engine.
+class TransferEngine
+{
+public:
+  using Callback = std::function<void(CURLcode)>;
+
+  // Transfers beyond max_host_connections to a host (if not zero) wait for
+  // a connection, or to be multiplexed over one
+  void start(const long max_host_connections = 0);
+
+  // Transfers still in flight complete with CURLE_ABORTED_BY_CALLBACK
+  void stop();
+
+  // Starts the transfer; on_done is called once with its result. Without a
+  // running engine the transfer is performed on the calling thread.
+  void submit(CURL *curl, Callback on_done);
+
+  // Abandons the transfer if it has not completed. On return the engine no
+  // longer uses the handle and its callback is not running.
+  void cancel(CURL *curl);
+
+  CURLcode perform(CURL *curl);
+
+  // Runs the transfers concurrently; null handles fail with CURLE_FAILED_INIT
+  std::vector<CURLcode> perform_all(const std::vector<CURL *> &handles);
+
+private:
+  struct Completion
+  {
+    CURL *curl;
+    Callback on_done;
+    CURLcode result;
+  };
+
+  // Called with mutex_ held
+  void fail_all(std::vector<Completion> &done, const CURLcode result);
+
+  void complete(std::vector<Completion> &done);
+
+  void run();
+
+  CURLM *multi_ = nullptr;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  bool stopping_ = false;
+  std::vector<std::pair<CURL *, Callback>> pending_;
+  std::map<CURL *, Callback> active_;
+  std::vector<CURL *> cancels_;
+  CURL *running_ = nullptr;
+};
+
+extern TransferEngine transfer_engine;
+
+// An easy handle attached to the shared transport; HTTP/2 is negotiated over
+// TLS. Every transfer runs on the one transfer engine, so a new transfer can
+// wait for a connection still being set up and be multiplexed onto it rather
+// than opening another.
+CURL *make_curl_handle();
+
+// Counterpart of make_curl_handle, noting the address that was connected to
+// and the transfer's metrics
+void release_curl_handle(CURL *curl);
+
+bool is_retryable_status(const long response_code);
+
+bool is_retryable_error(const CURLcode res);
+
+// The delay requested by the server, from a Retry-After header (seconds or
+// an HTTP date) or the RetryInfo detail of a Gemini error response
+std::chrono::milliseconds
+get_retry_after(const std::map<std::string, std::string> &headers,
+                const std::string &body = "");
+
+struct RetryPolicy
+{
+  int max_retries = 5; // Budget shared by all requests of one job
+  std::chrono::milliseconds base_delay{1000};
+  std::chrono::milliseconds max_delay{60000};
+  std::chrono::seconds deadline{0}; // Per job; zero means none
+};
+
+// Decides whether, and when, a failed request is retried. One scheduler is
+// used for all the requests of a job (uploads, generation and deletes), and
+// may be shared by the threads of its concurrent uploads.
+class RetryScheduler
+{
+public:
+  explicit RetryScheduler(const RetryPolicy &policy = {},
+                          const bool quiet = false,
+                          const std::string &label = "");
+
+  // Bounds each attempt by the time remaining until the job's deadline
+  void apply_deadline(CURL *curl) const;
+
+  // Sleeps before the next attempt (exponential backoff with full jitter,
+  // but no sooner than retry_after) and returns true; or returns false if
+  // the retry budget or the deadline would be exceeded.
+  bool wait_before_retry(const std::string &what, const std::string &reason,
+                         const std::chrono::milliseconds retry_after =
+                             std::chrono::milliseconds(0));
+
+private:
+  std::chrono::milliseconds remaining() const;
+
+  RetryPolicy policy_;
+  bool quiet_;
+  std::string label_; // Prefixed to messages, e.g. to identify the job
+  std::chrono::steady_clock::time_point start_;
+  std::mutex mutex_;
+  std::mt19937_64 rng_;
+  int retries_ = 0;
+};
+
+// The outcome of one HTTP request; the status is zero if the transfer failed
+struct HttpResponse
+{
+  CURLcode result = CURLE_OK;
+  long status = 0;
+  std::string body;
+  std::map<std::string, std::string> headers;
+};
+
+// Performs one request on a fresh handle, sending header_lines, once setup
+// has set its URL, body and so on. The response body and headers are
+// collected unless setup redirects them.
+HttpResponse perform_request(const std::vector<std::string> &header_lines,
+                             const std::function<void(CURL *)> &setup);
+
+// Performs a request as perform_request, retrying transfer failures and
+// retryable statuses while retry allows; what names the request in messages.
+// inspect, if given, sees each response first, and may throw, or return
+// false to keep a failure from being retried. A transfer that still fails
+// throws; a response with an error status is returned, for the caller.
+HttpResponse perform_with_retry(
+    const std::string &what, RetryScheduler &retry,
+    const std::vector<std::string> &header_lines,
+    const std::function<void(CURL *)> &setup,
+    const std::function<bool(HttpResponse &)> &inspect = nullptr);
+
+// As perform_with_retry, for count requests performed concurrently, setup
+// configuring each by its index; those failing retryably are retried
+// together. Failures are returned with the responses rather than thrown.
+std::vector<HttpResponse>
+perform_all_with_retry(const std::string &what, RetryScheduler &retry,
+                       const size_t count,
+                       const std::vector<std::string> &header_lines,
+                       const std::function<void(CURL *, size_t)> &setup);
+
+// Uploads running at once, across all jobs, unless --max-uploads is given
+const size_t DEFAULT_MAX_UPLOADS = 8;
+
+// What the transport is set up with; every user of it must agree
+struct TransportSettings
+{
+  std::string base_url;
+  std::string api_key; // Of the background deletion of files
+  bool quiet = true;   // Of the background deletion of files
+  bool persist_dns = false;
+  long max_connections = 0;
+  size_t max_uploads = DEFAULT_MAX_UPLOADS;
+  curl_off_t max_upload_rate = 0; // Bytes per second
+};
+
+void acquire_transport(const TransportSettings &settings);
+
+void release_transport();
+
+// Holds the transport for its scope
+class TransportUser
+{
+public:
+  explicit TransportUser(const TransportSettings &settings);
+  ~TransportUser() { release_transport(); }
+
+  TransportUser(const TransportUser &) = delete;
+  TransportUser &operator=(const TransportUser &) = delete;
+};
+
+} // namespace giftgen::detail
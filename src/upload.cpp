@@ -0,0 +1,1631 @@
+#include "upload.hpp"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef MOODLE_GIFT_GEN_JPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+
+namespace giftgen::detail
+{
+
+bool is_inline_file(const std::string &file_id)
+{
+  return file_id.compare(0, INLINE_FILE_PREFIX.size(), INLINE_FILE_PREFIX) == 0;
+}
+
+bool is_cached_content(const std::string &file_id)
+{
+  return file_id.compare(0, CACHED_CONTENT_PREFIX.size(),
+                         CACHED_CONTENT_PREFIX) == 0;
+}
+
+std::string get_extension_mime_type(const std::string &filename)
+{
+  // Find the last dot to get the file extension
+  size_t dot_pos = filename.find_last_of('.');
+  if (dot_pos == std::string::npos)
+  {
+    return "application/octet-stream"; // Default for unknown types
+  }
+
+  std::string extension = filename.substr(dot_pos + 1);
+
+  // Convert extension to lowercase for case-insensitive comparison
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+
+  // Map common file extensions to MIME types
+  if (extension == "pdf")
+    return "application/pdf";
+  else if (extension == "txt")
+    return "text/plain";
+  else if (extension == "md" || extension == "markdown")
+    return "text/markdown";
+  else if (extension == "docx")
+    return "application/"
+           "vnd.openxmlformats-officedocument.wordprocessingml.document";
+  else if (extension == "doc")
+    return "application/msword";
+  else if (extension == "pptx")
+    return "application/"
+           "vnd.openxmlformats-officedocument.presentationml.presentation";
+  else if (extension == "ppt")
+    return "application/vnd.ms-powerpoint";
+  else if (extension == "xlsx")
+    return "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet";
+  else if (extension == "xls")
+    return "application/vnd.ms-excel";
+  else if (extension == "jpg" || extension == "jpeg")
+    return "image/jpeg";
+  else if (extension == "png")
+    return "image/png";
+  else if (extension == "gif")
+    return "image/gif";
+  else if (extension == "bmp")
+    return "image/bmp";
+  else if (extension == "webp")
+    return "image/webp";
+  else if (extension == "tiff" || extension == "tif")
+    return "image/tiff";
+  else if (extension == "svg")
+    return "image/svg+xml";
+  else if (extension == "html" || extension == "htm")
+    return "text/html";
+  else if (extension == "json")
+    return "application/json";
+  else if (extension == "xml")
+    return "application/xml";
+  else if (extension == "csv")
+    return "text/csv";
+  else if (extension == "rtf")
+    return "application/rtf";
+  else
+    return "application/octet-stream"; // Default for unknown types
+}
+
+// The leading bytes of the binary formats Gemini accepts; for WebP, also
+// those at an offset (past the RIFF size)
+struct MagicSignature
+{
+  std::string_view prefix;
+  size_t tag_offset;
+  std::string_view tag;
+  const char *mime_type;
+};
+
+constexpr MagicSignature MAGIC_SIGNATURES[] = {
+    {"%PDF-", 0, "", "application/pdf"},
+    {"\x89PNG\r\n\x1a\n", 0, "", "image/png"},
+    {"\xFF\xD8\xFF", 0, "", "image/jpeg"},
+    {"GIF87a", 0, "", "image/gif"},
+    {"GIF89a", 0, "", "image/gif"},
+    {"RIFF", 8, "WEBP", "image/webp"},
+    {std::string_view("II*\0", 4), 0, "", "image/tiff"},
+    {std::string_view("MM\0*", 4), 0, "", "image/tiff"},
+    {"{\\rtf", 0, "", "application/rtf"},
+};
+
+// Whether any signature starts with each byte; most text files are ruled out
+// by their first byte alone
+constexpr std::array<bool, 256> MAGIC_FIRST_BYTES = []
+{
+  std::array<bool, 256> first{};
+  for (const auto &signature : MAGIC_SIGNATURES)
+    first[static_cast<unsigned char>(signature.prefix[0])] = true;
+  return first;
+}();
+
+// The MIME type given by the file's magic bytes, or nullptr if none match
+const char *sniff_mime_type(const char *data, const size_t size)
+{
+  if (size == 0 || !MAGIC_FIRST_BYTES[static_cast<unsigned char>(data[0])])
+    return nullptr;
+
+  const std::string_view head(data, size);
+  for (const auto &signature : MAGIC_SIGNATURES)
+  {
+    if (head.compare(0, signature.prefix.size(), signature.prefix) == 0 &&
+        (signature.tag.empty() ||
+         head.compare(signature.tag_offset, signature.tag.size(),
+                      signature.tag) == 0))
+      return signature.mime_type;
+  }
+  return nullptr;
+}
+
+// Whether the bytes read as text: no NULs, nor control characters other
+// than whitespace (and escape, as in coloured terminal logs)
+bool looks_like_text(const char *data, const size_t size)
+{
+  return std::none_of(data, data + size,
+                      [](const char c)
+                      {
+                        const auto u = static_cast<unsigned char>(c);
+                        return u < 0x20 && u != '\t' && u != '\n' &&
+                               u != '\r' && u != '\f' && u != 0x1b;
+                      });
+}
+
+std::string get_mime_type(const std::string &filename)
+{
+  std::array<char, 4096> head;
+  std::ifstream file(filename, std::ios::binary);
+  file.read(head.data(), head.size());
+  const size_t size = size_t(file.gcount());
+
+  if (const char *mime_type = sniff_mime_type(head.data(), size))
+    return mime_type;
+
+  const std::string mime_type = get_extension_mime_type(filename);
+  if (mime_type == "application/octet-stream" && size > 0 &&
+      looks_like_text(head.data(), size))
+    return "text/plain";
+  return mime_type;
+}
+
+uintmax_t image_budget = 0;
+
+// Copies a JPEG without its metadata: EXIF and XMP (with any thumbnails), ICC
+// profiles, other application segments and comments. JFIF (APP0) and Adobe
+// (APP14, which says how the colours are encoded) segments are kept. Returns
+// false if the data is not a well-formed JPEG.
+bool strip_jpeg_metadata(const char *data, const size_t size, std::string &out)
+{
+  const auto byte = [data](const size_t i)
+  { return static_cast<unsigned char>(data[i]); };
+  if (size < 4 || byte(0) != 0xFF || byte(1) != 0xD8)
+    return false;
+
+  out.assign(data, 2);
+  size_t i = 2;
+  while (i + 4 <= size)
+  {
+    if (byte(i) != 0xFF)
+      return false;
+    const unsigned char marker = byte(i + 1);
+    if (marker == 0xFF)
+    {
+      ++i; // Fill byte
+      continue;
+    }
+    if (marker == 0xDA)
+    {
+      // The entropy-coded data, and all that follows, is kept as it is
+      out.append(data + i, size - i);
+      return true;
+    }
+
+    const size_t length = size_t(byte(i + 2)) << 8 | byte(i + 3);
+    if (length < 2 || i + 2 + length > size)
+      return false;
+    const bool metadata =
+        (marker >= 0xE1 && marker <= 0xEF && marker != 0xEE) || marker == 0xFE;
+    if (!metadata)
+      out.append(data + i, 2 + length);
+    i += 2 + length;
+  }
+  return false;
+}
+
+// Copies a PNG without its textual and metadata chunks (tEXt, zTXt, iTXt,
+// tIME, eXIf and iCCP). Returns false if the data is not a well-formed PNG.
+bool strip_png_metadata(const char *data, const size_t size, std::string &out)
+{
+  const std::string_view signature("\x89PNG\r\n\x1a\n", 8);
+  if (size < signature.size() ||
+      std::string_view(data, signature.size()) != signature)
+    return false;
+
+  const std::array<std::string_view, 6> metadata = {"tEXt", "zTXt", "iTXt",
+                                                    "tIME", "eXIf", "iCCP"};
+  out.assign(data, signature.size());
+  size_t i = signature.size();
+  while (i + 12 <= size)
+  {
+    const auto *p = reinterpret_cast<const unsigned char *>(data + i);
+    const size_t length = size_t(p[0]) << 24 | size_t(p[1]) << 16 |
+                          size_t(p[2]) << 8 | size_t(p[3]);
+    if (length > size - i - 12)
+      return false;
+    const std::string_view type(data + i + 4, 4);
+    if (std::find(metadata.begin(), metadata.end(), type) == metadata.end())
+      out.append(data + i, length + 12);
+    i += length + 12;
+    if (type == "IEND")
+      return true;
+  }
+  return false;
+}
+
+#ifdef MOODLE_GIFT_GEN_JPEG
+
+// Reports libjpeg errors by jumping back to reencode_jpeg, rather than
+// exiting the process
+struct JpegErrorManager
+{
+  jpeg_error_mgr base;
+  std::jmp_buf jump;
+};
+
+// Decodes a JPEG at 1/scale of its width and height (which libjpeg does
+// cheaply, within the inverse DCT), and encodes it again at the quality
+// given. Only greyscale and colour (YCbCr) JPEGs are re-encoded, as the
+// colours of CMYK JPEGs depend on metadata. Returns false on failure.
+bool reencode_jpeg(const std::string &in, const unsigned scale,
+                   const int quality, std::string &out)
+{
+  jpeg_decompress_struct decoder;
+  jpeg_compress_struct encoder;
+  JpegErrorManager errors;
+  unsigned char *buffer = nullptr;
+  unsigned long buffer_size = 0;
+  // Set before setjmp; objects with destructors must not be skipped by the
+  // jump, so the row buffer is a plain allocation
+  JSAMPLE *volatile row = nullptr;
+  volatile bool encoder_created = false;
+
+  decoder.err = jpeg_std_error(&errors.base);
+  encoder.err = &errors.base;
+  errors.base.error_exit = [](j_common_ptr info)
+  {
+    std::longjmp(reinterpret_cast<JpegErrorManager *>(info->err)->jump, 1);
+  };
+  if (setjmp(errors.jump))
+  {
+    jpeg_destroy_decompress(&decoder);
+    if (encoder_created)
+      jpeg_destroy_compress(&encoder);
+    std::free(row);
+    std::free(buffer);
+    return false;
+  }
+
+  jpeg_create_decompress(&decoder);
+  jpeg_mem_src(&decoder,
+               reinterpret_cast<unsigned char *>(const_cast<char *>(in.data())),
+               static_cast<unsigned long>(in.size()));
+  jpeg_read_header(&decoder, TRUE);
+  if (decoder.jpeg_color_space != JCS_GRAYSCALE &&
+      decoder.jpeg_color_space != JCS_YCbCr)
+  {
+    jpeg_destroy_decompress(&decoder);
+    return false;
+  }
+  decoder.scale_num = 1;
+  decoder.scale_denom = scale;
+  jpeg_start_decompress(&decoder);
+
+  jpeg_create_compress(&encoder);
+  encoder_created = true;
+  jpeg_mem_dest(&encoder, &buffer, &buffer_size);
+  encoder.image_width = decoder.output_width;
+  encoder.image_height = decoder.output_height;
+  encoder.input_components = decoder.output_components;
+  encoder.in_color_space = decoder.out_color_space;
+  jpeg_set_defaults(&encoder);
+  jpeg_set_quality(&encoder, quality, TRUE);
+  jpeg_start_compress(&encoder, TRUE);
+
+  row = static_cast<JSAMPLE *>(
+      std::malloc(size_t(decoder.output_width) * decoder.output_components));
+  if (!row)
+    std::longjmp(errors.jump, 1);
+  JSAMPLE *rows[] = {row};
+  while (decoder.output_scanline < decoder.output_height)
+  {
+    jpeg_read_scanlines(&decoder, rows, 1);
+    jpeg_write_scanlines(&encoder, rows, 1);
+  }
+
+  jpeg_finish_compress(&encoder);
+  jpeg_finish_decompress(&decoder);
+  out.assign(reinterpret_cast<const char *>(buffer), buffer_size);
+  jpeg_destroy_compress(&encoder);
+  jpeg_destroy_decompress(&decoder);
+  std::free(row);
+  std::free(buffer);
+  return true;
+}
+
+#endif
+
+// Reduces an image to within budget bytes, if it can: first by stripping its
+// metadata, and then (for a JPEG, given libjpeg) by re-encoding it at quality
+// 85: at full size, then at half, a quarter or an eighth of its width and
+// height, until it fits. Returns false if nothing was saved.
+bool reduce_image(const MappedFile &file, const std::string &mime_type,
+                  const uintmax_t budget, std::string &out)
+{
+  const bool stripped =
+      mime_type == "image/jpeg"
+          ? strip_jpeg_metadata(file.data(), file.size(), out)
+      : mime_type == "image/png"
+          ? strip_png_metadata(file.data(), file.size(), out)
+          : false;
+  if (!stripped)
+    out.assign(file.data(), file.size());
+
+#ifdef MOODLE_GIFT_GEN_JPEG
+  const int quality = 85;
+  for (unsigned scale = 1;
+       mime_type == "image/jpeg" && out.size() > budget && scale <= 8;
+       scale *= 2)
+  {
+    std::string reencoded;
+    if (!reencode_jpeg(out, scale, quality, reencoded))
+      break;
+    if (reencoded.size() < out.size())
+      out = std::move(reencoded);
+  }
+#else
+  (void)budget;
+#endif
+  return out.size() < file.size();
+}
+
+// A file as it is to be sent: the file itself, or a reduced copy of it in the
+// cache directory. The key (of the upload cache) is the hash of the content
+// sent, and its MIME type.
+struct PreparedInput
+{
+  std::string filename; // As given by the user
+  std::string path;
+  std::string key;
+  uintmax_t size = 0;
+  uintmax_t original_size = 0;
+};
+
+// Total size of the reduced images kept; the least recently used are evicted
+const uintmax_t REDUCED_CACHE_MAX_BYTES = 256 * 1024 * 1024;
+
+// Prepares the files for upload on a pool of threads, a file at a time: each
+// is hashed and its type sniffed; and if an image larger than image_budget
+// (when that is non-zero), reduced. A reduced copy is kept in the cache
+// directory, under the hash of the original, for later runs.
+std::vector<PreparedInput>
+prepare_inputs(const std::vector<std::string> &filenames, const bool quiet)
+{
+  PhaseTimer phase("prepare");
+  std::vector<PreparedInput> inputs(filenames.size());
+  std::vector<std::exception_ptr> failures(filenames.size());
+  const std::filesystem::path reduced_dir = get_cache_dir() / "reduced";
+
+  auto prepare = [&](const size_t i)
+  {
+    const std::string &filename = filenames[i];
+    PreparedInput &input = inputs[i];
+    MappedFile file(filename);
+    Sha256 sha;
+    sha.update(file.data(), file.size());
+    const std::string hash = sha.hex_digest();
+    const std::string mime_type = get_mime_type(filename);
+    input = {filename, filename, hash + ":" + mime_type, file.size(),
+             file.size()};
+
+    if (image_budget == 0 || file.size() <= image_budget ||
+        mime_type.compare(0, 6, "image/") != 0)
+      return;
+
+    const std::filesystem::path reduced =
+        reduced_dir / (hash + "-" + std::to_string(image_budget) +
+                       std::filesystem::path(filename).extension().string());
+    std::error_code ec;
+    if (std::filesystem::exists(reduced, ec))
+      std::filesystem::last_write_time(
+          reduced, std::filesystem::file_time_type::clock::now(), ec);
+    else
+    {
+      std::string data;
+      if (!reduce_image(file, mime_type, image_budget, data) ||
+          !write_cache_file(reduced, data))
+        return;
+    }
+
+    MappedFile copy(reduced.string());
+    sha.reset();
+    sha.update(copy.data(), copy.size());
+    input = {filename, reduced.string(), sha.hex_digest() + ":" + mime_type,
+             copy.size(), file.size()};
+  };
+
+  std::atomic<size_t> next{0};
+  auto worker = [&]()
+  {
+    for (size_t i = next++; i < filenames.size(); i = next++)
+    {
+      try
+      {
+        prepare(i);
+      }
+      catch (...)
+      {
+        failures[i] = std::current_exception();
+      }
+    }
+  };
+
+  const size_t num_workers = std::min<size_t>(
+      filenames.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; ++i)
+    workers.emplace_back(worker);
+  for (auto &thread : workers)
+    thread.join();
+
+  for (const auto &failure : failures)
+  {
+    if (failure)
+      std::rethrow_exception(failure);
+  }
+
+  size_t reduced = 0;
+  uintmax_t before = 0, after = 0;
+  std::set<std::filesystem::path> in_use;
+  for (const auto &input : inputs)
+  {
+    if (input.size < input.original_size)
+    {
+      ++reduced;
+      before += input.original_size;
+      after += input.size;
+      in_use.insert(input.path);
+    }
+  }
+  if (reduced > 0)
+    evict_cache_files(reduced_dir, REDUCED_CACHE_MAX_BYTES, in_use);
+  if (!quiet && reduced > 0)
+    std::cout << "Reduced " << reduced << " images from " << std::fixed
+              << std::setprecision(1) << before / 1e6 << " MB to "
+              << after / 1e6 << " MB." << std::endl;
+  return inputs;
+}
+
+int64_t parse_rfc3339_utc(const std::string &timestamp)
+{
+  int y, mo, d, h, mi, s;
+  if (std::sscanf(timestamp.c_str(), "%d-%d-%dT%d:%d:%d", &y, &mo, &d, &h, &mi,
+                  &s) != 6)
+  {
+    return 0;
+  }
+
+  // Days since 1970-01-01 in the proleptic Gregorian calendar
+  y -= mo <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const int64_t yoe = y - era * 400;
+  const int64_t doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  const int64_t days = era * 146097 + doe - 719468;
+
+  return days * 86400 + h * 3600 + mi * 60 + s;
+}
+
+UploadCache::UploadCache(std::filesystem::path path,
+                         const int64_t margin)
+    : path_(std::move(path)), margin_(margin)
+{
+  std::lock_guard<std::mutex> lock(file_mutex());
+  entries_ = read(path_);
+}
+
+const UploadCache::Entry *UploadCache::lookup(const std::string &key) const
+{
+  auto it = entries_.find(key);
+  if (it == entries_.end() ||
+      it->second.expiry < unix_time_now() + margin_)
+  {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+bool UploadCache::offers(const std::string &file_id) const
+{
+  for (const auto &[key, entry] : entries_)
+  {
+    if (entry.file_id == file_id && lookup(key))
+      return true;
+  }
+  return false;
+}
+
+void UploadCache::store(const std::string &key, const Entry &entry)
+{
+  entries_[key] = entry;
+  stored_.insert(key);
+}
+
+void UploadCache::forget(const std::vector<std::string> &file_ids)
+{
+  forgotten_.insert(file_ids.begin(), file_ids.end());
+}
+
+void UploadCache::save() const
+{
+  std::lock_guard<std::mutex> lock(file_mutex());
+
+  std::map<std::string, Entry> merged = read(path_);
+  for (const auto &key : stored_)
+    merged[key] = entries_.at(key);
+
+  json data = json::object();
+  const int64_t now = unix_time_now();
+  for (const auto &[key, entry] : merged)
+  {
+    if (entry.expiry > now && !forgotten_.count(entry.file_id))
+      data[key] = {{"file_id", entry.file_id}, {"expiry", entry.expiry}};
+  }
+
+  write_json_file(path_, data);
+}
+
+std::mutex &UploadCache::file_mutex()
+{
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::map<std::string, UploadCache::Entry>
+UploadCache::read(const std::filesystem::path &path)
+{
+  std::map<std::string, Entry> entries;
+  std::ifstream file(path);
+  if (!file.good())
+    return entries;
+
+  json data = json::parse(file, nullptr, false);
+  if (data.is_discarded() || !data.is_object())
+    return entries;
+
+  // Entries of the wrong shape (e.g. from hand editing) are skipped
+  for (const auto &[key, value] : data.items())
+  {
+    if (value.is_object() && value.contains("file_id") &&
+        value["file_id"].is_string() && value.contains("expiry") &&
+        value["expiry"].is_number_integer())
+    {
+      entries[key] = {value["file_id"].get<std::string>(),
+                      value["expiry"].get<int64_t>()};
+    }
+  }
+  return entries;
+}
+
+std::filesystem::path get_upload_cache_path()
+{
+  return get_cache_dir() / "uploads.json";
+}
+
+std::filesystem::path get_context_cache_path()
+{
+  return get_cache_dir() / "context-caches.json";
+}
+
+// Returns, for each file ID, whether the file is still present on the server
+std::vector<bool> check_remote_files(const std::vector<std::string> &file_ids,
+                                     const std::string &api_key)
+{
+  std::vector<bool> present(file_ids.size(), false);
+  if (file_ids.empty())
+    return present;
+
+  std::vector<CURL *> handles(file_ids.size());
+  std::vector<std::string> results(file_ids.size());
+
+  for (size_t i = 0; i < file_ids.size(); ++i)
+  {
+    handles[i] = make_curl_handle();
+    if (!handles[i])
+      continue; // Treated as missing; the file is simply uploaded again
+
+    std::string url =
+        gemini_base_url + "/v1beta/files/" + file_ids[i] + "?key=" + api_key;
+
+    curl_easy_setopt(handles[i], CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(handles[i], CURLOPT_WRITEDATA, &results[i]);
+  }
+
+  // A failed check leaves present[] false, which only costs a re-upload
+  const std::vector<CURLcode> outcomes = transfer_engine.perform_all(handles);
+
+  for (size_t i = 0; i < handles.size(); ++i)
+  {
+    if (!handles[i])
+      continue;
+
+    long response_code = 0;
+    curl_easy_getinfo(handles[i], CURLINFO_RESPONSE_CODE, &response_code);
+    if (outcomes[i] == CURLE_OK && response_code == 200)
+    {
+      json response = json::parse(results[i], nullptr, false);
+      present[i] = !response.is_discarded() &&
+                   response.value("state", "ACTIVE") == "ACTIVE";
+    }
+
+    release_curl_handle(handles[i]);
+  }
+
+  return present;
+}
+
+void UploadScheduler::configure(const size_t max_in_flight,
+                                const curl_off_t max_rate)
+{
+  max_in_flight_ = std::max<size_t>(max_in_flight, 1);
+  max_rate_ = max_rate;
+}
+
+void UploadScheduler::run(const std::vector<uintmax_t> &sizes,
+                          const Upload &upload)
+{
+  std::vector<size_t> order(sizes.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+  Batch batch(*this);
+  std::atomic<size_t> next{0};
+  std::exception_ptr failure;
+  std::mutex failure_mutex;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    unfinished_ += sizes.size();
+  }
+
+  auto worker = [&]()
+  {
+    for (size_t i = next++; i < order.size(); i = next++)
+    {
+      if (batch.failed_)
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --unfinished_;
+        continue;
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        slot_free_.wait(lock, [this] { return in_flight_ < max_in_flight_; });
+        ++in_flight_;
+      }
+
+      try
+      {
+        if (!batch.failed_)
+          upload(order[i], batch);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(failure_mutex);
+        if (!failure)
+          failure = std::current_exception();
+        batch.failed_ = true;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      --in_flight_;
+      --unfinished_;
+      slot_free_.notify_one();
+    }
+  };
+
+  const size_t num_workers = std::min(order.size(), max_in_flight_);
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_workers; ++i)
+    workers.emplace_back(worker);
+  if (num_workers > 0)
+    worker();
+  for (auto &thread : workers)
+    thread.join();
+
+  if (failure)
+    std::rethrow_exception(failure);
+}
+
+void UploadScheduler::apply_rate_limit(CURL *curl)
+{
+  if (max_rate_ <= 0)
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  const size_t sharing =
+      std::max<size_t>(std::min(max_in_flight_, unfinished_), 1);
+  curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE,
+                   std::max<curl_off_t>(max_rate_ / curl_off_t(sharing), 1));
+}
+
+UploadScheduler upload_scheduler;
+
+// The file part of a multipart upload, as read by curl
+struct UploadHandle
+{
+  std::unique_ptr<MappedFile> file;
+  size_t offset = 0;
+};
+
+// Feeds the file part of a multipart upload from the file's mapping
+size_t upload_read_callback(char *buffer, size_t size, size_t nitems,
+                            void *userdata)
+{
+  UploadHandle *handle = static_cast<UploadHandle *>(userdata);
+  const size_t n =
+      std::min(size * nitems, handle->file->size() - handle->offset);
+  std::memcpy(buffer, handle->file->data() + handle->offset, n);
+  handle->offset += n;
+  return n;
+}
+
+int upload_seek_callback(void *userdata, curl_off_t offset, int origin)
+{
+  UploadHandle *handle = static_cast<UploadHandle *>(userdata);
+  if (origin != SEEK_SET || offset < 0 ||
+      static_cast<size_t>(offset) > handle->file->size())
+    return CURL_SEEKFUNC_CANTSEEK;
+  handle->offset = static_cast<size_t>(offset);
+  return CURL_SEEKFUNC_OK;
+}
+
+// Chunks must be a multiple of 256 KiB, except for the last
+const size_t RESUMABLE_CHUNK_SIZE = 8 << 20;
+
+// Upload URLs of interrupted resumable uploads, keyed as the upload cache
+std::filesystem::path get_resumable_journal_path()
+{
+  return get_cache_dir() / "resumable.json";
+}
+
+std::mutex resumable_journal_mutex;
+
+void update_resumable_journal(const std::string &key, const json &entry)
+{
+  std::lock_guard<std::mutex> lock(resumable_journal_mutex);
+
+  std::ifstream file(get_resumable_journal_path());
+  json journal = json::parse(file, nullptr, false);
+  file.close();
+  if (journal.is_discarded() || !journal.is_object())
+    journal = json::object();
+
+  if (entry.is_null())
+    journal.erase(key);
+  else
+    journal[key] = entry;
+
+  write_json_file(get_resumable_journal_path(), journal);
+}
+
+json read_resumable_journal(const std::string &key)
+{
+  std::lock_guard<std::mutex> lock(resumable_journal_mutex);
+
+  std::ifstream file(get_resumable_journal_path());
+  json journal = json::parse(file, nullptr, false);
+  if (journal.is_discarded() || !journal.contains(key))
+    return nullptr;
+  return journal[key];
+}
+
+// Sets up a request of the resumable upload protocol, posting body
+void setup_resumable_request(CURL *curl, const std::string &url,
+                             const char *body, const size_t body_size)
+{
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, curl_off_t(body_size));
+}
+
+// One request of the resumable upload protocol, not retried
+HttpResponse resumable_request(const std::string &url,
+                               const std::vector<std::string> &header_lines,
+                               const char *body, const size_t body_size,
+                               const RetryScheduler &retry,
+                               const UploadScheduler::Batch *batch = nullptr)
+{
+  return perform_request(header_lines,
+                         [&](CURL *curl)
+                         {
+                           setup_resumable_request(curl, url, body, body_size);
+                           retry.apply_deadline(curl);
+                           if (batch)
+                             batch->apply_rate_limit(curl);
+                         });
+}
+
+std::string resumable_failure(const long code)
+{
+  return code ? "HTTP " + std::to_string(code) : "transfer failed";
+}
+
+// Uploads a large file in chunks using the resumable upload protocol, and
+// returns the upload response. Each chunk is retried on failure, resuming
+// from the offset the server reports; and the upload URL is journalled, so
+// a later run can resume an interrupted upload of the same content. The
+// file is named display_name on the server.
+json upload_file_resumable(const std::string &filename,
+                           const std::string &display_name,
+                           const std::string &key,
+                           const std::string &api_key,
+                           RetryScheduler &retry,
+                           const UploadScheduler::Batch *batch = nullptr)
+{
+  // Each chunk is sent straight from the mapping
+  const MappedFile file(filename);
+  const uintmax_t size = file.size();
+
+  HttpResponse response;
+  uintmax_t offset = 0;
+
+  // Returns true, with the offset updated, if the upload can continue; an
+  // offset missing or malformed (or beyond the file) means starting afresh
+  auto query_offset = [&](const std::string &upload_url)
+  {
+    response = resumable_request(upload_url, {"X-Goog-Upload-Command: query"},
+                                 "", 0, retry);
+    if (response.status != 200 ||
+        response.headers["x-goog-upload-status"] != "active")
+      return false;
+    const std::string &received =
+        response.headers["x-goog-upload-size-received"];
+    uintmax_t value = 0;
+    const auto [end, error] =
+        std::from_chars(received.data(), received.data() + received.size(),
+                        value);
+    if (error != std::errc() || end != received.data() + received.size() ||
+        received.empty() || value > size)
+      return false;
+    offset = value;
+    return true;
+  };
+
+  auto start_upload = [&]()
+  {
+    offset = 0;
+    json metadata = {{"file", {{"display_name", display_name}}}};
+    std::string body = metadata.dump();
+
+    const std::string url =
+        gemini_base_url + "/upload/v1beta/files?key=" + api_key;
+    response = perform_with_retry(
+        "Upload of " + filename, retry,
+        {"X-Goog-Upload-Protocol: resumable", "X-Goog-Upload-Command: start",
+         "X-Goog-Upload-Header-Content-Length: " + std::to_string(size),
+         "X-Goog-Upload-Header-Content-Type: " + get_mime_type(filename),
+         "Content-Type: application/json"},
+        [&](CURL *curl)
+        { setup_resumable_request(curl, url, body.data(), body.size()); });
+
+    std::string upload_url = response.headers["x-goog-upload-url"];
+    if (response.status != 200 || upload_url.empty())
+    {
+      throw std::runtime_error("Upload failed for " + filename + " with HTTP " +
+                               std::to_string(response.status));
+    }
+    update_resumable_journal(key, {{"upload_url", upload_url}, {"offset", 0}});
+    return upload_url;
+  };
+
+  std::string upload_url;
+  json checkpoint = read_resumable_journal(key);
+  if (checkpoint.is_object() && checkpoint.contains("upload_url") &&
+      query_offset(checkpoint["upload_url"]))
+  {
+    upload_url = checkpoint["upload_url"];
+  }
+  else
+  {
+    upload_url = start_upload();
+  }
+
+  while (true)
+  {
+    // The journal lets a later run resume from here
+    if (batch && batch->stopped())
+    {
+      throw std::runtime_error("Upload of " + filename +
+                               " stopped, as another upload failed");
+    }
+
+    const size_t n = static_cast<size_t>(
+        std::min<uintmax_t>(RESUMABLE_CHUNK_SIZE, size - offset));
+    const bool last = offset + n == size;
+
+    response = resumable_request(
+        upload_url,
+        {"X-Goog-Upload-Offset: " + std::to_string(offset),
+         std::string("X-Goog-Upload-Command: ") +
+             (last ? "upload, finalize" : "upload")},
+        file.data() + offset, n, retry, batch);
+
+    if (response.status == 200)
+    {
+      if (last)
+        break;
+      offset += n;
+      update_resumable_journal(key,
+                               {{"upload_url", upload_url}, {"offset", offset}});
+      continue;
+    }
+
+    if (!retry.wait_before_retry(
+            "Upload of " + filename, resumable_failure(response.status),
+            get_retry_after(response.headers, response.body)))
+    {
+      throw std::runtime_error("Upload failed for " + filename + " at offset " +
+                               std::to_string(offset) + " (" +
+                               resumable_failure(response.status) + ")");
+    }
+
+    // Continue from whatever the server committed; an upload that can no
+    // longer be resumed was either finalized or has to start again.
+    if (!query_offset(upload_url))
+    {
+      if (response.headers["x-goog-upload-status"] == "final")
+        break;
+      upload_url = start_upload();
+    }
+  }
+
+  update_resumable_journal(key, nullptr);
+
+  json uploaded = json::parse(response.body, nullptr, false);
+  if (uploaded.is_discarded())
+  {
+    throw std::runtime_error("Failed to parse file ID from upload response for " +
+                             filename);
+  }
+  return uploaded;
+}
+
+// Uploads a file as one multipart request, named display_name on the
+// server, and returns the upload response. Retryable failures are retried.
+json upload_file_multipart(const std::string &filename,
+                           const std::string &display_name,
+                           const std::string &api_key, RetryScheduler &retry,
+                           const UploadScheduler::Batch *batch = nullptr)
+{
+  const std::string url =
+      gemini_base_url + "/upload/v1beta/files?key=" + api_key;
+  const std::string metadata =
+      json{{"file", {{"display_name", display_name}}}}.dump();
+
+  UploadHandle handle;
+  handle.file = std::make_unique<MappedFile>(filename);
+
+  // Each attempt posts a new form, freed with its handle
+  std::unique_ptr<curl_mime, decltype(&curl_mime_free)> mime(nullptr,
+                                                             curl_mime_free);
+  auto setup = [&](CURL *curl)
+  {
+    handle.offset = 0;
+    mime.reset(curl_mime_init(curl));
+
+    // Add metadata part
+    curl_mimepart *part = curl_mime_addpart(mime.get());
+    curl_mime_name(part, "metadata");
+    curl_mime_data(part, metadata.c_str(), CURL_ZERO_TERMINATED);
+    curl_mime_type(part, "application/json; charset=utf-8");
+
+    // Add file part, read from the mapping
+    part = curl_mime_addpart(mime.get());
+    curl_mime_name(part, "file");
+    curl_mime_filename(part, display_name.c_str());
+    curl_mime_data_cb(part, curl_off_t(handle.file->size()),
+                      upload_read_callback, upload_seek_callback, nullptr,
+                      &handle);
+    curl_mime_type(part, get_mime_type(filename).c_str());
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime.get());
+    if (batch)
+      batch->apply_rate_limit(curl);
+  };
+
+  // No retry once another upload of the batch has failed
+  auto inspect = [&](const HttpResponse &response)
+  {
+    if (response.status != 200 && batch && batch->stopped())
+    {
+      throw std::runtime_error("Upload of " + filename +
+                               " stopped, as another upload failed");
+    }
+    return true;
+  };
+
+  const HttpResponse response =
+      perform_with_retry("Upload of " + filename, retry, {}, setup, inspect);
+  if (response.status != 200)
+  {
+    throw std::runtime_error("Upload failed for " + filename + " with HTTP " +
+                             std::to_string(response.status));
+  }
+  if (response.body.empty())
+  {
+    throw std::runtime_error("Empty response for " + filename);
+  }
+  return json::parse(response.body, nullptr, false);
+}
+
+// Files are held for their uploading process, against --gc, for at most this
+// long (in case the process ID is reused)
+const int64_t FILE_OWNER_SECONDS = 24 * 60 * 60;
+
+// Files are kept by the server for 48 hours, if it gives no expiry
+const int64_t FILE_DEFAULT_LIFETIME_SECONDS = 48 * 60 * 60;
+
+std::filesystem::path get_file_journal_path()
+{
+  return get_cache_dir() / "files.json";
+}
+
+bool process_alive(const int64_t pid)
+{
+#ifdef _WIN32
+  HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, DWORD(pid));
+  if (!process)
+    return false;
+  const bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+  CloseHandle(process);
+  return alive;
+#else
+  return kill(pid_t(pid), 0) == 0 || errno == EPERM;
+#endif
+}
+
+// A journal, shared by all runs, of every file uploaded: its expiry, and the
+// process which uploaded it, while that process runs. Files whose process
+// has gone (e.g. crashed) and which the upload cache does not offer for reuse
+// are orphans, for --gc to delete.
+class FileJournal
+{
+public:
+  struct Entry
+  {
+    int64_t expiry = 0;
+    int64_t owner = 0; // Process ID; zero once the process is done with it
+    int64_t owner_until = 0;
+
+    bool owned() const
+    {
+      return owner != 0 && owner_until > unix_time_now() &&
+             process_alive(owner);
+    }
+  };
+
+  static void record(const std::string &file_id, const int64_t expiry)
+  {
+    update([&](std::map<std::string, Entry> &entries)
+           {
+             entries[file_id] = {expiry, current_process_id(),
+                                 unix_time_now() + FILE_OWNER_SECONDS};
+           });
+  }
+
+  // Releases the files of this process, which are left for --gc
+  static void disown()
+  {
+    update([](std::map<std::string, Entry> &entries)
+           {
+             for (auto &[file_id, entry] : entries)
+             {
+               if (entry.owner == current_process_id())
+                 entry.owner = 0;
+             }
+           });
+  }
+
+  static void forget(const std::vector<std::string> &file_ids)
+  {
+    update([&](std::map<std::string, Entry> &entries)
+           {
+             for (const auto &file_id : file_ids)
+               entries.erase(file_id);
+           });
+  }
+
+  static std::map<std::string, Entry> read()
+  {
+    std::lock_guard<std::mutex> lock(file_mutex());
+    return read_file();
+  }
+
+private:
+  // Serialises the read-modify-write of concurrent jobs within this process;
+  // expired entries are dropped
+  static void
+  update(const std::function<void(std::map<std::string, Entry> &)> &change)
+  {
+    std::lock_guard<std::mutex> lock(file_mutex());
+    std::map<std::string, Entry> entries = read_file();
+    change(entries);
+
+    json data = json::object();
+    const int64_t now = unix_time_now();
+    for (const auto &[file_id, entry] : entries)
+    {
+      if (entry.expiry > now)
+      {
+        data[file_id] = {{"expiry", entry.expiry},
+                         {"owner", entry.owner},
+                         {"owner_until", entry.owner_until}};
+      }
+    }
+    write_json_file(get_file_journal_path(), data);
+  }
+
+  static std::mutex &file_mutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::map<std::string, Entry> read_file()
+  {
+    std::map<std::string, Entry> entries;
+    std::ifstream file(get_file_journal_path());
+    if (!file.good())
+      return entries;
+
+    json data = json::parse(file, nullptr, false);
+    if (data.is_discarded() || !data.is_object())
+      return entries;
+
+    for (const auto &[file_id, value] : data.items())
+    {
+      entries[file_id] = {value.value("expiry", int64_t(0)),
+                          value.value("owner", int64_t(0)),
+                          value.value("owner_until", int64_t(0))};
+    }
+    return entries;
+  }
+};
+
+// Deletes the files, and context caches, from the server concurrently, and
+// returns those deleted (or found already gone). Deleted files are no longer
+// offered for reuse by later runs.
+std::vector<std::string> cleanup_files(const std::vector<std::string> &file_ids,
+                                       const std::string &api_key,
+                                       RetryScheduler &retry,
+                                       const bool quiet = false)
+{
+  std::vector<std::string> deleted;
+  if (file_ids.empty())
+    return deleted;
+
+  PhaseTimer phase("cleanup");
+  // Inline files were never uploaded
+  std::vector<std::string> pending;
+  std::copy_if(file_ids.begin(), file_ids.end(), std::back_inserter(pending),
+               [](const std::string &id) { return !is_inline_file(id); });
+  const size_t count = pending.size();
+  if (count == 0)
+    return deleted;
+
+  if (!quiet)
+    std::cout << "Starting parallel deletion of " << count
+              << " files from Gemini..." << std::endl;
+
+  std::vector<HttpResponse> responses;
+  try
+  {
+    responses = perform_all_with_retry(
+        "Deletion of " + std::to_string(count) + " files", retry, count, {},
+        [&](CURL *curl, const size_t i)
+        {
+          const std::string url =
+              is_cached_content(pending[i])
+                  ? gemini_base_url + "/v1beta/" +
+                        pending[i].substr(CACHED_CONTENT_PREFIX.size()) +
+                        "?key=" + api_key
+                  : gemini_base_url + "/v1beta/files/" + pending[i] +
+                        "?key=" + api_key;
+          curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+          curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+        });
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "File deletion failed: " << e.what() << std::endl;
+  }
+
+  std::string reason;
+  for (size_t i = 0; i < responses.size(); ++i)
+  {
+    const HttpResponse &response = responses[i];
+    if (response.status == 200 || response.status == 404)
+      deleted.push_back(pending[i]);
+    else if (response.result != CURLE_OK && is_retryable_error(response.result))
+      reason = curl_easy_strerror(response.result);
+    else if (is_retryable_status(response.status))
+      reason = "HTTP " + std::to_string(response.status);
+  }
+  if (!reason.empty())
+    std::cerr << "File deletion incomplete: " << reason << std::endl;
+
+  // Deleted files must not be offered for reuse by later runs
+  std::vector<std::string> deleted_files, deleted_caches;
+  for (const auto &file_id : deleted)
+  {
+    if (is_cached_content(file_id))
+      deleted_caches.push_back(file_id.substr(CACHED_CONTENT_PREFIX.size()));
+    else
+      deleted_files.push_back(file_id);
+  }
+  UploadCache cache(get_upload_cache_path());
+  cache.forget(deleted_files);
+  cache.save();
+  if (!deleted_caches.empty())
+  {
+    UploadCache context_cache(get_context_cache_path());
+    context_cache.forget(deleted_caches);
+    context_cache.save();
+  }
+  FileJournal::forget(deleted_files);
+
+  if (!quiet)
+  {
+    if (deleted.size() == count)
+      std::cout << "All " << count
+                << " files have been successfully deleted from online storage."
+                << std::endl;
+    else
+      std::cout << deleted.size() << " of " << count
+                << " files have been deleted from online storage."
+                << std::endl;
+  }
+  return deleted;
+}
+
+void FileLifecycle::start(const std::string &api_key, const bool quiet)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  api_key_ = api_key;
+  quiet_ = quiet;
+}
+
+void FileLifecycle::mark_disposable(const std::string &file_id)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  disposable_.insert(file_id);
+}
+
+void FileLifecycle::acquire(const std::vector<std::string> &file_ids)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &file_id : file_ids)
+    ++users_[file_id];
+}
+
+void FileLifecycle::release(const std::vector<std::string> &file_ids)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &file_id : file_ids)
+  {
+    if (--users_[file_id] > 0)
+      continue;
+    users_.erase(file_id);
+    if (disposable_.erase(file_id))
+      queue(file_id);
+  }
+}
+
+void FileLifecycle::finish()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &file_id : disposable_)
+    {
+      if (!users_.count(file_id))
+        queue(file_id);
+    }
+    disposable_.clear();
+    stopping_ = true;
+    queued_.notify_all();
+  }
+  if (thread_.joinable())
+    thread_.join();
+
+  if (!quiet_ && deleted_ > 0)
+    std::cout << "Deleted " << deleted_ << " files from online storage."
+              << std::endl;
+  if (recorded_)
+    FileJournal::disown();
+
+  // Ready for reuse, should the transport be set up again
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopping_ = false;
+  deleted_ = 0;
+  recorded_ = false;
+}
+
+void FileLifecycle::uploaded(const std::string &file_id, const int64_t expiry,
+                             const bool disposable)
+{
+  FileJournal::record(file_id, expiry);
+  recorded_ = true;
+  if (disposable)
+    mark_disposable(file_id);
+}
+
+void FileLifecycle::queue(const std::string &file_id)
+{
+  pending_.push_back(file_id);
+  if (!thread_.joinable())
+    thread_ = std::thread([this] { run(); });
+  queued_.notify_one();
+}
+
+void FileLifecycle::run()
+{
+  RetryScheduler retry(RetryPolicy{}, true);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true)
+  {
+    queued_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+    if (pending_.empty())
+      return;
+
+    std::vector<std::string> batch;
+    batch.swap(pending_);
+    const std::string api_key = api_key_;
+    lock.unlock();
+    const size_t deleted = cleanup_files(batch, api_key, retry, true).size();
+    lock.lock();
+    deleted_ += deleted;
+  }
+}
+
+FileLifecycle file_lifecycle;
+
+void finish_file_lifecycle() { file_lifecycle.finish(); }
+
+FileLease::FileLease(const std::vector<std::string> &file_ids)
+{
+  add(file_ids);
+}
+
+void FileLease::add(const std::vector<std::string> &file_ids)
+{
+  file_lifecycle.acquire(file_ids);
+  file_ids_.insert(file_ids_.end(), file_ids.begin(), file_ids.end());
+}
+
+void FileLease::release()
+{
+  file_lifecycle.release(file_ids_);
+  file_ids_.clear();
+}
+
+// Returns the IDs of all the files stored on the server, page by page
+std::vector<std::string> list_remote_files(const std::string &api_key,
+                                           RetryScheduler &retry)
+{
+  std::vector<std::string> file_ids;
+  std::string page_token;
+  do
+  {
+    std::string url =
+        gemini_base_url + "/v1beta/files?pageSize=100&key=" + api_key;
+    if (!page_token.empty())
+      url += "&pageToken=" + page_token;
+
+    const HttpResponse listing = perform_with_retry(
+        "File listing", retry, {},
+        [&](CURL *curl) { curl_easy_setopt(curl, CURLOPT_URL, url.c_str()); });
+
+    const json response = json::parse(listing.body, nullptr, false);
+    if (listing.status != 200 || response.is_discarded())
+    {
+      throw std::runtime_error("Failed to list files (HTTP " +
+                               std::to_string(listing.status) + ")");
+    }
+
+    for (const auto &file : response.value("files", json::array()))
+    {
+      const std::string name = file.value("name", "");
+      if (!name.empty())
+        file_ids.push_back(name.substr(name.find_last_of('/') + 1));
+    }
+    page_token = response.value("nextPageToken", "");
+  } while (!page_token.empty());
+
+  return file_ids;
+}
+
+size_t collect_garbage(const std::string &api_key, const bool quiet,
+                       RetryScheduler &retry)
+{
+  const std::vector<std::string> remote = list_remote_files(api_key, retry);
+  const std::map<std::string, FileJournal::Entry> journal =
+      FileJournal::read();
+  const UploadCache cache(get_upload_cache_path());
+
+  std::vector<std::string> orphans, gone;
+  size_t kept = 0;
+  const std::set<std::string> remote_ids(remote.begin(), remote.end());
+  for (const auto &[file_id, entry] : journal)
+  {
+    if (!remote_ids.count(file_id))
+      gone.push_back(file_id);
+    else if (entry.owned() || cache.offers(file_id))
+      ++kept;
+    else
+      orphans.push_back(file_id);
+  }
+
+  // Entries of files already deleted, or expired, are of no further use
+  FileJournal::forget(gone);
+
+  if (!quiet)
+    std::cout << remote.size() << " files on the server: " << orphans.size()
+              << " orphaned, " << kept << " in use or kept for reuse."
+              << std::endl;
+
+  const size_t deleted = cleanup_files(orphans, api_key, retry, quiet).size();
+  return orphans.size() - deleted;
+}
+
+std::vector<std::string> upload_files(const std::vector<std::string> &filenames,
+                                      const std::string &api_key,
+                                      RetryScheduler &retry,
+                                      const bool quiet,
+                                      const bool use_cache,
+                                      const uintmax_t resumable_threshold,
+                                      const uintmax_t inline_threshold,
+                                      std::vector<size_t> *file_indices)
+{
+  if (filenames.empty())
+    return {};
+
+  // Key each file by content hash and MIME type, in first-seen order; the
+  // file sent may be a reduced copy
+  const std::vector<PreparedInput> inputs = prepare_inputs(filenames, quiet);
+  PhaseTimer phase("upload");
+  std::vector<std::string> keys;
+  std::map<std::string, std::string> key_filenames;
+  std::map<std::string, std::string> key_display_names;
+  std::map<std::string, size_t> key_indices;
+  if (file_indices)
+    file_indices->clear();
+  for (const auto &input : inputs)
+  {
+    const std::string &key = input.key;
+    if (key_filenames.emplace(key, input.path).second)
+    {
+      // A reduced copy is still named after the user's file
+      key_display_names[key] = input.filename.substr(
+          input.filename.find_last_of("/\\") + 1);
+      key_indices[key] = keys.size();
+      keys.push_back(key);
+    }
+    if (file_indices)
+      file_indices->push_back(key_indices[key]);
+  }
+
+  // Files smaller than the inline threshold are not uploaded, but sent inline
+  // with each generateContent request
+  std::map<std::string, std::string> key_file_ids;
+  for (const auto &key : keys)
+  {
+    if (std::filesystem::file_size(key_filenames[key]) < inline_threshold)
+      key_file_ids[key] = INLINE_FILE_PREFIX + key_filenames[key];
+  }
+  const size_t inline_count = key_file_ids.size();
+
+  std::optional<UploadCache> cache;
+  if (use_cache)
+  {
+    cache.emplace(get_upload_cache_path());
+
+    std::vector<std::string> cached_keys, cached_ids;
+    for (const auto &key : keys)
+    {
+      if (key_file_ids.count(key))
+        continue;
+      if (const UploadCache::Entry *entry = cache->lookup(key))
+      {
+        cached_keys.push_back(key);
+        cached_ids.push_back(entry->file_id);
+      }
+    }
+
+    std::vector<bool> present = check_remote_files(cached_ids, api_key);
+    for (size_t i = 0; i < cached_keys.size(); ++i)
+    {
+      if (present[i])
+        key_file_ids[cached_keys[i]] = cached_ids[i];
+    }
+
+    if (!quiet && key_file_ids.size() > inline_count)
+      std::cout << "Reusing " << key_file_ids.size() - inline_count
+                << " previously uploaded files." << std::endl;
+  }
+
+  std::vector<std::string> pending_keys;
+  for (const auto &key : keys)
+  {
+    if (key_file_ids.find(key) == key_file_ids.end())
+      pending_keys.push_back(key);
+  }
+
+  if (!quiet && !pending_keys.empty())
+    std::cout << "Starting parallel upload of " << pending_keys.size()
+              << " files to Gemini..." << std::endl;
+
+  std::vector<uintmax_t> sizes;
+  for (const auto &key : pending_keys)
+    sizes.push_back(std::filesystem::file_size(key_filenames.at(key)));
+
+  // The file ID of each upload is taken as it completes; so after a failure,
+  // the uploads which did complete are still cached for a re-run
+  std::mutex upload_mutex;
+  auto record = [&](const std::string &key, const json &response)
+  {
+    if (response.is_discarded() || !response.contains("file") ||
+        !response["file"].contains("name"))
+    {
+      throw std::runtime_error(
+          "Failed to parse file ID from upload response for " +
+          key_filenames.at(key));
+    }
+
+    const std::string file_name = response["file"]["name"];
+    const std::string file_id =
+        file_name.substr(file_name.find_last_of('/') + 1);
+    const bool has_expiry = response["file"].contains("expirationTime");
+    const int64_t expiry =
+        has_expiry ? parse_rfc3339_utc(response["file"]["expirationTime"])
+                   : unix_time_now() + FILE_DEFAULT_LIFETIME_SECONDS;
+    file_lifecycle.uploaded(file_id, expiry, !use_cache);
+
+    std::lock_guard<std::mutex> lock(upload_mutex);
+    key_file_ids[key] = file_id;
+    if (cache && has_expiry)
+      cache->store(key, {file_id, expiry});
+  };
+
+  // Large files use the resumable protocol, and the rest are sent as single
+  // multipart requests
+  try
+  {
+    upload_scheduler.run(
+        sizes,
+        [&](const size_t i, const UploadScheduler::Batch &batch)
+        {
+          const std::string &key = pending_keys[i];
+          const std::string &filename = key_filenames.at(key);
+          const std::string &display_name = key_display_names.at(key);
+          record(key, sizes[i] >= resumable_threshold
+                          ? upload_file_resumable(filename, display_name, key,
+                                                  api_key, retry, &batch)
+                          : upload_file_multipart(filename, display_name,
+                                                  api_key, retry, &batch));
+        });
+  }
+  catch (...)
+  {
+    if (cache)
+      cache->save();
+    throw;
+  }
+
+  if (!quiet && !pending_keys.empty())
+    std::cout << "Successfully uploaded all " << pending_keys.size()
+              << " files to Gemini in parallel." << std::endl;
+
+  if (cache)
+    cache->save();
+
+  std::vector<std::string> file_ids;
+  file_ids.reserve(keys.size());
+  for (const auto &key : keys)
+    file_ids.push_back(key_file_ids[key]);
+
+  return file_ids;
+}
+
+} // namespace giftgen::detail
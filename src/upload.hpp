@@ -0,0 +1,232 @@
+// Uploads to the Files API: MIME detection, image reduction, the upload
+// cache, the upload scheduler, resumable uploads, and the lifecycle of
+// uploaded files.
+#pragma once
+
+#include "transport.hpp"
+
+namespace giftgen::detail
+{
+
+// Small files can be sent inline, in the generateContent request itself,
+// rather than uploaded; these are listed among the file IDs by filename,
+// following this prefix.
+inline const std::string INLINE_FILE_PREFIX = "inline:";
+
+bool is_inline_file(const std::string &file_id);
+
+// Files may instead be held in a context cache on the server, which each
+// request refers to by name; the cache is listed among the file IDs by its
+// name, following this prefix. The cache also holds QUIZ_QUERY_CONSTRAINTS,
+// as its system instruction, so these are not sent again with each query.
+inline const std::string CACHED_CONTENT_PREFIX = "cached:";
+
+bool is_cached_content(const std::string &file_id);
+
+// The MIME type of a file: that of its magic bytes, if they are those of a
+// binary format, so a misnamed file is sent as what it is; otherwise that of
+// its extension. A file of unknown extension which reads as text is sent as
+// plain text.
+std::string get_mime_type(const std::string &filename);
+
+// Images larger than this many bytes are reduced before upload; zero to send
+// images as they are (--image-budget)
+extern uintmax_t image_budget;
+
+// Parse an RFC 3339 UTC timestamp, e.g. "2025-01-15T12:34:56.123456Z"
+int64_t parse_rfc3339_utc(const std::string &timestamp);
+
+// Cached file IDs must outlive the generation request (and interactive retries)
+const int64_t UPLOAD_CACHE_MARGIN_SECONDS = 60 * 60;
+
+// Maps "<sha256>:<mime type>" to the Gemini file ID and its expiry time (or,
+// for context caches, a hash of their contents to the cache's name)
+class UploadCache
+{
+public:
+  struct Entry
+  {
+    std::string file_id;
+    int64_t expiry = 0;
+  };
+
+  explicit UploadCache(std::filesystem::path path,
+                       const int64_t margin = UPLOAD_CACHE_MARGIN_SECONDS);
+
+  const Entry *lookup(const std::string &key) const;
+
+  // Whether a lookup may still return the file ID
+  bool offers(const std::string &file_id) const;
+
+  void store(const std::string &key, const Entry &entry);
+
+  void forget(const std::vector<std::string> &file_ids);
+
+  // Changes are merged with whatever other jobs or processes saved since this
+  // cache was loaded; expired entries are dropped.
+  void save() const;
+
+private:
+  // Serialises the read-merge-write of concurrent jobs within this process
+  static std::mutex &file_mutex();
+
+  static std::map<std::string, Entry> read(const std::filesystem::path &path);
+
+  std::filesystem::path path_;
+  int64_t margin_;
+  std::map<std::string, Entry> entries_;
+  std::set<std::string> stored_;
+  std::set<std::string> forgotten_;
+};
+
+// Context caches are reused by later runs only while they have this long
+// left to live
+const int64_t CONTEXT_CACHE_MARGIN_SECONDS = 5 * 60;
+
+std::filesystem::path get_context_cache_path();
+
+// Schedules the uploads of each batch (one call of upload_files): largest
+// first, so the longest uploads do not start last and set the batch's finish
+// time; with at most max_in_flight uploads running at once, across all the
+// batches of concurrent jobs; and sharing an optional cap on their combined
+// rate, in bytes per second. A batch stops at its first failure: no more of
+// its uploads are started, and its resumable uploads stop before their next
+// chunk.
+class UploadScheduler
+{
+public:
+  class Batch
+  {
+  public:
+    bool stopped() const { return failed_; }
+
+    // Call for each transfer of an upload
+    void apply_rate_limit(CURL *curl) const
+    {
+      scheduler_.apply_rate_limit(curl);
+    }
+
+  private:
+    friend class UploadScheduler;
+    explicit Batch(UploadScheduler &scheduler) : scheduler_(scheduler) {}
+
+    UploadScheduler &scheduler_;
+    std::atomic<bool> failed_{false};
+  };
+
+  using Upload = std::function<void(size_t, const Batch &)>;
+
+  void configure(const size_t max_in_flight, const curl_off_t max_rate);
+
+  // Calls upload for the index of each size, and rethrows the first failure
+  void run(const std::vector<uintmax_t> &sizes, const Upload &upload);
+
+private:
+  // Each transfer gets an equal share of the cap, among as many uploads as
+  // may be running while it does
+  void apply_rate_limit(CURL *curl);
+
+  size_t max_in_flight_ = DEFAULT_MAX_UPLOADS;
+  curl_off_t max_rate_ = 0; // No cap
+  std::mutex mutex_;
+  std::condition_variable slot_free_;
+  size_t in_flight_ = 0;
+  size_t unfinished_ = 0; // Uploads of running batches yet to finish
+};
+
+extern UploadScheduler upload_scheduler;
+
+// Files of at least this size use the resumable upload protocol
+const uintmax_t DEFAULT_RESUMABLE_THRESHOLD = 32 << 20;
+
+// Deletes the files which this process uploaded but does not keep for reuse
+// (nor any context caches it made likewise), as soon as no job uses them; in
+// the background, e.g. while the GIFT output is written. Deletions queued
+// together are sent together, over the transfer engine. Whatever is left
+// when the process is done is deleted by finish().
+class FileLifecycle
+{
+public:
+  void start(const std::string &api_key, const bool quiet);
+
+  void mark_disposable(const std::string &file_id);
+
+  void acquire(const std::vector<std::string> &file_ids);
+
+  void release(const std::vector<std::string> &file_ids);
+
+  // Deletes the disposable files not in use, waiting for all deletions to
+  // finish; the files kept for reuse are left for --gc once they are not
+  void finish();
+
+  // Records an uploaded file in the journal, for --gc should this process
+  // not delete it; a disposable file is deleted once no job uses it
+  void uploaded(const std::string &file_id, const int64_t expiry,
+                const bool disposable);
+
+private:
+  // Called with mutex_ held
+  void queue(const std::string &file_id);
+
+  void run();
+
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::thread thread_;
+  std::string api_key_;
+  bool quiet_ = true;
+  bool stopping_ = false;
+  std::atomic<bool> recorded_{false};
+  std::map<std::string, int> users_;
+  std::set<std::string> disposable_;
+  std::vector<std::string> pending_;
+  size_t deleted_ = 0;
+};
+
+extern FileLifecycle file_lifecycle;
+
+void finish_file_lifecycle();
+
+// The files (and context caches) used by a job; acquired when constructed,
+// and released by release(), e.g. once generation is done, or else when
+// destroyed
+class FileLease
+{
+public:
+  explicit FileLease(const std::vector<std::string> &file_ids = {});
+  ~FileLease() { release(); }
+
+  FileLease(const FileLease &) = delete;
+  FileLease &operator=(const FileLease &) = delete;
+
+  void add(const std::vector<std::string> &file_ids);
+
+  void release();
+
+private:
+  std::vector<std::string> file_ids_;
+};
+
+// Deletes the orphans among the files stored on the server: those uploaded
+// by a run which did not delete them (e.g. it crashed), which no running
+// process still uses, and which the upload cache does not offer for reuse.
+// Files uploaded by other tools, and so not in the journal, are left alone.
+// Returns the number of orphans not deleted.
+size_t collect_garbage(const std::string &api_key, const bool quiet,
+                       RetryScheduler &retry);
+
+// Uploads the files (or reuses cached uploads of identical content) and
+// returns the file IDs; files with identical content share a single ID. If
+// given, file_indices receives the position of each file's ID.
+std::vector<std::string> upload_files(const std::vector<std::string> &filenames,
+                                      const std::string &api_key,
+                                      RetryScheduler &retry,
+                                      const bool quiet = false,
+                                      const bool use_cache = true,
+                                      const uintmax_t resumable_threshold =
+                                          DEFAULT_RESUMABLE_THRESHOLD,
+                                      const uintmax_t inline_threshold = 0,
+                                      std::vector<size_t> *file_indices =
+                                          nullptr);
+
+} // namespace giftgen::detail
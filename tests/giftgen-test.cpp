@@ -0,0 +1,559 @@
+// Checks the SIMD code paths of libgiftgen against scalar references, that
+// rendered GIFT reads back as the quiz it was rendered from, and the parsers,
+// planners, caches and retry logic behind generation, none of which needs the
+// network. Built from the library's sources, with the same options, as the
+// functions tested are internal to it.
+#include "src/generation.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace giftgen::detail;
+using giftgen::Question;
+using giftgen::Quiz;
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do                                                                           \
+  {                                                                            \
+    if (!(condition))                                                          \
+    {                                                                          \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition " failed"    \
+                << std::endl;                                                  \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (false)
+
+std::string base64_reference(const std::string &in)
+{
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < in.size(); i += 3)
+  {
+    uint32_t bits = uint32_t(uint8_t(in[i])) << 16;
+    if (i + 1 < in.size())
+      bits |= uint32_t(uint8_t(in[i + 1])) << 8;
+    if (i + 2 < in.size())
+      bits |= uint8_t(in[i + 2]);
+    out += alphabet[(bits >> 18) & 63];
+    out += alphabet[(bits >> 12) & 63];
+    out += i + 1 < in.size() ? alphabet[(bits >> 6) & 63] : '=';
+    out += i + 2 < in.size() ? alphabet[bits & 63] : '=';
+  }
+  return out;
+}
+
+size_t find_gift_special_reference(const std::string &text)
+{
+  const size_t at = text.find_first_of("{}#:~=");
+  return at == std::string::npos ? text.size() : at;
+}
+
+void test_base64(std::mt19937 &random)
+{
+  // Every length up to a few SIMD blocks, for each tail, then a large input
+  std::vector<size_t> sizes;
+  for (size_t size = 0; size <= 200; ++size)
+    sizes.push_back(size);
+  sizes.push_back(100003);
+
+  for (const size_t size : sizes)
+  {
+    std::string in(size, '\0');
+    for (auto &c : in)
+      c = char(random());
+    std::string out(base64_encoded_size(size), '\0');
+    base64_encode(reinterpret_cast<const unsigned char *>(in.data()), size,
+                  &out[0]);
+    CHECK(out == base64_reference(in));
+  }
+}
+
+void test_find_gift_special(std::mt19937 &random)
+{
+  const std::string specials = "{}#:~=";
+
+  // A single control character at each position of each length, across the
+  // blocks and the scalar tail
+  for (size_t size = 0; size <= 100; ++size)
+  {
+    std::string text(size, 'a');
+    CHECK(find_gift_special(text.data(), text.size()) == size);
+    for (size_t at = 0; at < size; ++at)
+    {
+      for (const char special : specials)
+      {
+        text[at] = special;
+        CHECK(find_gift_special(text.data(), text.size()) == at);
+      }
+      text[at] = 'a';
+    }
+  }
+
+  // Random text, mostly of near misses, with the odd control character
+  const std::string others = "abz09 \n\\|[]!\x7f\x80\xff";
+  for (int i = 0; i < 10000; ++i)
+  {
+    std::string text(random() % 300, '\0');
+    for (auto &c : text)
+      c = random() % 200 == 0 ? specials[random() % specials.size()]
+                              : others[random() % others.size()];
+    CHECK(find_gift_special(text.data(), text.size()) ==
+          find_gift_special_reference(text));
+  }
+}
+
+void test_gift_round_trip()
+{
+  Quiz quiz;
+  quiz.questions.push_back(
+      {"Sets", "What is {1, 2} \\cap {2, 3}?", {"{2}", "{1, 3}", "{}"}, 0, ""});
+  quiz.questions.push_back({"Ratios: a#b",
+                            "Which is a = b / c?\nSee page 3.",
+                            {"a:b ~ c", "50% = 1/2", "C:\\path"},
+                            2,
+                            ""});
+  quiz.questions.push_back({"", "No title here", {"yes", "no"}, 1, ""});
+
+  const std::string gift = convert_to_gift_format(quiz, "Week 3");
+
+  std::vector<std::string> categories;
+  std::vector<GiftQuestion> questions;
+  size_t errors = 0;
+  GiftParser parser;
+  parser.on_category = [&](const std::string &name)
+  { categories.push_back(name); };
+  parser.on_question = [&](GiftQuestion &question)
+  { questions.push_back(question); };
+  parser.on_error = [&](size_t, const std::string &) { ++errors; };
+  parser.parse(gift.data(), gift.size());
+
+  CHECK(errors == 0);
+  CHECK(categories == std::vector<std::string>{"Week 3"});
+  CHECK(questions.size() == quiz.questions.size());
+  for (size_t i = 0; i < questions.size() && i < quiz.questions.size(); ++i)
+  {
+    const Question &expected = quiz.questions[i];
+    const GiftQuestion &actual = questions[i];
+    CHECK(actual.type == GiftQuestionType::MultipleChoice);
+    CHECK(actual.title == expected.title);
+    CHECK(actual.format == "markdown");
+    CHECK(actual.text == expected.question);
+    CHECK(actual.answers.size() == expected.options.size());
+    for (size_t j = 0;
+         j < actual.answers.size() && j < expected.options.size(); ++j)
+    {
+      CHECK(actual.answers[j].text == expected.options[j]);
+      CHECK(actual.answers[j].correct == (int(j) == expected.correct_answer));
+    }
+  }
+}
+
+// A scratch directory, removed with its contents when done
+class TemporaryDirectory
+{
+public:
+  TemporaryDirectory()
+      : path_(std::filesystem::temp_directory_path() /
+              ("giftgen-test-" + std::to_string(current_process_id())))
+  {
+    std::filesystem::remove_all(path_);
+    std::filesystem::create_directories(path_);
+  }
+  ~TemporaryDirectory()
+  {
+    std::error_code ec;
+    std::filesystem::remove_all(path_, ec);
+  }
+
+  std::filesystem::path operator/(const std::string &name) const
+  {
+    return path_ / name;
+  }
+
+private:
+  std::filesystem::path path_;
+};
+
+void write_file(const std::filesystem::path &path, const std::string &data)
+{
+  std::ofstream(path, std::ios::binary) << data;
+}
+
+void test_gift_parser_errors()
+{
+  const std::string gift = "::T1::Good {=a ~b}\n"
+                           "\n"
+                           "::T2::Not closed {=a ~b\n"
+                           "\n"
+                           "// A comment\n"
+                           "::T3:: {=a ~b}\n"
+                           "\n"
+                           "\n"
+                           "::T4::No correct answer {~a ~b}\n"
+                           "\n"
+                           "::T5 {=a ~b}\n";
+
+  std::vector<std::pair<size_t, std::string>> errors;
+  std::vector<std::string> titles;
+  GiftParser parser;
+  parser.on_question = [&](GiftQuestion &question)
+  { titles.push_back(question.title); };
+  parser.on_error = [&](size_t line, const std::string &message)
+  { errors.emplace_back(line, message); };
+  parser.parse(gift.data(), gift.size());
+
+  // Each malformed item is reported at its first line, and skipped
+  CHECK(titles == std::vector<std::string>{"T1"});
+  const std::vector<std::pair<size_t, std::string>> expected = {
+      {3, "answers are not closed by \"}\""},
+      {6, "question has no text"},
+      {9, "multiple choice question has no correct answer"},
+      {11, "title is not closed by \"::\""}};
+  CHECK(errors == expected);
+
+  // A part of a larger text numbers its lines from first_line
+  errors.clear();
+  parser.parse(gift.data(), gift.size(), 101);
+  CHECK(errors.size() == expected.size());
+  for (size_t i = 0; i < errors.size() && i < expected.size(); ++i)
+    CHECK(errors[i].first == expected[i].first + 100);
+}
+
+void test_plan_gift_append()
+{
+  TemporaryDirectory directory;
+  const std::string gift = "$CATEGORY: A\n"
+                           "\n"
+                           "::Q1::One {=a ~b}\n"
+                           "\n"
+                           "$CATEGORY: B\n"
+                           "\n"
+                           "::Q2::Two {=a ~b}\n"
+                           "\n"
+                           "::Q3::Three {=a ~b}\n";
+  const std::string file = (directory / "quiz.gift").string();
+  write_file(file, gift);
+
+  // Without --context, the last category is topped up in place
+  GiftAppendPlan plan = plan_gift_append(file, 5, "");
+  CHECK(!plan.new_category);
+  CHECK(plan.existing == 2);
+  CHECK(plan.missing == 3);
+  CHECK(plan.titles == (std::vector<std::string>{"Q2", "Q3"}));
+  CHECK(plan.bank.size() == 3);
+  CHECK(plan.separator == "\n");
+
+  // An earlier category is named again; a full one needs nothing
+  plan = plan_gift_append(file, 1, "A");
+  CHECK(plan.new_category);
+  CHECK(plan.existing == 1);
+  CHECK(plan.missing == 0);
+
+  plan = plan_gift_append(file, 2, "C");
+  CHECK(plan.new_category);
+  CHECK(plan.existing == 0);
+  CHECK(plan.missing == 2);
+  CHECK(plan.titles.empty());
+
+  // The separator leaves exactly one blank line before the new questions
+  write_file(file, gift + "\n");
+  CHECK(plan_gift_append(file, 5, "").separator.empty());
+  write_file(file, gift.substr(0, gift.size() - 1));
+  CHECK(plan_gift_append(file, 5, "").separator == "\n\n");
+
+  plan = plan_gift_append((directory / "new.gift").string(), 4, "");
+  CHECK(plan.new_category);
+  CHECK(plan.missing == 4);
+  CHECK(plan.bank.empty());
+  CHECK(plan.separator.empty());
+}
+
+void test_question_index()
+{
+  const Question original{"Sets",
+                          "Which of these sets is the intersection of the "
+                          "set of even numbers and the set of primes?",
+                          {"The empty set", "The set of two", "All primes"},
+                          1,
+                          ""};
+  Question paraphrase = original;
+  paraphrase.question = "Which of these sets is the intersection of the set "
+                        "of even numbers and the set of prime numbers?";
+  const Question other{"Graphs",
+                       "How many edges has a complete graph on five vertices?",
+                       {"Five", "Ten", "Twenty"},
+                       1,
+                       ""};
+
+  QuestionIndex index;
+  CHECK(index.add(original));
+  CHECK(!index.add(original));
+
+  // Later questions are also compared with those kept before them
+  std::vector<Question> questions = {paraphrase, other, other};
+  CHECK(index.remove_similar(questions) == 2);
+  CHECK(questions.size() == 1);
+  CHECK(!questions.empty() && questions[0].title == "Graphs");
+  CHECK(index.size() == 2);
+
+  // Saved signatures are read back by a later index
+  TemporaryDirectory directory;
+  const std::filesystem::path path = directory / "questions.idx";
+  {
+    QuestionIndex saved(path);
+    saved.add(original);
+    saved.save();
+    saved.add(other);
+    saved.save();
+  }
+  QuestionIndex loaded(path);
+  CHECK(loaded.size() == 2);
+  CHECK(!loaded.add(paraphrase));
+
+  write_file(path, "not an index");
+  bool threw = false;
+  try
+  {
+    QuestionIndex corrupt(path);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+void test_plan_document_groups()
+{
+  // Small documents are grouped until a group is as long as a large one
+  const std::vector<std::string> ids = {"a", "b", "c", "d", "e"};
+  const std::vector<double> pages = {10, 1, 2, 3, 20};
+  std::vector<DocumentGroup> groups = plan_document_groups(ids, pages, 10);
+  CHECK(groups.size() == 3);
+  if (groups.size() == 3)
+  {
+    CHECK(groups[0].file_ids == std::vector<std::string>{"a"});
+    CHECK((groups[1].file_ids == std::vector<std::string>{"b", "c", "d"}));
+    CHECK(groups[2].file_ids == std::vector<std::string>{"e"});
+    CHECK(groups[1].pages == 6);
+    // One each, then 7 shared by largest remainder of 10:6:20
+    CHECK(groups[0].num_questions == 3);
+    CHECK(groups[1].num_questions == 2);
+    CHECK(groups[2].num_questions == 5);
+  }
+
+  // With fewer questions than groups, those given none are dropped
+  groups = plan_document_groups(ids, pages, 2);
+  CHECK(groups.size() == 2);
+  if (groups.size() == 2)
+  {
+    CHECK(groups[0].file_ids == std::vector<std::string>{"a"});
+    CHECK(groups[1].file_ids == std::vector<std::string>{"e"});
+    CHECK(groups[0].num_questions == 1 && groups[1].num_questions == 1);
+  }
+
+  int total = 0;
+  for (const auto &group : plan_document_groups(ids, pages, 37))
+    total += group.num_questions;
+  CHECK(total == 37);
+}
+
+const char *const STREAMED_QUIZ =
+    R"({"category": "Sets {1}", "questions": [)"
+    R"({"title": "T1", "question": "Is {a} \"quoted\"?",)"
+    R"( "options": ["x", "y]", "z}"], "correct_answer": 1},)"
+    R"( {"title": "T2", "question": "Two\n\\lines", "hint": {"title": "no"},)"
+    R"( "options": ["p", "q"], "correct_answer": 0}]})";
+
+void check_streamed_quiz(const std::string &category,
+                         const std::vector<Question> &questions)
+{
+  CHECK(category == "Sets {1}");
+  CHECK(questions.size() == 2);
+  if (questions.size() != 2)
+    return;
+  CHECK(questions[0].title == "T1");
+  CHECK(questions[0].question == "Is {a} \"quoted\"?");
+  CHECK((questions[0].options == std::vector<std::string>{"x", "y]", "z}"}));
+  CHECK(questions[0].correct_answer == 1);
+  CHECK(questions[1].title == "T2");
+  CHECK(questions[1].question == "Two\n\\lines");
+  CHECK(questions[1].correct_answer == 0);
+}
+
+void test_quiz_stream_parser(std::mt19937 &random)
+{
+  // The text arrives in chunks split anywhere, including within strings and
+  // escapes; one byte at a time, then at random
+  const std::string text = STREAMED_QUIZ;
+  for (int round = 0; round < 200; ++round)
+  {
+    std::string category;
+    std::vector<Question> questions;
+    QuizStreamParser parser;
+    parser.on_category = [&](const std::string &name) { category = name; };
+    parser.on_question = [&](Question &question)
+    { questions.push_back(std::move(question)); };
+    for (size_t at = 0; at < text.size();)
+    {
+      const size_t size = round == 0 ? 1 : 1 + random() % 16;
+      parser.feed(text.substr(at, size));
+      at += size;
+    }
+    check_streamed_quiz(category, questions);
+  }
+}
+
+void test_decode_quiz_response()
+{
+  // The quiz as the model's text, as the whole response, or as the part
+  const json quiz = json::parse(STREAMED_QUIZ);
+  json response;
+  response["candidates"][0]["content"]["parts"][0]["text"] = quiz.dump();
+  response["usageMetadata"] = {{"promptTokenCount", 10}};
+  json part;
+  part["candidates"][0]["content"]["parts"][0] = quiz;
+
+  for (const json &body : {response, quiz, part})
+  {
+    const Quiz decoded = decode_quiz_response(body.dump(), false);
+    check_streamed_quiz(decoded.category, decoded.questions);
+  }
+
+  bool threw = false;
+  try
+  {
+    decode_quiz_response(R"({"error": {"code": 429, "message": "Quota",)"
+                         R"( "status": "RESOURCE_EXHAUSTED"}})",
+                         false);
+  }
+  catch (const GeminiApiError &error)
+  {
+    threw = std::string(error.what()) ==
+            "Gemini API Error 429: Quota (Status: RESOURCE_EXHAUSTED)";
+  }
+  CHECK(threw);
+
+  threw = false;
+  try
+  {
+    decode_quiz_response(R"({"questions": [{"title": )", false);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+void test_upload_cache()
+{
+  TemporaryDirectory directory;
+  const std::filesystem::path path = directory / "uploads.json";
+  const int64_t now = unix_time_now();
+
+  // Entries within the margin of their expiry are not offered
+  {
+    UploadCache cache(path, 60);
+    cache.store("live", {"f1", now + 3600});
+    cache.store("soon", {"f2", now + 30});
+    cache.store("gone", {"f3", now - 10});
+    CHECK(cache.lookup("live") && cache.lookup("live")->file_id == "f1");
+    CHECK(!cache.lookup("soon"));
+    CHECK(cache.offers("f1") && !cache.offers("f2"));
+    cache.save();
+  }
+  {
+    // Expired entries are dropped when saved
+    UploadCache cache(path, 0);
+    CHECK(cache.lookup("live") && cache.lookup("soon"));
+    CHECK(!cache.lookup("gone"));
+    std::ifstream file(path);
+    CHECK(!json::parse(file).contains("gone"));
+    cache.forget({"f1"});
+    cache.save();
+  }
+  CHECK(!UploadCache(path, 0).lookup("live"));
+
+  // A corrupt file reads as empty, and entries of the wrong shape are skipped
+  write_file(path, "{\"live\": {\"file_id\": ");
+  CHECK(!UploadCache(path, 0).lookup("live"));
+  write_file(path, R"({"a": {"file_id": 3, "expiry": 1}, "b": "x", )"
+                   R"("c": {"file_id": "fc", "expiry": )" +
+                       std::to_string(now + 3600) + "}}");
+  UploadCache cache(path, 0);
+  CHECK(!cache.lookup("a") && !cache.lookup("b"));
+  CHECK(cache.lookup("c") && cache.lookup("c")->file_id == "fc");
+}
+
+void test_retry_scheduler()
+{
+  using std::chrono::milliseconds;
+
+  // Retry-After is given in seconds or as an HTTP date, or in the body
+  CHECK(get_retry_after({{"retry-after", "7"}}) == milliseconds(7000));
+  CHECK(get_retry_after({{"retry-after", "Wed, 21 Oct 2015 07:28:00 GMT"}}) ==
+        milliseconds(0));
+  const std::string body = R"([{"error": {"details": [{"@type": "RetryInfo",)"
+                           R"( "retryDelay": "0.5s"}]}}])";
+  CHECK(get_retry_after({}, body) == milliseconds(500));
+  CHECK(get_retry_after({}, "not json") == milliseconds(0));
+
+  // The budget is shared by every request, and the delay is at least the
+  // server's Retry-After
+  RetryPolicy policy;
+  policy.max_retries = 2;
+  policy.base_delay = milliseconds(1);
+  policy.max_delay = milliseconds(2);
+  RetryScheduler retry(policy, true);
+  const auto start = std::chrono::steady_clock::now();
+  CHECK(retry.wait_before_retry("Request", "HTTP 503", milliseconds(50)));
+  CHECK(std::chrono::steady_clock::now() - start >= milliseconds(50));
+  CHECK(retry.wait_before_retry("Request", "HTTP 503"));
+  CHECK(!retry.wait_before_retry("Request", "HTTP 503"));
+
+  // No retry is waited for past the deadline
+  policy.max_retries = 5;
+  policy.deadline = std::chrono::seconds(1);
+  RetryScheduler bounded(policy, true);
+  CHECK(!bounded.wait_before_retry("Request", "HTTP 429", milliseconds(5000)));
+  CHECK(bounded.wait_before_retry("Request", "HTTP 429"));
+}
+
+} // namespace
+
+int main()
+{
+  std::mt19937 random(14);
+  test_base64(random);
+  test_find_gift_special(random);
+  test_gift_round_trip();
+  test_gift_parser_errors();
+  test_plan_gift_append();
+  test_question_index();
+  test_plan_document_groups();
+  test_quiz_stream_parser(random);
+  test_decode_quiz_response();
+  test_upload_cache();
+  test_retry_scheduler();
+
+  if (failures > 0)
+  {
+    std::cerr << failures << " checks failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return EXIT_SUCCESS;
+}